@@ -0,0 +1,87 @@
+#ifndef USER_THREAD_BENCHMARK_HPP
+#define USER_THREAD_BENCHMARK_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "user-thread.hpp"
+
+namespace bench {
+
+using orks::userthread::WorkerManager;
+
+struct BenchmarkOptions {
+    // smaller inputs for a quick check of the suite
+    bool small = false;
+};
+
+/*
+ * one workload of the suite.
+ * prepare() and verify() are called on the driver thread, run() on a user thread of wm.
+ * only run() is timed.
+ */
+struct Benchmark {
+    std::string name;
+    // problem size, reported as is
+    std::string parameters;
+    std::function<void()> prepare;
+    std::function<void(WorkerManager& wm)> run;
+    std::function<bool()> verify;
+};
+
+Benchmark make_fib_benchmark(const BenchmarkOptions& options);
+Benchmark make_fib_lazy_benchmark(const BenchmarkOptions& options);
+Benchmark make_nqueens_benchmark(const BenchmarkOptions& options);
+Benchmark make_uts_benchmark(const BenchmarkOptions& options);
+Benchmark make_sparselu_benchmark(const BenchmarkOptions& options);
+Benchmark make_sort_benchmark(const BenchmarkOptions& options);
+Benchmark make_matmul_benchmark(const BenchmarkOptions& options);
+Benchmark make_strassen_benchmark(const BenchmarkOptions& options);
+
+// deterministic pseudo random numbers for inputs
+inline std::uint64_t splitmix64(std::uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// in [-1, 1)
+inline double random_double(std::uint64_t seed) {
+    return static_cast<double>(splitmix64(seed) >> 11) / (1ull << 52) - 1.0;
+}
+
+/*
+ * check C == A * B of n x n row major matrices with a random vector, in O(n^2).
+ */
+inline bool verify_product(const std::vector<double>& a, const std::vector<double>& b, const std::vector<double>& c,
+                           std::size_t n) {
+    std::vector<double> x(n), bx(n, 0.0);
+    for (std::size_t i = 0; i < n; ++i) {
+        x[i] = random_double(i + 12345);
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+        for (std::size_t j = 0; j < n; ++j) {
+            bx[i] += b[i * n + j] * x[j];
+        }
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+        double expected = 0.0;
+        double actual = 0.0;
+        for (std::size_t j = 0; j < n; ++j) {
+            expected += a[i * n + j] * bx[j];
+            actual += c[i * n + j] * x[j];
+        }
+        if (std::abs(expected - actual) > 1e-9 * n * n) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+#endif //USER_THREAD_BENCHMARK_HPP
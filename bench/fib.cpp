@@ -0,0 +1,95 @@
+#include <memory>
+
+#include "benchmark.hpp"
+
+namespace bench {
+
+namespace {
+
+long fib_serial(int n) {
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+long fib(WorkerManager& wm, int n, int cutoff) {
+    if (n < cutoff) {
+        return fib_serial(n);
+    }
+    long x = 0;
+    orks::userthread::TaskGroup group(wm);
+    group.run([&wm, &x, n, cutoff]() {
+        x = fib(wm, n - 1, cutoff);
+    });
+    const long y = fib(wm, n - 2, cutoff);
+    group.wait();
+    return x + y;
+}
+
+// the child is made into a user thread only if it is stolen
+long fib_lazy(WorkerManager& wm, int n, int cutoff) {
+    if (n < cutoff) {
+        return fib_serial(n);
+    }
+    long x = 0, y = 0;
+    orks::userthread::detail::parallel_invoke(wm, [&wm, &x, n, cutoff]() {
+        x = fib_lazy(wm, n - 1, cutoff);
+    }, [&wm, &y, n, cutoff]() {
+        y = fib_lazy(wm, n - 2, cutoff);
+    });
+    return x + y;
+}
+
+long fib_answer(int n) {
+    long a = 0, b = 1;
+    for (int i = 0; i < n; ++i) {
+        const long next = a + b;
+        a = b;
+        b = next;
+    }
+    return a;
+}
+
+}
+
+Benchmark make_fib_benchmark(const BenchmarkOptions& options) {
+    const int n = options.small ? 25 : 32;
+    // the leaves are still tiny, so spawning dominates
+    const int cutoff = 12;
+    auto result = std::make_shared<long>(0);
+
+    Benchmark benchmark;
+    benchmark.name = "fib";
+    benchmark.parameters = "n=" + std::to_string(n) + " cutoff=" + std::to_string(cutoff);
+    benchmark.prepare = [result]() {
+        *result = 0;
+    };
+    benchmark.run = [result, n, cutoff](WorkerManager & wm) {
+        *result = fib(wm, n, cutoff);
+    };
+    benchmark.verify = [result, n]() {
+        return *result == fib_answer(n);
+    };
+    return benchmark;
+}
+
+Benchmark make_fib_lazy_benchmark(const BenchmarkOptions& options) {
+    Benchmark benchmark;
+    const int n = options.small ? 25 : 32;
+    // the same as fib, to compare the cost of spawns
+    const int cutoff = 12;
+    auto result = std::make_shared<long>(0);
+
+    benchmark.name = "fib_lazy";
+    benchmark.parameters = "n=" + std::to_string(n) + " cutoff=" + std::to_string(cutoff);
+    benchmark.prepare = [result]() {
+        *result = 0;
+    };
+    benchmark.run = [result, n, cutoff](WorkerManager & wm) {
+        *result = fib_lazy(wm, n, cutoff);
+    };
+    benchmark.verify = [result, n]() {
+        return *result == fib_answer(n);
+    };
+    return benchmark;
+}
+
+}
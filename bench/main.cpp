@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark.hpp"
+
+using namespace bench;
+using orks::userthread::SchedulerCounters;
+
+namespace {
+
+struct Options {
+    std::vector<unsigned> workers;
+    std::vector<std::string> benchmarks;
+    unsigned repeat = 3;
+    bool json = false;
+    BenchmarkOptions benchmark_options;
+};
+
+struct Result {
+    std::string name;
+    std::string parameters;
+    unsigned workers;
+    // the fastest of the repeats
+    double seconds;
+    double speedup;
+    double efficiency;
+    // of the fastest run
+    SchedulerCounters counters;
+    bool verified;
+};
+
+std::vector<std::string> split(const std::string& s) {
+    std::vector<std::string> items;
+    std::istringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+void usage() {
+    std::cerr <<
+              "usage: bench [--workers 1,2,4 | --max-workers N] [--benchmarks fib,sort] [--repeat R]\n"
+              "             [--format csv|json] [--small]\n"
+              "runs each benchmark with each number of workers, and prints the fastest of R runs.\n"
+              "default: 1..number of cpu cores workers, all benchmarks, 3 repeats, csv.\n"
+              "speedup and efficiency are relative to the first number of workers.\n"
+              "benchmarks: fib fib_lazy nqueens uts sparselu sort matmul strassen\n";
+}
+
+Options parse_options(int argc, char** argv) {
+    Options options;
+    unsigned max_workers = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument(arg + " requires a value");
+            }
+            return std::string(argv[++i]);
+        };
+        if (arg == "--workers") {
+            for (const auto& w : split(value())) {
+                options.workers.push_back(std::stoul(w));
+            }
+        } else if (arg == "--max-workers") {
+            max_workers = std::stoul(value());
+        } else if (arg == "--benchmarks") {
+            options.benchmarks = split(value());
+        } else if (arg == "--repeat") {
+            options.repeat = std::max(1ul, std::stoul(value()));
+        } else if (arg == "--format") {
+            const auto format = value();
+            if (format != "csv" && format != "json") {
+                throw std::invalid_argument("unknown format: " + format);
+            }
+            options.json = format == "json";
+        } else if (arg == "--small") {
+            options.benchmark_options.small = true;
+        } else {
+            throw std::invalid_argument("unknown option: " + arg);
+        }
+    }
+    if (options.workers.empty()) {
+        for (unsigned w = 1; w <= max_workers; ++w) {
+            options.workers.push_back(w);
+        }
+    }
+    if (std::find(options.workers.begin(), options.workers.end(), 0u) != options.workers.end()) {
+        throw std::invalid_argument("number of workers must be positive");
+    }
+    return options;
+}
+
+std::vector<Benchmark> make_benchmarks(const Options& options) {
+    std::vector<Benchmark> all {
+        make_fib_benchmark(options.benchmark_options),
+        make_fib_lazy_benchmark(options.benchmark_options),
+        make_nqueens_benchmark(options.benchmark_options),
+        make_uts_benchmark(options.benchmark_options),
+        make_sparselu_benchmark(options.benchmark_options),
+        make_sort_benchmark(options.benchmark_options),
+        make_matmul_benchmark(options.benchmark_options),
+        make_strassen_benchmark(options.benchmark_options),
+    };
+    if (options.benchmarks.empty()) {
+        return all;
+    }
+
+    std::vector<Benchmark> selected;
+    for (const auto& name : options.benchmarks) {
+        auto it = std::find_if(all.begin(), all.end(), [&name](const Benchmark & b) {
+            return b.name == name;
+        });
+        if (it == all.end()) {
+            throw std::invalid_argument("unknown benchmark: " + name);
+        }
+        selected.push_back(*it);
+    }
+    return selected;
+}
+
+SchedulerCounters operator-(const SchedulerCounters& a, const SchedulerCounters& b) {
+    SchedulerCounters d;
+    d.steals = a.steals - b.steals;
+    d.switches = a.switches - b.switches;
+    return d;
+}
+
+Result measure(WorkerManager& wm, unsigned workers, Benchmark& benchmark, unsigned repeat) {
+    Result result { benchmark.name, benchmark.parameters, workers, 0.0, 0.0, 0.0, {}, true };
+    for (unsigned r = 0; r < repeat; ++r) {
+        benchmark.prepare();
+
+        const auto before = wm.get_scheduler_counters();
+        const auto start = std::chrono::steady_clock::now();
+        orks::userthread::detail::run(wm, [&wm, &benchmark]() {
+            benchmark.run(wm);
+        }).get();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        const auto counters = wm.get_scheduler_counters() - before;
+
+        result.verified = result.verified && benchmark.verify();
+        if (r == 0 || elapsed.count() < result.seconds) {
+            result.seconds = elapsed.count();
+            result.counters = counters;
+        }
+    }
+    return result;
+}
+
+void print_csv(const std::vector<Result>& results) {
+    std::cout << "benchmark,parameters,workers,seconds,speedup,efficiency,steals,switches,verified\n";
+    for (const auto& r : results) {
+        std::cout << r.name << ",\"" << r.parameters << "\"," << r.workers << "," << r.seconds << ","
+                  << r.speedup << "," << r.efficiency << "," << r.counters.steals << "," << r.counters.switches << ","
+                  << (r.verified ? "true" : "false") << "\n";
+    }
+}
+
+void print_json(const std::vector<Result>& results) {
+    std::cout << "[\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const auto& r = results[i];
+        std::cout << "  {\"benchmark\": \"" << r.name << "\", \"parameters\": \"" << r.parameters
+                  << "\", \"workers\": " << r.workers << ", \"seconds\": " << r.seconds
+                  << ", \"speedup\": " << r.speedup << ", \"efficiency\": " << r.efficiency
+                  << ", \"steals\": " << r.counters.steals << ", \"switches\": " << r.counters.switches
+                  << ", \"verified\": " << (r.verified ? "true" : "false") << "}"
+                  << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    std::cout << "]\n";
+}
+
+}
+
+/*
+ * task parallel benchmarks in the style of BOTS, swept over the number of workers.
+ * progress goes to stderr, and results to stdout.
+ * exits with 1 if a result was wrong.
+ */
+int main(int argc, char** argv) {
+
+    try {
+        const Options options = parse_options(argc, argv);
+        auto benchmarks = make_benchmarks(options);
+
+        std::vector<Result> results;
+        for (unsigned workers : options.workers) {
+            WorkerManager wm { workers };
+            for (auto& benchmark : benchmarks) {
+                std::cerr << benchmark.name << " with " << workers << " workers" << std::endl;
+                results.push_back(measure(wm, workers, benchmark, options.repeat));
+            }
+        }
+
+        const unsigned base_workers = options.workers.front();
+        bool all_verified = true;
+        for (auto& r : results) {
+            const auto base = std::find_if(results.begin(), results.end(), [&r, base_workers](const Result & b) {
+                return b.name == r.name && b.workers == base_workers;
+            });
+            r.speedup = base->seconds / r.seconds;
+            r.efficiency = r.speedup * base_workers / r.workers;
+            all_verified = all_verified && r.verified;
+        }
+
+        std::cout << std::setprecision(6);
+        if (options.json) {
+            print_json(results);
+        } else {
+            print_csv(results);
+        }
+        return all_verified ? 0 : 1;
+
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 1;
+    }
+}
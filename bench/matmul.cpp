@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "benchmark.hpp"
+
+namespace bench {
+
+namespace {
+
+constexpr std::size_t matmul_cutoff = 32;
+
+// C += A * B of n x n blocks in row major matrices with leading dimension ld
+void multiply_add_serial(const double* a, const double* b, double* c, std::size_t n, std::size_t ld) {
+    for (std::size_t i = 0; i < n; ++i) {
+        for (std::size_t k = 0; k < n; ++k) {
+            const double aik = a[i * ld + k];
+            for (std::size_t j = 0; j < n; ++j) {
+                c[i * ld + j] += aik * b[k * ld + j];
+            }
+        }
+    }
+}
+
+/*
+ * divide and conquer over quadrants, after matmul of the Cilk examples.
+ * the four products of each half are independent, and the halves are ordered.
+ */
+void multiply_add(WorkerManager& wm, const double* a, const double* b, double* c, std::size_t n, std::size_t ld) {
+    if (n <= matmul_cutoff) {
+        multiply_add_serial(a, b, c, n, ld);
+        return;
+    }
+
+    const std::size_t h = n / 2;
+    auto quadrant = [h, ld](auto* m, int i, int j) {
+        return m + i * h * ld + j * h;
+    };
+    for (int k = 0; k < 2; ++k) {
+        orks::userthread::TaskGroup group(wm);
+        for (int i = 0; i < 2; ++i) {
+            for (int j = 0; j < 2; ++j) {
+                double* cij = quadrant(c, i, j);
+                const double* aik = quadrant(a, i, k);
+                const double* bkj = quadrant(b, k, j);
+                if (i == 1 && j == 1) {
+                    multiply_add(wm, aik, bkj, cij, h, ld);
+                } else {
+                    group.run([&wm, aik, bkj, cij, h, ld]() {
+                        multiply_add(wm, aik, bkj, cij, h, ld);
+                    });
+                }
+            }
+        }
+        group.wait();
+    }
+}
+
+}
+
+Benchmark make_matmul_benchmark(const BenchmarkOptions& options) {
+    const std::size_t n = options.small ? 128 : 1024;
+    auto a = std::make_shared<std::vector<double>>(n * n);
+    auto b = std::make_shared<std::vector<double>>(n * n);
+    auto c = std::make_shared<std::vector<double>>(n * n);
+
+    Benchmark benchmark;
+    benchmark.name = "matmul";
+    benchmark.parameters = "n=" + std::to_string(n) + " cutoff=" + std::to_string(matmul_cutoff);
+    benchmark.prepare = [a, b, c, n]() {
+        for (std::size_t i = 0; i < n * n; ++i) {
+            (*a)[i] = random_double(i);
+            (*b)[i] = random_double(i + n * n);
+        }
+        std::fill(c->begin(), c->end(), 0.0);
+    };
+    benchmark.run = [a, b, c, n](WorkerManager & wm) {
+        multiply_add(wm, a->data(), b->data(), c->data(), n, n);
+    };
+    benchmark.verify = [a, b, c, n]() {
+        return verify_product(*a, *b, *c, n);
+    };
+    return benchmark;
+}
+
+}
@@ -0,0 +1,78 @@
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "benchmark.hpp"
+
+namespace bench {
+
+namespace {
+
+// columns and diagonals are bit masks of the queens placed in the rows above
+long nqueens_serial(std::uint32_t all, std::uint32_t columns, std::uint32_t left, std::uint32_t right) {
+    if (columns == all) {
+        return 1;
+    }
+    long count = 0;
+    std::uint32_t free = all & ~(columns | left | right);
+    while (free) {
+        const std::uint32_t bit = free & -free;
+        free ^= bit;
+        count += nqueens_serial(all, columns | bit, (left | bit) << 1, (right | bit) >> 1);
+    }
+    return count;
+}
+
+long nqueens(WorkerManager& wm, int depth, int cutoff, std::uint32_t all,
+             std::uint32_t columns, std::uint32_t left, std::uint32_t right) {
+    if (depth >= cutoff) {
+        return nqueens_serial(all, columns, left, right);
+    }
+
+    // reserved, so that children can keep pointers to their counts
+    std::vector<long> counts;
+    counts.reserve(32);
+    orks::userthread::TaskGroup group(wm);
+    std::uint32_t free = all & ~(columns | left | right);
+    while (free) {
+        const std::uint32_t bit = free & -free;
+        free ^= bit;
+        counts.push_back(0);
+        long* count = &counts.back();
+        group.run([=, &wm]() {
+            *count = nqueens(wm, depth + 1, cutoff, all, columns | bit, (left | bit) << 1, (right | bit) >> 1);
+        });
+    }
+    group.wait();
+
+    long count = 0;
+    for (long c : counts) {
+        count += c;
+    }
+    return count;
+}
+
+}
+
+Benchmark make_nqueens_benchmark(const BenchmarkOptions& options) {
+    const int n = options.small ? 10 : 13;
+    const int cutoff = 4;
+    auto result = std::make_shared<long>(0);
+
+    Benchmark benchmark;
+    benchmark.name = "nqueens";
+    benchmark.parameters = "n=" + std::to_string(n) + " cutoff=" + std::to_string(cutoff);
+    benchmark.prepare = [result]() {
+        *result = 0;
+    };
+    benchmark.run = [result, n, cutoff](WorkerManager & wm) {
+        *result = nqueens(wm, 0, cutoff, (1u << n) - 1, 0, 0, 0);
+    };
+    benchmark.verify = [result, n]() {
+        // https://oeis.org/A000170
+        return *result == (n == 10 ? 724 : 73712);
+    };
+    return benchmark;
+}
+
+}
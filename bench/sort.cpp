@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "benchmark.hpp"
+
+namespace bench {
+
+namespace {
+
+/*
+ * merge sort with a parallel merge, after cilksort of BOTS.
+ */
+constexpr std::size_t sort_cutoff = 4096;
+constexpr std::size_t merge_cutoff = 4096;
+
+// merge sorted [a, a + na) and [b, b + nb) into out
+void merge(WorkerManager& wm, const int* a, std::size_t na, const int* b, std::size_t nb, int* out) {
+    if (na < nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    if (na + nb < merge_cutoff || nb == 0) {
+        std::merge(a, a + na, b, b + nb, out);
+        return;
+    }
+
+    // split at the middle of the longer one
+    const std::size_t ma = na / 2;
+    const std::size_t mb = std::lower_bound(b, b + nb, a[ma]) - b;
+    out[ma + mb] = a[ma];
+
+    orks::userthread::TaskGroup group(wm);
+    group.run([&wm, a, ma, b, mb, out]() {
+        merge(wm, a, ma, b, mb, out);
+    });
+    merge(wm, a + ma + 1, na - ma - 1, b + mb, nb - mb, out + ma + mb + 1);
+    group.wait();
+}
+
+/*
+ * sort [src, src + n). the result is in dst if into_dst, or in src.
+ * the halves are sorted into the other buffer, and merged back.
+ */
+void sort(WorkerManager& wm, int* src, int* dst, std::size_t n, bool into_dst) {
+    if (n < sort_cutoff) {
+        std::sort(src, src + n);
+        if (into_dst) {
+            std::copy(src, src + n, dst);
+        }
+        return;
+    }
+
+    const std::size_t half = n / 2;
+    {
+        orks::userthread::TaskGroup group(wm);
+        group.run([&wm, src, dst, half, into_dst]() {
+            sort(wm, src, dst, half, !into_dst);
+        });
+        sort(wm, src + half, dst + half, n - half, !into_dst);
+        group.wait();
+    }
+
+    int* from = into_dst ? src : dst;
+    int* to = into_dst ? dst : src;
+    merge(wm, from, half, from + half, n - half, to);
+}
+
+}
+
+Benchmark make_sort_benchmark(const BenchmarkOptions& options) {
+    const std::size_t n = options.small ? (1u << 18) : (1u << 23);
+    auto data = std::make_shared<std::vector<int>>(n);
+    auto buffer = std::make_shared<std::vector<int>>(n);
+    auto sum = std::make_shared<long long>(0);
+
+    Benchmark benchmark;
+    benchmark.name = "sort";
+    benchmark.parameters = "n=" + std::to_string(n);
+    benchmark.prepare = [data, sum, n]() {
+        *sum = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            (*data)[i] = static_cast<int>(splitmix64(i));
+            *sum += (*data)[i];
+        }
+    };
+    benchmark.run = [data, buffer, n](WorkerManager & wm) {
+        sort(wm, data->data(), buffer->data(), n, false);
+    };
+    benchmark.verify = [data, sum]() {
+        long long s = 0;
+        for (int x : *data) {
+            s += x;
+        }
+        return s == *sum && std::is_sorted(data->begin(), data->end());
+    };
+    return benchmark;
+}
+
+}
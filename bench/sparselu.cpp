@@ -0,0 +1,218 @@
+#include <memory>
+#include <vector>
+
+#include "benchmark.hpp"
+
+namespace bench {
+
+namespace {
+
+/*
+ * LU factorization of a sparse block matrix, after SparseLU of BOTS.
+ * blocks are dense bs x bs, and null blocks are allocated when they fill in.
+ */
+class BlockMatrix {
+    std::size_t nb;
+    std::size_t bs;
+    std::vector<std::unique_ptr<float[]>> blocks;
+
+public:
+    BlockMatrix(std::size_t nb, std::size_t bs) :
+        nb(nb), bs(bs), blocks(nb * nb) {
+    }
+
+    std::size_t get_number_of_blocks() const {
+        return nb;
+    }
+
+    std::size_t get_block_size() const {
+        return bs;
+    }
+
+    float* block(std::size_t i, std::size_t j) const {
+        return blocks[i * nb + j].get();
+    }
+
+    float* allocate_block(std::size_t i, std::size_t j) {
+        blocks[i * nb + j].reset(new float[bs * bs]());
+        return block(i, j);
+    }
+
+    // the same null pattern and values as genmat() of BOTS
+    void generate() {
+        for (std::size_t ii = 0; ii < nb; ++ii) {
+            for (std::size_t jj = 0; jj < nb; ++jj) {
+                bool null_entry = false;
+                if (ii < jj && ii % 3 != 0) {
+                    null_entry = true;
+                }
+                if (ii > jj && jj % 3 != 0) {
+                    null_entry = true;
+                }
+                if (ii % 2 == 1) {
+                    null_entry = true;
+                }
+                if (jj % 2 == 1) {
+                    null_entry = true;
+                }
+                if (ii == jj || ii == jj - 1 || ii - 1 == jj) {
+                    null_entry = false;
+                }
+                if (ii == jj - 2 || ii - 2 == jj) {
+                    null_entry = false;
+                }
+
+                blocks[ii * nb + jj].reset();
+                if (!null_entry) {
+                    float* p = allocate_block(ii, jj);
+                    std::uint64_t seed = ii * nb + jj;
+                    for (std::size_t k = 0; k < bs * bs; ++k) {
+                        p[k] = static_cast<float>(random_double(seed * bs * bs + k) * 2.0);
+                    }
+                }
+            }
+        }
+    }
+
+    bool operator==(const BlockMatrix& other) const {
+        for (std::size_t k = 0; k < nb * nb; ++k) {
+            const float* a = blocks[k].get();
+            const float* b = other.blocks[k].get();
+            if (!a != !b) {
+                return false;
+            }
+            for (std::size_t e = 0; a && e < bs * bs; ++e) {
+                if (a[e] != b[e]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+void lu0(float* diag, std::size_t bs) {
+    for (std::size_t k = 0; k < bs; ++k) {
+        for (std::size_t i = k + 1; i < bs; ++i) {
+            diag[i * bs + k] = diag[i * bs + k] / diag[k * bs + k];
+            for (std::size_t j = k + 1; j < bs; ++j) {
+                diag[i * bs + j] = diag[i * bs + j] - diag[i * bs + k] * diag[k * bs + j];
+            }
+        }
+    }
+}
+
+void bdiv(const float* diag, float* row, std::size_t bs) {
+    for (std::size_t i = 0; i < bs; ++i) {
+        for (std::size_t k = 0; k < bs; ++k) {
+            row[i * bs + k] = row[i * bs + k] / diag[k * bs + k];
+            for (std::size_t j = k + 1; j < bs; ++j) {
+                row[i * bs + j] = row[i * bs + j] - row[i * bs + k] * diag[k * bs + j];
+            }
+        }
+    }
+}
+
+void bmod(const float* row, const float* col, float* inner, std::size_t bs) {
+    for (std::size_t i = 0; i < bs; ++i) {
+        for (std::size_t j = 0; j < bs; ++j) {
+            for (std::size_t k = 0; k < bs; ++k) {
+                inner[i * bs + j] = inner[i * bs + j] - row[i * bs + k] * col[k * bs + j];
+            }
+        }
+    }
+}
+
+void fwd(const float* diag, float* col, std::size_t bs) {
+    for (std::size_t j = 0; j < bs; ++j) {
+        for (std::size_t k = 0; k < bs; ++k) {
+            for (std::size_t i = k + 1; i < bs; ++i) {
+                col[i * bs + j] = col[i * bs + j] - diag[i * bs + k] * col[k * bs + j];
+            }
+        }
+    }
+}
+
+/*
+ * spawn(fn) runs fn as a task, and sync() waits all of them.
+ * each block is updated by one task per phase, so the result does not depend on the schedule.
+ */
+template <typename Spawn, typename Sync>
+void sparselu(BlockMatrix& m, Spawn spawn, Sync sync) {
+    const std::size_t nb = m.get_number_of_blocks();
+    const std::size_t bs = m.get_block_size();
+    for (std::size_t kk = 0; kk < nb; ++kk) {
+        lu0(m.block(kk, kk), bs);
+
+        for (std::size_t jj = kk + 1; jj < nb; ++jj) {
+            if (m.block(kk, jj)) {
+                spawn([&m, kk, jj, bs]() {
+                    fwd(m.block(kk, kk), m.block(kk, jj), bs);
+                });
+            }
+        }
+        for (std::size_t ii = kk + 1; ii < nb; ++ii) {
+            if (m.block(ii, kk)) {
+                spawn([&m, kk, ii, bs]() {
+                    bdiv(m.block(kk, kk), m.block(ii, kk), bs);
+                });
+            }
+        }
+        sync();
+
+        for (std::size_t ii = kk + 1; ii < nb; ++ii) {
+            if (!m.block(ii, kk)) {
+                continue;
+            }
+            for (std::size_t jj = kk + 1; jj < nb; ++jj) {
+                if (!m.block(kk, jj)) {
+                    continue;
+                }
+                // allocated before the task, so that tasks never write the block table
+                float* inner = m.block(ii, jj) ? m.block(ii, jj) : m.allocate_block(ii, jj);
+                spawn([&m, kk, ii, jj, bs, inner]() {
+                    bmod(m.block(ii, kk), m.block(kk, jj), inner, bs);
+                });
+            }
+        }
+        sync();
+    }
+}
+
+}
+
+Benchmark make_sparselu_benchmark(const BenchmarkOptions& options) {
+    const std::size_t nb = options.small ? 20 : 50;
+    const std::size_t bs = options.small ? 16 : 32;
+    auto matrix = std::make_shared<BlockMatrix>(nb, bs);
+    auto expected = std::make_shared<std::unique_ptr<BlockMatrix>>();
+
+    Benchmark benchmark;
+    benchmark.name = "sparselu";
+    benchmark.parameters = "blocks=" + std::to_string(nb) + "x" + std::to_string(nb) + " block_size=" + std::to_string(bs);
+    benchmark.prepare = [matrix]() {
+        matrix->generate();
+    };
+    benchmark.run = [matrix](WorkerManager & wm) {
+        orks::userthread::TaskGroup group(wm);
+        sparselu(*matrix, [&group](std::function<void()> fn) {
+            group.run(std::move(fn));
+        }, [&group]() {
+            group.wait();
+        });
+    };
+    benchmark.verify = [matrix, expected, nb, bs]() {
+        if (!*expected) {
+            expected->reset(new BlockMatrix(nb, bs));
+            (*expected)->generate();
+            sparselu(**expected, [](std::function<void()> fn) {
+                fn();
+            }, []() {
+            });
+        }
+        return *matrix == **expected;
+    };
+    return benchmark;
+}
+
+}
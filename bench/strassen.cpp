@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "benchmark.hpp"
+
+namespace bench {
+
+namespace {
+
+constexpr std::size_t strassen_cutoff = 64;
+
+// view of an n x n block of a row major matrix
+struct Block {
+    double* p;
+    std::size_t ld;
+
+    double& at(std::size_t i, std::size_t j) const {
+        return p[i * ld + j];
+    }
+
+    Block quadrant(std::size_t h, int i, int j) const {
+        return Block { p + i * h * ld + j * h, ld };
+    }
+};
+
+// z = x + sign * y
+void add(Block x, Block y, double sign, Block z, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+        for (std::size_t j = 0; j < n; ++j) {
+            z.at(i, j) = x.at(i, j) + sign * y.at(i, j);
+        }
+    }
+}
+
+void copy(Block x, Block z, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+        for (std::size_t j = 0; j < n; ++j) {
+            z.at(i, j) = x.at(i, j);
+        }
+    }
+}
+
+// C = A * B
+void multiply_serial(Block a, Block b, Block c, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+        for (std::size_t j = 0; j < n; ++j) {
+            c.at(i, j) = 0.0;
+        }
+        for (std::size_t k = 0; k < n; ++k) {
+            const double aik = a.at(i, k);
+            for (std::size_t j = 0; j < n; ++j) {
+                c.at(i, j) += aik * b.at(k, j);
+            }
+        }
+    }
+}
+
+/*
+ * C = A * B by Strassen's algorithm, after strassen of BOTS.
+ * the seven products are computed by user threads into temporaries of n/2 x n/2.
+ */
+void multiply(WorkerManager& wm, Block a, Block b, Block c, std::size_t n) {
+    if (n <= strassen_cutoff) {
+        multiply_serial(a, b, c, n);
+        return;
+    }
+
+    const std::size_t h = n / 2;
+    const Block a11 = a.quadrant(h, 0, 0), a12 = a.quadrant(h, 0, 1), a21 = a.quadrant(h, 1, 0), a22 = a.quadrant(h, 1, 1);
+    const Block b11 = b.quadrant(h, 0, 0), b12 = b.quadrant(h, 0, 1), b21 = b.quadrant(h, 1, 0), b22 = b.quadrant(h, 1, 1);
+
+    std::vector<double> products(7 * h * h);
+    auto m = [&products, h](int i) {
+        return Block { products.data() + i * h * h, h };
+    };
+
+    // M = (X1 + sx * X2) * (Y1 + sy * Y2). a null operand is omitted.
+    auto product = [&wm, h](Block x1, const Block* x2, double sx, Block y1, const Block* y2, double sy, Block out) {
+        std::vector<double> operands(2 * h * h);
+        Block x { operands.data(), h };
+        Block y { operands.data() + h * h, h };
+        if (x2) {
+            add(x1, *x2, sx, x, h);
+        } else {
+            copy(x1, x, h);
+        }
+        if (y2) {
+            add(y1, *y2, sy, y, h);
+        } else {
+            copy(y1, y, h);
+        }
+        multiply(wm, x, y, out, h);
+    };
+
+    {
+        orks::userthread::TaskGroup group(wm);
+        group.run([&]() {
+            product(a11, &a22, 1, b11, &b22, 1, m(0));
+        });
+        group.run([&]() {
+            product(a21, &a22, 1, b11, nullptr, 0, m(1));
+        });
+        group.run([&]() {
+            product(a11, nullptr, 0, b12, &b22, -1, m(2));
+        });
+        group.run([&]() {
+            product(a22, nullptr, 0, b21, &b11, -1, m(3));
+        });
+        group.run([&]() {
+            product(a11, &a12, 1, b22, nullptr, 0, m(4));
+        });
+        group.run([&]() {
+            product(a21, &a11, -1, b11, &b12, 1, m(5));
+        });
+        product(a12, &a22, -1, b21, &b22, 1, m(6));
+        group.wait();
+    }
+
+    for (std::size_t i = 0; i < h; ++i) {
+        for (std::size_t j = 0; j < h; ++j) {
+            const double m1 = m(0).at(i, j), m2 = m(1).at(i, j), m3 = m(2).at(i, j), m4 = m(3).at(i, j);
+            const double m5 = m(4).at(i, j), m6 = m(5).at(i, j), m7 = m(6).at(i, j);
+            c.quadrant(h, 0, 0).at(i, j) = m1 + m4 - m5 + m7;
+            c.quadrant(h, 0, 1).at(i, j) = m3 + m5;
+            c.quadrant(h, 1, 0).at(i, j) = m2 + m4;
+            c.quadrant(h, 1, 1).at(i, j) = m1 - m2 + m3 + m6;
+        }
+    }
+}
+
+}
+
+Benchmark make_strassen_benchmark(const BenchmarkOptions& options) {
+    const std::size_t n = options.small ? 256 : 1024;
+    auto a = std::make_shared<std::vector<double>>(n * n);
+    auto b = std::make_shared<std::vector<double>>(n * n);
+    auto c = std::make_shared<std::vector<double>>(n * n);
+
+    Benchmark benchmark;
+    benchmark.name = "strassen";
+    benchmark.parameters = "n=" + std::to_string(n) + " cutoff=" + std::to_string(strassen_cutoff);
+    benchmark.prepare = [a, b, c, n]() {
+        for (std::size_t i = 0; i < n * n; ++i) {
+            (*a)[i] = random_double(i);
+            (*b)[i] = random_double(i + n * n);
+        }
+        std::fill(c->begin(), c->end(), 0.0);
+    };
+    benchmark.run = [a, b, c, n](WorkerManager & wm) {
+        multiply(wm, Block { a->data(), n }, Block { b->data(), n }, Block { c->data(), n }, n);
+    };
+    benchmark.verify = [a, b, c, n]() {
+        return verify_product(*a, *b, *c, n);
+    };
+    return benchmark;
+}
+
+}
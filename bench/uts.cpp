@@ -0,0 +1,100 @@
+#include <memory>
+#include <vector>
+
+#include "benchmark.hpp"
+
+namespace bench {
+
+namespace {
+
+/*
+ * Unbalanced Tree Search on a binomial tree (T3 of the UTS suite).
+ * the root has root_children children. other nodes have m children with probability q, or none.
+ * the shape is derived from the node states, so every run visits the same tree.
+ * splitmix64 stands in for SHA-1 of the original.
+ */
+struct UtsParameters {
+    int root_children;
+    int m;
+    double q;
+    // hash rounds per node, the work of a node
+    int granularity;
+};
+
+std::uint64_t child_state(const UtsParameters& p, std::uint64_t parent, int i) {
+    std::uint64_t state = parent ^ (static_cast<std::uint64_t>(i + 1) * 0x9e3779b97f4a7c15ull);
+    for (int r = 0; r < p.granularity; ++r) {
+        state = splitmix64(state);
+    }
+    return state;
+}
+
+int number_of_children(const UtsParameters& p, std::uint64_t state, bool is_root) {
+    if (is_root) {
+        return p.root_children;
+    }
+    const double u = static_cast<double>(state >> 11) / (1ull << 53);
+    return u < p.q ? p.m : 0;
+}
+
+long count_serial(const UtsParameters& p, std::uint64_t state, bool is_root) {
+    long count = 1;
+    const int n = number_of_children(p, state, is_root);
+    for (int i = 0; i < n; ++i) {
+        count += count_serial(p, child_state(p, state, i), false);
+    }
+    return count;
+}
+
+// every child is a user thread but the last one, which the parent visits itself
+long count(WorkerManager& wm, const UtsParameters& p, std::uint64_t state, bool is_root) {
+    const int n = number_of_children(p, state, is_root);
+    if (n == 0) {
+        return 1;
+    }
+
+    std::vector<long> counts(n, 0);
+    orks::userthread::TaskGroup group(wm);
+    for (int i = 0; i < n - 1; ++i) {
+        group.run([&wm, &p, &counts, state, i]() {
+            counts[i] = count(wm, p, child_state(p, state, i), false);
+        });
+    }
+    counts[n - 1] = count(wm, p, child_state(p, state, n - 1), false);
+    group.wait();
+
+    long total = 1;
+    for (long c : counts) {
+        total += c;
+    }
+    return total;
+}
+
+}
+
+Benchmark make_uts_benchmark(const BenchmarkOptions& options) {
+    const UtsParameters p { options.small ? 200 : 2000, 8, 0.124, 32 };
+    const std::uint64_t root = 19;
+    auto result = std::make_shared<long>(0);
+    auto expected = std::make_shared<long>(-1);
+
+    Benchmark benchmark;
+    benchmark.name = "uts";
+    benchmark.parameters = "b0=" + std::to_string(p.root_children) + " m=" + std::to_string(p.m) +
+                           " q=" + std::to_string(p.q) + " granularity=" + std::to_string(p.granularity);
+    benchmark.prepare = [result]() {
+        *result = 0;
+    };
+    benchmark.run = [result, p, root](WorkerManager & wm) {
+        *result = count(wm, p, root, true);
+    };
+    benchmark.verify = [result, expected, p, root]() {
+        if (*expected < 0) {
+            *expected = count_serial(p, root, true);
+        }
+        return *result == *expected;
+    };
+    return benchmark;
+}
+
+}
@@ -3,12 +3,29 @@
 #ifndef USER_THREAD_HPP_
 #define USER_THREAD_HPP_
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
 #include <list>
+#include <mutex>
 #include <queue>
 #include <future>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include "../src/user-thread-internal.hpp"
+#include "../src/sync.hpp"
+#include "../src/admission.hpp"
+#include "../src/io.hpp"
+#include "../src/pipeline.hpp"
+#include "../src/generator.hpp"
+#include "../src/watchdog.hpp"
+#include "../src/handoff.hpp"
 
 
 namespace orks {
@@ -16,7 +33,10 @@ namespace userthread {
 namespace detail {
 class WorkerManager {
     WorkStealQueue<Work> work_queue;
+    AdmissionControl admission;
     std::list<Worker> workers;
+    std::once_flag shutdown_flag;
+    std::unique_ptr<Watchdog> watchdog;
 
     static unsigned int number_of_cpu_cores() {
         const auto num = std::thread::hardware_concurrency();
@@ -27,15 +47,70 @@ class WorkerManager {
         return num;
     }
 
+    /*
+     * return nullptr if fn was run inline by admission control.
+     * spawn_site nullptr means the type of fn. see AdmissionControl::admit() for before_wait.
+     */
+    template <typename Fn, typename BeforeWait = AdmissionControl::NoopBeforeWait>
+    Work make_admitted_thread(Fn fn, const ThreadAttributes& attributes, const void* spawn_site = nullptr,
+                              BeforeWait before_wait = {}) {
+        AdmissionControl::Ticket ticket;
+        if (!admission.admit(fn, ticket, before_wait)) {
+            return nullptr;
+        }
+
+        if (!spawn_site) {
+            spawn_site = reinterpret_cast<const void*>(&spawn_site_of<Fn>);
+        }
+        return Worker::make_thread([fn = std::move(fn), ticket = std::move(ticket)]() mutable {
+            fn();
+            ticket.release();
+        }, attributes, spawn_site);
+    }
+
+    Work make_admitted_thread(void (*func)(void* arg), void* arg, const ThreadAttributes& attributes) {
+        return make_admitted_thread([func, arg]() {
+            func(arg);
+        }, attributes, reinterpret_cast<const void*>(func));
+    }
+
+    /*
+     * count threads made outside of user threads of this manager, which may race shutdown().
+     * if it was already shut down, the threads are discarded and std::logic_error is thrown.
+     */
+    template <typename Iterator>
+    void count_submitted_threads(Iterator first, Iterator last, const char* caller) {
+        if (work_queue.try_thread_created(std::distance(first, last))) {
+            return;
+        }
+        for (; first != last; ++first) {
+            BadDesignContextTraits::discard_context(*first);
+        }
+        throw std::logic_error(std::string(caller) + ": WorkerManager was already finished");
+    }
+
+    void count_submitted_thread(Work thread, const char* caller) {
+        count_submitted_threads(&thread, &thread + 1, caller);
+    }
+
 public:
-    explicit WorkerManager(unsigned int number_of_worker) :
-        work_queue(number_of_worker) {
+    /*
+     * admission_limits bounds the number of live user threads.
+     * see AdmissionPolicy for what spawning does at the limit.
+     */
+    WorkerManager(unsigned int number_of_worker, const AdmissionLimits& admission_limits) :
+        work_queue(number_of_worker),
+        admission(admission_limits) {
 
         for (unsigned int i = 0; i < number_of_worker; ++i) {
             workers.emplace_back(work_queue.get_local_queue(i), std::to_string(i));
         }
     }
 
+    explicit WorkerManager(unsigned int number_of_worker) :
+        WorkerManager(number_of_worker, AdmissionLimits {}) {
+    }
+
     /*
      * construct WorkerManager with the number of the cpu cores of your computer
      */
@@ -43,35 +118,244 @@ public:
         WorkerManager(number_of_cpu_cores()) {
     }
 
+    WorkerManager(const WorkerManager&) = delete;
+
+    ~WorkerManager() {
+        shutdown();
+    }
+
     /**
      * This function blocks until all user threads finish.
+     * user threads still running when main thread returned are waited too.
+     * workers are shut down after that. use run() to keep them.
      */
     void start_main_thread(void (*func)(void* arg), void* arg) {
+        run(func, arg);
+        shutdown();
+    }
 
-        // main_thread func wrapper
-        auto main0 = [&]() {
-            func(arg);
-            this->work_queue.close();
-        };
+    /**
+     * one session of the runtime: start main thread and block until all user threads finish.
+     * workers stay parked between sessions, so run() can be called any number of times until shutdown().
+     * threads of concurrent sessions and submitted threads are also waited.
+     * must be called from a native thread that is not a worker.
+     */
+    void run(void (*func)(void* arg), void* arg) {
+        if (find_worker_of_this_native_thread()) {
+            throw std::logic_error("run: called from a worker");
+        }
+        if (work_queue.is_closed()) {
+            throw std::logic_error("run: WorkerManager was already finished");
+        }
 
         // created Work* will be deleted in Worker::execute_next_thread_impl
-        auto main_thread = Worker::make_thread(exec_thread<decltype(main0)>, &main0);
-        work_queue.get_local_queue(0).push(main_thread);
+        auto main_thread = Worker::make_thread(func, arg);
+        count_submitted_thread(main_thread, "run");
+        work_queue.inject(main_thread);
 
-        for (auto& worker : workers) {
-            worker.wait();
+        work_queue.wait_all_threads_finished();
+    }
+
+    /**
+     * wait for user threads to finish, and then wake parked workers and join them.
+     * called by the destructor. submitting threads after this throws std::logic_error.
+     */
+    void shutdown() {
+        std::call_once(shutdown_flag, [this]() {
+            watchdog.reset();
+            work_queue.close();
+            for (auto& worker : workers) {
+                worker.wait();
+            }
+        });
+    }
+
+    void start_thread(void (*func)(void* arg), void* arg, const ThreadAttributes& attributes = {}) {
+
+        if (find_worker_of_this_native_thread() == nullptr) {
+            submit_thread(func, arg, attributes);
+            return;
+        }
+
+        // created Work* will be deleted in Worker::execute_next_thread_impl
+        Work thread_data = make_admitted_thread(func, arg, attributes);
+
+        if (thread_data) {
+            // admission may have suspended the caller and resumed it on another worker
+            get_worker_of_this_native_thread().create_thread(thread_data);
         }
 
     }
 
-    void start_thread(void (*func)(void* arg), void* arg) {
+    /**
+     * start_thread() with a function object.
+     * fn is deleted without being called if the thread is cancelled before launch.
+     */
+    template <typename Fn>
+    void start_thread_function(Fn fn, const ThreadAttributes& attributes = {}) {
+
+        if (find_worker_of_this_native_thread() == nullptr) {
+            submit_thread_function(std::move(fn), attributes);
+            return;
+        }
+
+        if (Work thread_data = make_admitted_thread(std::move(fn), attributes)) {
+            // admission may have suspended the caller and resumed it on another worker
+            get_worker_of_this_native_thread().create_thread(thread_data);
+        }
+    }
 
+    /**
+     * start_thread_function() on the worker_index th worker, for threads that own per worker resources.
+     * the thread is pinned: it is never stolen, and is always resumed on that worker.
+     * other threads are still stolen from the worker.
+     * can be called from any native thread, and the calling thread continues to run.
+     */
+    template <typename Fn>
+    void start_thread_function_on(unsigned worker_index, Fn fn, const ThreadAttributes& attributes = {}) {
+        if (worker_index >= workers.size()) {
+            throw std::out_of_range("start_thread_function_on: no such worker");
+        }
+        if (work_queue.is_closed()) {
+            throw std::logic_error("start_thread_function_on: WorkerManager was already finished");
+        }
+
+        if (Work thread_data = make_admitted_thread(std::move(fn), attributes)) {
+            thread_data->pinned = true;
+            count_submitted_thread(thread_data, "start_thread_function_on");
+            work_queue.post_pinned(worker_index, thread_data);
+        }
+    }
+
+    unsigned get_number_of_workers() const {
+        return static_cast<unsigned>(workers.size());
+    }
+
+    /**
+     * push a work that is made into a user thread only if an idle worker steals it.
+     * *must* be called from a worker. see parallel_invoke().
+     */
+    void push_lazy_work(LazyWork<Work>& work) {
+        get_worker_of_this_native_thread().push_lazy(work);
+    }
+
+    // return false if the work was stolen
+    bool withdraw_lazy_work(LazyWork<Work>& work) {
+        return work_queue.withdraw_lazy(work);
+    }
+
+    /**
+     * make a lazy work that is in no queue into a thread, as a thief would, and push it to the local queue.
+     * for a pusher that can not run it inline. the thread is not admission controlled.
+     * *must* be called from a worker.
+     */
+    void enqueue_lazy_work(LazyWork<Work>& work) {
+        get_worker_of_this_native_thread().enqueue_thread(work.make(work));
+    }
+
+    /**
+     * start_thread_function() without switching to the thread.
+     * the calling thread continues to run and the thread waits in the queue until run or stolen.
+     */
+    template <typename Fn>
+    void enqueue_thread_function(Fn fn, const ThreadAttributes& attributes = {}) {
+
+        if (find_worker_of_this_native_thread() == nullptr) {
+            submit_thread_function(std::move(fn), attributes);
+            return;
+        }
+
+        if (Work thread_data = make_admitted_thread(std::move(fn), attributes)) {
+            get_worker_of_this_native_thread().enqueue_thread(thread_data);
+        }
+    }
+
+    /**
+     * start threads for each function object in one operation.
+     * unlike start_thread(), calling thread continues to run and the threads are pushed to the queue at once.
+     */
+    template <typename Fn>
+    void start_thread_functions(std::vector<Fn> fns, const ThreadAttributes& attributes = {}) {
+        const bool from_worker = find_worker_of_this_native_thread() != nullptr;
+        if (!from_worker && work_queue.is_closed()) {
+            throw std::logic_error("start_thread_functions: WorkerManager was already finished");
+        }
+
+        std::vector<Work> threads;
+        auto publish = [&]() {
+            if (threads.empty()) {
+                return;
+            }
+            std::vector<Work> batch;
+            batch.swap(threads);
+            if (!from_worker) {
+                count_submitted_threads(batch.begin(), batch.end(), "start_thread_functions");
+                work_queue.inject_bulk(batch.begin(), batch.end());
+            } else {
+                // not cached: admission may have moved the caller to another worker
+                get_worker_of_this_native_thread().create_threads(batch);
+            }
+        };
+
+        try {
+            for (auto& fn : fns) {
+                // threads admitted so far are published before waiting for capacity that only they can free
+                if (Work thread_data = make_admitted_thread(std::move(fn), attributes, nullptr, publish)) {
+                    threads.push_back(thread_data);
+                }
+            }
+        } catch (...) {
+            // threads admitted before the rejection are still run
+            publish();
+            throw;
+        }
+        publish();
+    }
+
+    /**
+     * create user thread from any native thread, including threads which are not workers.
+     * the thread is put in lock-free injection queue and a parked worker is woken.
+     * unlike start_thread(), calling thread continues to run.
+     * throws std::logic_error after start_main_thread() returned.
+     */
+    void submit_thread(void (*func)(void* arg), void* arg, const ThreadAttributes& attributes = {}) {
+        if (work_queue.is_closed()) {
+            throw std::logic_error("submit_thread: WorkerManager was already finished");
+        }
 
         // created Work* will be deleted in Worker::execute_next_thread_impl
-        Work thread_data = Worker::make_thread(func, arg);
+        Work thread_data = make_admitted_thread(func, arg, attributes);
+
+        if (thread_data) {
+            count_submitted_thread(thread_data, "submit_thread");
+            work_queue.inject(thread_data);
+        }
+    }
+
+    // submit_thread() with a function object
+    template <typename Fn>
+    void submit_thread_function(Fn fn, const ThreadAttributes& attributes = {}) {
+        if (work_queue.is_closed()) {
+            throw std::logic_error("submit_thread: WorkerManager was already finished");
+        }
+
+        if (Work thread_data = make_admitted_thread(std::move(fn), attributes)) {
+            count_submitted_thread(thread_data, "submit_thread");
+            work_queue.inject(thread_data);
+        }
+    }
 
-        get_worker_of_this_native_thread().create_thread(thread_data);
+    AdmissionCounters get_admission_counters() const {
+        return admission.get_counters();
+    }
 
+    SchedulerCounters get_scheduler_counters() {
+        SchedulerCounters counters;
+        counters.steals = work_queue.get_number_of_steals();
+        for (auto& worker : workers) {
+            counters.switches += worker.get_switch_count();
+        }
+        return counters;
     }
 
     /**
@@ -82,6 +366,51 @@ public:
         get_worker_of_this_native_thread().schedule_thread();
     }
 
+    /**
+     * opt-in preemption.
+     * user threads running longer than time_slice (up to twice of it) without context switch
+     * will be switched out at the next preemption_point().
+     */
+    void enable_preemption(std::chrono::microseconds time_slice) {
+        preemption::install_signal_handler();
+        for (auto& worker : workers) {
+            worker.start_preemption_timer(time_slice);
+        }
+    }
+
+    void disable_preemption() {
+        for (auto& worker : workers) {
+            worker.stop_preemption_timer();
+        }
+    }
+
+    /**
+     * opt-in watchdog of user threads that run longer than threshold without context switch.
+     * each hog is reported to on_hog on the watchdog thread, or logged to stderr if on_hog is empty,
+     * and the works queued on the hogged worker are handed to the other workers. see Watchdog.
+     * replaces the watchdog enabled before.
+     */
+    void enable_watchdog(std::chrono::microseconds threshold, std::function<void(const HogReport&)> on_hog = {}) {
+        watchdog.reset();
+        std::vector<Worker*> monitored;
+        for (auto& worker : workers) {
+            monitored.push_back(&worker);
+        }
+        watchdog.reset(new Watchdog(std::move(monitored), work_queue, threshold, std::move(on_hog)));
+    }
+
+    void disable_watchdog() {
+        watchdog.reset();
+    }
+
+    /**
+     * yield only if the time slice of the calling user thread was expired.
+     * call this in long running loops instead of scheduling_yield().
+     */
+    void preemption_point() {
+        get_worker_of_this_native_thread().preemption_point();
+    }
+
     // static utility function
     template<typename Fn>
     static void exec_thread(void* func_obj) {
@@ -113,19 +442,301 @@ void call_and_set_value_to_promise(P& promise, Fn fn, Args...args) {
     call_and_set_value_to_promise_impl<decltype(fn(std::move(args)...))>::call_and_set_value_to_promise(promise, fn, std::move(args)...);
 }
 
-// return: std::future<auto>
+/*
+ * result of a user thread.
+ * get() and wait() suspend the calling user thread instead of blocking its worker.
+ * not to be called inside a catch handler, like the other suspending functions. see sync.hpp.
+ */
+template <typename T>
+class Future {
+    std::future<T> future;
+    std::shared_ptr<Event> completion;
+
+public:
+    Future() = default;
+
+    Future(std::future<T> future, std::shared_ptr<Event> completion) :
+        future(std::move(future)), completion(std::move(completion)) {
+    }
+
+    bool valid() const {
+        return future.valid();
+    }
+
+    bool is_ready() const {
+        return completion->is_set();
+    }
+
+    /*
+     * return WaitStatus::cancelled if the calling user thread was cancelled before the result is ready.
+     */
+    WaitStatus wait() const {
+        return completion->wait();
+    }
+
+    template <class Rep, class Period>
+    std::future_status wait_for(const std::chrono::duration<Rep, Period>& rel_time) const {
+        if (is_ready()) {
+            return std::future_status::ready;
+        }
+        if (rel_time <= rel_time.zero()) {
+            return std::future_status::timeout;
+        }
+        return completion->wait_for(rel_time) == WaitStatus::ready ? std::future_status::ready : std::future_status::timeout;
+    }
+
+    /*
+     * rethrows the exception thrown by the thread.
+     * throws OperationCancelled if the calling thread was cancelled while waiting,
+     * or the thread was discarded by cancellation before launch.
+     */
+    T get() {
+        if (wait() == WaitStatus::cancelled) {
+            throw OperationCancelled();
+        }
+        return future.get();
+    }
+
+    // set when the thread finished or was discarded
+    Event& get_completion_event() const {
+        return *completion;
+    }
+};
+
+/*
+ * suspend the calling thread once until all futures in [first, last) are ready.
+ * return WaitStatus::cancelled if the calling user thread was cancelled before that.
+ */
+template <typename Iterator>
+WaitStatus when_all(Iterator first, Iterator last) {
+    struct Countdown : EventListener {
+        std::atomic<std::size_t>* remaining;
+        Event* done;
+    };
+
+    // one count is held until all listeners are added
+    std::atomic<std::size_t> remaining { 1 };
+    Event done;
+    std::vector<Countdown> listeners;
+    listeners.reserve(std::distance(first, last));
+
+    for (auto it = first; it != last; ++it) {
+        listeners.emplace_back();
+        Countdown& countdown = listeners.back();
+        countdown.on_set = [](EventListener & self) {
+            auto& countdown = static_cast<Countdown&>(self);
+            if (--*countdown.remaining == 0) {
+                countdown.done->set();
+            }
+        };
+        countdown.remaining = &remaining;
+        countdown.done = &done;
+        ++remaining;
+        if (!it->get_completion_event().add_listener(&countdown)) {
+            --remaining;
+        }
+    }
+    if (--remaining == 0) {
+        done.set();
+    }
+
+    const auto status = done.wait();
+
+    std::size_t i = 0;
+    for (auto it = first; it != last; ++it, ++i) {
+        it->get_completion_event().remove_listener(&listeners[i]);
+    }
+    return status;
+}
+
+/*
+ * suspend the calling thread once until one of futures in [first, last) is ready.
+ * return the iterator to the first ready future,
+ * or last if the calling user thread was cancelled before that or the range is empty.
+ */
+template <typename Iterator>
+Iterator when_any(Iterator first, Iterator last) {
+    constexpr std::size_t none = ~std::size_t(0);
+    struct FirstReady : EventListener {
+        std::atomic<std::size_t>* winner;
+        std::size_t index;
+        Event* done;
+    };
+
+    std::atomic<std::size_t> winner { none };
+    Event done;
+    std::vector<FirstReady> listeners;
+    listeners.reserve(std::distance(first, last));
+
+    auto on_set = [](EventListener & self) {
+        auto& listener = static_cast<FirstReady&>(self);
+        std::size_t expected = none;
+        if (listener.winner->compare_exchange_strong(expected, listener.index)) {
+            listener.done->set();
+        }
+    };
+
+    std::size_t index = 0;
+    for (auto it = first; it != last; ++it, ++index) {
+        listeners.emplace_back();
+        FirstReady& listener = listeners.back();
+        listener.on_set = on_set;
+        listener.winner = &winner;
+        listener.index = index;
+        listener.done = &done;
+        if (!it->get_completion_event().add_listener(&listener)) {
+            // already ready. later futures are not watched.
+            listeners.pop_back();
+            std::size_t expected = none;
+            winner.compare_exchange_strong(expected, index);
+            break;
+        }
+    }
+
+    if (winner == none && !listeners.empty()) {
+        done.wait();
+    }
+
+    auto it = first;
+    for (auto& listener : listeners) {
+        it->get_completion_event().remove_listener(&listener);
+        ++it;
+    }
+
+    const std::size_t ready = winner;
+    if (ready == none) {
+        return last;
+    }
+    return std::next(first, ready);
+}
+
+/*
+ * promise of a user thread.
+ * if the thread is discarded before launch, OperationCancelled, or the exception that failed the launch,
+ * is set at destruction.
+ */
+template <typename T>
+class ThreadPromise {
+    std::promise<T> promise;
+    std::shared_ptr<Event> completion;
+    bool satisfied = false;
+
+public:
+    ThreadPromise() :
+        completion(std::make_shared<Event>()) {
+    }
+
+    ThreadPromise(ThreadPromise&&) = default;
+
+    ~ThreadPromise() {
+        if (completion && !satisfied) {
+            promise.set_exception(exception_of_discarded_thread());
+            completion->set();
+        }
+    }
+
+    Future<T> get_future() {
+        return Future<T>(promise.get_future(), completion);
+    }
+
+    template <typename Fn, typename... Args>
+    void call(Fn& fn, Args&... args) {
+        try {
+            call_and_set_value_to_promise(promise, fn, std::move(args)...);
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+        satisfied = true;
+        completion->set();
+    }
+};
+
+// return: std::pair<Future<auto>, function object that sets value to the future>
 template <typename Fn, typename... Args>
-auto create_thread(WorkerManager& wm, Fn fn, Args... args) {
-    std::promise<decltype(fn(args...))> promise;
+auto make_thread_function_with_future(Fn fn, Args... args) {
+    ThreadPromise<decltype(fn(args...))> promise;
     auto future = promise.get_future();
 
     // TODO INVOKE(DECAY_COPY(std::forward<F>(f)), DECAY_COPY(std::forward<Args>(args))...)
     auto fn0 = [promise = std::move(promise), fn, args...]() mutable {
-        call_and_set_value_to_promise(promise, fn, std::move(args)...);
+        promise.call(fn, args...);
     };
-    using Fn0 = decltype(fn0);
-    wm.start_thread(detail::exec_thread_delete<Fn0>, new Fn0(std::move(fn0)));
-    return future;
+    return std::make_pair(std::move(future), std::move(fn0));
+}
+
+// return: Future<auto>
+template <typename Fn, typename... Args>
+auto create_thread(WorkerManager& wm, const ThreadAttributes& attributes, Fn fn, Args... args) {
+    auto thread = make_thread_function_with_future(std::move(fn), std::move(args)...);
+    wm.start_thread_function(std::move(thread.second), attributes);
+    return std::move(thread.first);
+}
+
+// return: Future<auto>
+template <typename Fn, typename... Args>
+auto create_thread(WorkerManager& wm, Fn fn, Args... args) {
+    return create_thread(wm, ThreadAttributes {}, std::move(fn), std::move(args)...);
+}
+
+/*
+ * create a thread pinned to the worker_index th worker. see WorkerManager::start_thread_function_on().
+ * return: Future<auto>
+ */
+template <typename Fn, typename... Args>
+auto create_thread_on(WorkerManager& wm, unsigned worker_index, const ThreadAttributes& attributes, Fn fn,
+                      Args... args) {
+    auto thread = make_thread_function_with_future(std::move(fn), std::move(args)...);
+    wm.start_thread_function_on(worker_index, std::move(thread.second), attributes);
+    return std::move(thread.first);
+}
+
+// return: Future<auto>
+template <typename Fn, typename... Args>
+auto create_thread_on(WorkerManager& wm, unsigned worker_index, Fn fn, Args... args) {
+    return create_thread_on(wm, worker_index, ThreadAttributes {}, std::move(fn), std::move(args)...);
+}
+
+/*
+ * create n threads that call fn(i) for i in [0, n) in one operation.
+ * the calling thread is not switched.
+ * return: std::vector<Future<auto>>
+ */
+template <typename Fn>
+auto create_threads(WorkerManager& wm, const ThreadAttributes& attributes, std::size_t n, Fn fn) {
+    using Thread = decltype(make_thread_function_with_future(fn, std::size_t()));
+    std::vector<typename Thread::first_type> futures;
+    std::vector<typename Thread::second_type> fns;
+    futures.reserve(n);
+    fns.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        auto thread = make_thread_function_with_future(fn, i);
+        futures.push_back(std::move(thread.first));
+        fns.push_back(std::move(thread.second));
+    }
+    wm.start_thread_functions(std::move(fns), attributes);
+    return futures;
+}
+
+// return: std::vector<Future<auto>>
+template <typename Fn>
+auto create_threads(WorkerManager& wm, std::size_t n, Fn fn) {
+    return create_threads(wm, ThreadAttributes {}, n, std::move(fn));
+}
+
+// can be called from any native thread
+// return: Future<auto>
+template <typename Fn, typename... Args>
+auto submit(WorkerManager& wm, const ThreadAttributes& attributes, Fn fn, Args... args) {
+    auto thread = make_thread_function_with_future(std::move(fn), std::move(args)...);
+    wm.submit_thread_function(std::move(thread.second), attributes);
+    return std::move(thread.first);
+}
+
+// can be called from any native thread
+// return: Future<auto>
+template <typename Fn, typename... Args>
+auto submit(WorkerManager& wm, Fn fn, Args... args) {
+    return submit(wm, ThreadAttributes {}, std::move(fn), std::move(args)...);
 }
 
 // blocks until main thread finished
@@ -146,43 +757,762 @@ auto start_main_thread(WorkerManager& wm, Fn fn, Args... args) {
 
 }
 
+// start_main_thread() that keeps the workers for next sessions
+// return: std::future<auto>
+template <typename Fn, typename... Args>
+auto run(WorkerManager& wm, Fn fn, Args... args) {
+
+    std::promise<decltype(fn(args...))> promise;
+    auto future = promise.get_future();
+
+    auto fn0 = [promise = std::move(promise), fn = std::move(fn), &args...]() mutable {
+        call_and_set_value_to_promise(promise, fn, std::move(args)...);
+    };
+    using Fn0 = decltype(fn0);
+    wm.run(WorkerManager::exec_thread<Fn0>, &fn0);
+    return future;
+}
+
 WorkerManager& get_global_workermanager();
+
+/*
+ * fork/join scope of user threads without a future per child.
+ * children are tracked by one counter. a child run() on a user thread is recorded in the lazy queue of the worker
+ * and gets a thread only if an idle worker steals it. see parallel_invoke().
+ * wait() runs children not stolen yet inline, then suspends the calling user thread until all children finished.
+ * on a thread that used half of its stack, children get threads instead, so that recursive groups do not overflow it.
+ * the first exception thrown by a child is rethrown by wait().
+ * children discarded by cancellation before launch are reported as OperationCancelled.
+ * stolen children are not admission controlled.
+ * wait() suspends, and so must not be called inside a catch handler.
+ */
+class TaskGroup {
+    struct Child : LazyWork<Work> {
+        TaskGroup* group;
+        std::function<void()> fn;
+        // of the caller of run(), not of the thief
+        std::shared_ptr<CancellationState> cancellation;
+        // submitted from a native thread, and run() has not returned yet. under the lock of the group
+        bool submitting = false;
+
+        Child(TaskGroup& group, std::function<void()> fn, std::shared_ptr<CancellationState> cancellation) :
+            group(&group), fn(std::move(fn)), cancellation(std::move(cancellation)) {
+            make = &make_thread;
+        }
+    };
+
+    // body of a child thread
+    class ChildThread {
+        TaskGroup* group;
+        Child* child;
+
+    public:
+        ChildThread(TaskGroup& group, Child& child) :
+            group(&group), child(&child) {
+        }
+
+        ChildThread(ChildThread&& other) :
+            group(other.group), child(other.child) {
+            other.child = nullptr;
+        }
+
+        // the group is not touched after finish_thread()
+        void operator()() {
+            Child* c = child;
+            child = nullptr;
+            group->call(*c);
+            group->finish_thread();
+        }
+
+        ~ChildThread() {
+            if (child) {
+                group->discard(*child);
+            }
+        }
+    };
+
+    WorkerManager& wm;
+    const ThreadAttributes attributes;
+
+    // number of children not finished
+    std::atomic<std::size_t> pending = { 0 };
+
+    std::mutex mutex;
+    std::condition_variable native_cond;
+    std::vector<Waiter*> waiters;
+    std::deque<Child> children;
+    // in the lazy queues unless stolen, newest last
+    std::vector<Child*> queued;
+    std::exception_ptr exception;
+
+public:
+    explicit TaskGroup(WorkerManager& wm, const ThreadAttributes& attributes = {}) :
+        wm(wm), attributes(attributes) {
+    }
+
+    TaskGroup() :
+        TaskGroup(get_global_workermanager()) {
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+
+    // waits all children. exceptions of children are discarded.
+    ~TaskGroup() {
+        join();
+    }
+
+    template <typename Fn>
+    void run(Fn fn) {
+        ++pending;
+        Work self = get_current_thread();
+        auto lock = util::make_unique_lock(mutex);
+        children.emplace_back(*this, std::move(fn), self ? self->cancellation : nullptr);
+        Child& child = children.back();
+        if (!self) {
+            // no lazy queue on a native thread
+            child.submitting = true;
+            lock.unlock();
+            submit(child);
+            return;
+        }
+        // pushed under the lock, so that help() on another thread does not take it for stolen
+        queued.push_back(&child);
+        try {
+            wm.push_lazy_work(child);
+        } catch (...) {
+            queued.pop_back();
+            children.pop_back();
+            lock.unlock();
+            finish_thread();
+            throw;
+        }
+    }
+
+    /*
+     * the group can be reused after wait().
+     * not cancellable, because children refer to the group.
+     */
+    void wait() {
+        join();
+
+        std::exception_ptr e;
+        {
+            auto lock = util::make_unique_lock(mutex);
+            std::swap(e, exception);
+            if (pending == 0 && queued.empty()) {
+                children.clear();
+            }
+        }
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+
+private:
+    void join() {
+        help();
+
+        if (!get_current_thread()) {
+            auto lock = util::make_unique_lock(mutex);
+            native_cond.wait(lock, [this]() {
+                return pending == 0;
+            });
+            return;
+        }
+
+        // pending is read under the lock. the last finish_thread() may still hold it otherwise.
+        {
+            auto lock = util::make_unique_lock(mutex);
+            if (pending == 0) {
+                // all children were run inline or finished. no switch.
+                return;
+            }
+        }
+        suspend_current_thread_until_woken([this](Waiter & waiter) {
+            auto lock = util::make_unique_lock(mutex);
+            if (pending == 0) {
+                return false;
+            }
+            waiters.push_back(&waiter);
+            return true;
+        });
+        // woken by finish_thread() that already removed the waiter
+        auto lock = util::make_unique_lock(mutex);
+        assert(pending == 0);
+    }
+
+    /*
+     * run children not stolen yet, newest first.
+     * past half of the stack of the calling thread, they get threads instead. see has_stack_for_inline_call().
+     */
+    void help() {
+        Work self = get_current_thread();
+        // a native thread has a stack large enough
+        const bool can_call_inline = !self || has_stack_for_inline_call(self);
+        for (;;) {
+            Child* child;
+            {
+                auto lock = util::make_unique_lock(mutex);
+                if (queued.empty()) {
+                    return;
+                }
+                child = queued.back();
+                queued.pop_back();
+            }
+            if (!wm.withdraw_lazy_work(*child)) {
+                continue;
+            }
+            if (can_call_inline) {
+                call(*child);
+                finish_thread();
+                continue;
+            }
+            try {
+                wm.enqueue_lazy_work(*child);
+            } catch (...) {
+                set_exception(std::current_exception());
+                finish_thread();
+            }
+        }
+    }
+
+    // a thread for child. if the submit throws, the child is rolled back and never reported.
+    void submit(Child& child) {
+        try {
+            wm.enqueue_thread_function(ChildThread(*this, child), attributes);
+        } catch (...) {
+            {
+                auto lock = util::make_unique_lock(mutex);
+                child.submitting = false;
+                if (&children.back() == &child) {
+                    children.pop_back();
+                } else {
+                    // erasing it would invalidate the children pushed after it
+                    child.fn = nullptr;
+                }
+            }
+            finish_thread();
+            throw;
+        }
+
+        {
+            auto lock = util::make_unique_lock(mutex);
+            if (child.submitting) {
+                child.submitting = false;
+                return;
+            }
+        }
+        // discarded by cancellation before this returned, and left to this by discard()
+        set_exception(exception_of_discarded_thread());
+        finish_thread();
+    }
+
+    // a child thread discarded before launch
+    void discard(Child& child) {
+        {
+            auto lock = util::make_unique_lock(mutex);
+            if (child.submitting) {
+                // submit() rolls it back or reports it
+                child.submitting = false;
+                return;
+            }
+        }
+        set_exception(exception_of_discarded_thread());
+        finish_thread();
+    }
+
+    static Work make_thread(LazyWork<Work>& self) {
+        auto& child = static_cast<Child&>(self);
+        const ThreadAttributes& attributes = child.group->attributes;
+        Work thread = Worker::make_thread(ChildThread(*child.group, child), attributes);
+        if (!attributes.cancellation_token.valid()) {
+            thread->cancellation = child.cancellation;
+        }
+        return thread;
+    }
+
+    void call(Child& child) {
+        try {
+            child.fn();
+        } catch (...) {
+            set_exception(std::current_exception());
+        }
+        // release captures early
+        child.fn = nullptr;
+    }
+
+    void set_exception(std::exception_ptr e) {
+        auto lock = util::make_unique_lock(mutex);
+        if (!exception) {
+            exception = e;
+        }
+    }
+
+    void finish_thread() {
+        std::size_t n = pending.load();
+        while (n > 1) {
+            if (pending.compare_exchange_weak(n, n - 1)) {
+                return;
+            }
+        }
+
+        // the last one decrements under the lock, so that wait() can not return and destroy the group before unlock
+        auto lock = util::make_unique_lock(mutex);
+        if (--pending != 0) {
+            return;
+        }
+        for (Waiter* waiter : waiters) {
+            try_wake_waiter(*waiter, WaitStatus::ready);
+        }
+        waiters.clear();
+        native_cond.notify_all();
+    }
+};
+
+/*
+ * the first function of parallel_invoke(). placed on the stack of the caller.
+ * made into a user thread only when a thief takes it from the lazy queue.
+ */
+template <typename F>
+class LazyInvoke : public LazyWork<Work> {
+    // body of the user thread made by the thief
+    class StolenThread {
+        LazyInvoke* lazy;
+
+    public:
+        explicit StolenThread(LazyInvoke& lazy) :
+            lazy(&lazy) {
+        }
+
+        StolenThread(StolenThread&& other) :
+            lazy(other.lazy) {
+            other.lazy = nullptr;
+        }
+
+        void operator()() {
+            LazyInvoke* l = lazy;
+            lazy = nullptr;
+            try {
+                l->f();
+            } catch (...) {
+                l->exception = std::current_exception();
+            }
+            l->finish();
+        }
+
+        // discarded by cancellation before launch
+        ~StolenThread() {
+            if (lazy) {
+                lazy->exception = exception_of_discarded_thread();
+                lazy->finish();
+            }
+        }
+    };
+
+    F& f;
+    std::shared_ptr<CancellationState> cancellation;
+    std::size_t stack_size;
+
+    std::mutex mutex;
+    bool finished = false;
+    Waiter* waiter = nullptr;
+
+public:
+    std::exception_ptr exception;
+
+    LazyInvoke(F& f, std::shared_ptr<CancellationState> cancellation, std::size_t stack_size) :
+        f(f), cancellation(std::move(cancellation)), stack_size(stack_size) {
+        make = &make_thread;
+    }
+
+    LazyInvoke(const LazyInvoke&) = delete;
+
+    // after a thief took this
+    void wait() {
+        suspend_current_thread_until_woken([this](Waiter & w) {
+            auto lock = util::make_unique_lock(mutex);
+            if (finished) {
+                return false;
+            }
+            waiter = &w;
+            return true;
+        });
+        // woken by finish() that may still hold the lock. this is destroyed after wait() returns.
+        auto lock = util::make_unique_lock(mutex);
+        assert(finished);
+    }
+
+private:
+    static Work make_thread(LazyWork<Work>& self) {
+        auto& lazy = static_cast<LazyInvoke&>(self);
+        ThreadAttributes attributes;
+        attributes.stack_size = lazy.stack_size;
+        Work thread = Worker::make_thread(StolenThread(lazy), attributes);
+        // of the caller, not of the thief
+        thread->cancellation = lazy.cancellation;
+        return thread;
+    }
+
+    // under the lock, which wait() takes after it was woken, so that it can not return and destroy this before unlock
+    void finish() {
+        auto lock = util::make_unique_lock(mutex);
+        finished = true;
+        if (waiter) {
+            try_wake_waiter(*waiter, WaitStatus::ready);
+        }
+    }
+};
+
+/*
+ * call f() and g(), possibly in parallel, and return after both finished.
+ * g() is called on the calling thread. f() is recorded in the lazy queue of the worker without making a thread,
+ * and is called after g() as a plain function call, unless an idle worker stole it in the meantime.
+ * only a stolen f() gets a stack, of attributes.stack_size, and runs in a user thread that is not admission controlled.
+ * the exception of g(), or else of f(), is rethrown. a stolen f() discarded by cancellation throws OperationCancelled.
+ * on a thread that used half of its stack, both are called in a new thread, so that recursion does not overflow it.
+ * called from a native thread that is not a worker, or from a thread on a shared stack
+ * whose frames a thief could not refer to, f() and g() are called in order.
+ */
+template <typename F, typename G>
+void parallel_invoke(WorkerManager& wm, const ThreadAttributes& attributes, F f, G g) {
+    Work self = get_current_thread();
+    if (!self || self->uses_shared_stack()) {
+        f();
+        g();
+        return;
+    }
+
+    if (!has_stack_for_inline_call(self)) {
+        // continue on a stack of its own instead of deeper on this one
+        auto both = [&wm, &attributes, &f, &g]() {
+            parallel_invoke(wm, attributes, std::move(f), std::move(g));
+        };
+        LazyInvoke<decltype(both)> fresh(both, self->cancellation, attributes.stack_size);
+        wm.enqueue_lazy_work(fresh);
+        fresh.wait();
+        if (fresh.exception) {
+            std::rethrow_exception(fresh.exception);
+        }
+        return;
+    }
+
+    LazyInvoke<F> lazy(f, self->cancellation, attributes.stack_size);
+    wm.push_lazy_work(lazy);
+
+    std::exception_ptr exception;
+    try {
+        g();
+    } catch (...) {
+        exception = std::current_exception();
+    }
+
+    // possibly on another worker after g()
+    if (wm.withdraw_lazy_work(lazy)) {
+        try {
+            f();
+        } catch (...) {
+            lazy.exception = std::current_exception();
+        }
+    } else {
+        lazy.wait();
+    }
+
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+    if (lazy.exception) {
+        std::rethrow_exception(lazy.exception);
+    }
+}
+
+template <typename F, typename G>
+void parallel_invoke(WorkerManager& wm, F f, G g) {
+    parallel_invoke(wm, ThreadAttributes {}, std::move(f), std::move(g));
+}
+
+/*
+ * run a pipeline of filters with at most max_tokens items in flight.
+ * each token is a user thread that carries items through all filters, so memory is bounded by max_tokens.
+ * suspends the calling user thread until the source stopped and all items passed the last filter.
+ * the first exception thrown by a filter stops the source and is rethrown.
+ * must not be called inside a catch handler, and filters must not suspend inside one. see sync.hpp.
+ */
+inline void run_pipeline(WorkerManager& wm, std::size_t max_tokens, const Filter<void, void>& filter) {
+    if (!get_current_thread()) {
+        throw std::logic_error("run_pipeline: not called from a user thread");
+    }
+    if (max_tokens == 0) {
+        throw std::invalid_argument("run_pipeline: max_tokens is 0");
+    }
+
+    PipelineRun run;
+    for (FilterMode mode : filter.modes) {
+        run.stages.emplace_back(new PipelineStage(mode));
+    }
+
+    TaskGroup group { wm };
+    for (std::size_t i = 0; i < max_tokens; ++i) {
+        group.run([&run, &filter]() {
+            run_pipeline_token(run, filter.body);
+        });
+    }
+    group.wait();
+}
 }
 using detail::WorkerManager;
+using detail::ThreadAttributes;
+using detail::StackUsageHistogram;
+using detail::StackUsageProfile;
+using detail::FiberLocalKey;
+using detail::AdmissionPolicy;
+using detail::AdmissionLimits;
+using detail::AdmissionCounters;
+using detail::SchedulerCounters;
+using detail::HogReport;
+using detail::AdmissionRejected;
+using detail::CancellationToken;
+using detail::OperationCancelled;
+using detail::WaitStatus;
+using detail::Event;
+using detail::Future;
+using detail::when_all;
+using detail::when_any;
+using detail::TaskGroup;
+using detail::FilterMode;
+using detail::FlowControl;
+using detail::Filter;
+using detail::make_filter;
+using detail::run_pipeline;
+using detail::Generator;
+using detail::HandoffPoint;
+using detail::sleep_for;
+using detail::RegisteredFile;
+using detail::read_at;
+using detail::write_at;
+using detail::sync_file;
+using detail::open_at;
+using detail::register_io_files;
+using detail::register_io_buffers;
 
 /* 重要!
-*  main thread が終了した後に新規スレッド作成かyieldをすると未定義動作
+*  start_main_thread() returns after main thread and all user threads created by it finished.
 *  main thread がyield()を呼ぶと未定義動作
 */
 
 void start_thread(void (*func)(void* arg), void* arg);
 
+/*
+* create user thread from any native thread, including threads which are not workers.
+* calling thread is not switched.
+*/
+void submit_thread(void (*func)(void* arg), void* arg);
+
 /*
 * initialize global worker manager with the number of the worker.
-* DO NOT call twice.
+* do nothing if it is already initialized and not shut down by start_main_thread().
 */
 void init_worker_manager(unsigned int number_of_worker);
 
+/*
+* initialize global worker manager with the number of the worker and limits of live user threads.
+* do nothing if it is already initialized and not shut down by start_main_thread().
+*/
+void init_worker_manager(unsigned int number_of_worker, const AdmissionLimits& admission_limits);
+
 /*
 * initialize global worker manager with the number of the cpu cores.
-* DO NOT call twice.
+* do nothing if it is already initialized and not shut down by start_main_thread().
 */
 void init_worker_manager();
 
 /**
 * This function blocks until all user threads finish.
+* the global worker manager is shut down after that, and workers are joined.
+* it is then uninitialized again: init_worker_manager(), or start_main_thread() and run() initializing with the number
+* of the cpu cores, create a new one. preemption and the watchdog are not enabled on it.
 */
 void start_main_thread(void (*func)(void* arg), void* arg);
 
+/**
+* one session of the global worker manager.
+* blocks until all user threads finish, but workers are kept for next run().
+* initialize global worker manager with the number of the cpu cores if not initialized.
+*/
+void run(void (*func)(void* arg), void* arg);
+
 void yield();
 
-// return: std::future<auto>
+AdmissionCounters get_admission_counters();
+
+SchedulerCounters get_scheduler_counters();
+
+/*
+* enable preemption of the global worker manager.
+* initialize global worker manager with the number of the cpu cores if not initialized.
+*/
+void enable_preemption(std::chrono::microseconds time_slice);
+
+/*
+* enable the watchdog of the global worker manager. see WorkerManager::enable_watchdog().
+* initialize global worker manager with the number of the cpu cores if not initialized.
+*/
+void enable_watchdog(std::chrono::microseconds threshold, std::function<void(const HogReport&)> on_hog = {});
+
+/*
+* yield if the time slice of the calling user thread was expired.
+* do nothing if preemption is not enabled.
+*/
+void preemption_point();
+
+/*
+* return stack high watermarks of finished user threads.
+* always empty unless built with ORKS_USERTHREAD_STACK_PROFILE.
+*/
+StackUsageProfile get_stack_usage_profile();
+
+void reset_stack_usage_profile();
+
+/*
+* also aggregate stack high watermarks per entry function of user threads.
+*/
+void set_stack_usage_profile_by_spawn_site(bool enable);
+
+/*
+* fiber local storage.
+* C++ thread_local must not be used in user threads because they migrate between workers.
+* these functions must be called from user threads. throws std::logic_error if called from other native threads.
+*/
+
+/*
+* destructor is called with non null value at the end of each user thread.
+*/
+FiberLocalKey create_fiber_local_key(void (*destructor)(void*) = nullptr);
+
+/*
+* destructor of the key is no longer called. values are not destructed.
+* the key may be returned by a later create_fiber_local_key(), but values set before are not seen through it.
+*/
+void delete_fiber_local_key(FiberLocalKey key);
+
+void* get_fiber_local(FiberLocalKey key);
+
+void set_fiber_local(FiberLocalKey key, void* value);
+
+/*
+* raw slots without destructors for the fastest access.
+* *must* index < number_of_fiber_local_slots
+*/
+constexpr std::size_t number_of_fiber_local_slots = detail::FiberLocalStorage::number_of_fixed_slots;
+void*& fiber_local_slot(std::size_t index);
+
+/*
+* T is default constructed at first get() in each user thread, and deleted at the end of the thread.
+*/
+template <typename T>
+class FiberLocal {
+    FiberLocalKey key;
+
+public:
+    FiberLocal()
+        : key(create_fiber_local_key([](void* p) {
+        delete static_cast<T*>(p);
+    })) {
+    }
+
+    FiberLocal(const FiberLocal&) = delete;
+
+    ~FiberLocal() {
+        delete_fiber_local_key(key);
+    }
+
+    T& get() {
+        void* p = get_fiber_local(key);
+        if (!p) {
+            p = new T();
+            set_fiber_local(key, p);
+        }
+        return *static_cast<T*>(p);
+    }
+
+    T* operator->() {
+        return &get();
+    }
+
+    T& operator*() {
+        return get();
+    }
+};
+
+/*
+* cancellation token of the calling user thread. empty if the thread is not cancellable or not a user thread.
+* pass CancellationToken::create() as ThreadAttributes::cancellation_token to make a new cancellation tree.
+*/
+CancellationToken get_cancellation_token();
+
+/*
+* return true if the calling user thread was cancelled.
+* cancelled threads should return early. waits of cancelled threads return WaitStatus::cancelled.
+*/
+bool is_cancelled();
+
+/*
+* the longest time the calling user thread waited to be run again after yield() or preemption_point().
+* yielded threads are queued in FIFO order, and run at least once in a bounded number of scheduling points.
+* zero if the caller is not a user thread.
+*/
+std::chrono::steady_clock::duration get_max_yield_wait();
+
+// return: Future<auto>
 template <typename Fn, typename... Args>
 auto create_thread(Fn fn, Args... args) {
 
     return detail::create_thread(detail::get_global_workermanager(), std::move(fn), std::move(args)...);
 }
 
+// create user thread with attributes such as stack size
+// return: Future<auto>
+template <typename Fn, typename... Args>
+auto create_thread(const ThreadAttributes& attributes, Fn fn, Args... args) {
+
+    return detail::create_thread(detail::get_global_workermanager(), attributes, std::move(fn), std::move(args)...);
+}
+
+/*
+* create n threads that call fn(i) for i in [0, n) in one operation.
+* unlike create_thread(), the calling thread is not switched to the children.
+* return: std::vector<Future<auto>>
+*/
+template <typename Fn>
+auto create_threads(std::size_t n, Fn fn) {
+
+    return detail::create_threads(detail::get_global_workermanager(), n, std::move(fn));
+}
+
+// return: std::vector<Future<auto>>
+template <typename Fn>
+auto create_threads(const ThreadAttributes& attributes, std::size_t n, Fn fn) {
+
+    return detail::create_threads(detail::get_global_workermanager(), attributes, n, std::move(fn));
+}
+
+// can be called from any native thread
+// return: Future<auto>
+template <typename Fn, typename... Args>
+auto submit(Fn fn, Args... args) {
+
+    return detail::submit(detail::get_global_workermanager(), std::move(fn), std::move(args)...);
+}
+
+/*
+* call f() and g(), possibly in parallel. a user thread is made for f() only if an idle worker steals it.
+* see detail::parallel_invoke().
+*/
+template <typename F, typename G>
+void parallel_invoke(F f, G g) {
+
+    detail::parallel_invoke(detail::get_global_workermanager(), std::move(f), std::move(g));
+}
+
 }
 }
 
@@ -0,0 +1,237 @@
+#ifndef USER_THREAD_ADMISSION_HPP
+#define USER_THREAD_ADMISSION_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "util.hpp"
+#include "sync.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * what spawning does when the limit of live threads is reached.
+ */
+enum class AdmissionPolicy {
+    // call the function of the thread on the stack of the caller
+    run_inline,
+    // suspend the calling user thread (or block the calling native thread) until a thread finishes
+    wait,
+    // throw AdmissionRejected
+    fail
+};
+
+struct AdmissionLimits {
+    // 0 means unlimited. counts user threads from spawn to finish, including queued and blocked ones.
+    std::size_t max_threads = 0;
+    AdmissionPolicy policy = AdmissionPolicy::run_inline;
+};
+
+struct AdmissionCounters {
+    std::uint64_t admitted = 0;
+    std::uint64_t run_inline = 0;
+    // number of waits, not waiting spawns. a spawn may wait more than once.
+    std::uint64_t waited = 0;
+    std::uint64_t rejected = 0;
+};
+
+class AdmissionRejected : public std::runtime_error {
+public:
+    AdmissionRejected() :
+        std::runtime_error("spawn rejected: too many user threads") {
+    }
+};
+
+/*
+ * bounds the number of live user threads of a WorkerManager.
+ * the main thread and threads spawned before the limit applies are not counted.
+ */
+class AdmissionControl {
+    const AdmissionLimits limits;
+    std::atomic<std::size_t> number_of_admitted = { 0 };
+
+    std::atomic<std::uint64_t> admitted = { 0 };
+    std::atomic<std::uint64_t> run_inline = { 0 };
+    std::atomic<std::uint64_t> waited = { 0 };
+    std::atomic<std::uint64_t> rejected = { 0 };
+
+    std::mutex mutex;
+    std::condition_variable native_cond;
+    std::vector<Waiter*> waiters;
+    std::atomic<std::size_t> number_of_waiters = { 0 };
+
+public:
+    /*
+     * held by the function object of an admitted thread.
+     * released when the function returns, or when the thread is discarded before launch.
+     */
+    class Ticket {
+        AdmissionControl* control = nullptr;
+
+    public:
+        Ticket() = default;
+
+        explicit Ticket(AdmissionControl& control) :
+            control(&control) {
+        }
+
+        Ticket(Ticket&& other) :
+            control(other.control) {
+            other.control = nullptr;
+        }
+
+        Ticket& operator=(Ticket&& other) {
+            release();
+            control = other.control;
+            other.control = nullptr;
+            return *this;
+        }
+
+        ~Ticket() {
+            release();
+        }
+
+        void release() {
+            if (control) {
+                control->release();
+                control = nullptr;
+            }
+        }
+    };
+
+    explicit AdmissionControl(const AdmissionLimits& limits = {}) :
+        limits(limits) {
+    }
+
+    AdmissionControl(const AdmissionControl&) = delete;
+
+    struct NoopBeforeWait {
+        void operator()() const {
+        }
+    };
+
+    /*
+     * take a ticket for a new thread. ticket stays empty if unlimited.
+     * return false if fn() was run inline instead. the caller must not spawn it then.
+     * throws AdmissionRejected by the fail policy, and OperationCancelled if the waiting thread was cancelled.
+     * before_wait() is called each time before waiting by the wait policy,
+     * so that threads admitted but not published yet can free the capacity.
+     */
+    template <typename Fn, typename BeforeWait = NoopBeforeWait>
+    bool admit(Fn& fn, Ticket& ticket, BeforeWait before_wait = {}) {
+        if (limits.max_threads == 0) {
+            return true;
+        }
+
+        while (!try_admit()) {
+            switch (limits.policy) {
+            case AdmissionPolicy::run_inline:
+                ++run_inline;
+                fn();
+                return false;
+            case AdmissionPolicy::fail:
+                ++rejected;
+                throw AdmissionRejected();
+            case AdmissionPolicy::wait:
+                before_wait();
+                ++waited;
+                if (wait_for_capacity() == WaitStatus::cancelled) {
+                    throw OperationCancelled();
+                }
+                break;
+            }
+        }
+
+        ++admitted;
+        ticket = Ticket(*this);
+        return true;
+    }
+
+    AdmissionCounters get_counters() const {
+        AdmissionCounters counters;
+        counters.admitted = admitted;
+        counters.run_inline = run_inline;
+        counters.waited = waited;
+        counters.rejected = rejected;
+        return counters;
+    }
+
+private:
+    bool try_admit() {
+        std::size_t current = number_of_admitted.load();
+        do {
+            if (current >= limits.max_threads) {
+                return false;
+            }
+        } while (!number_of_admitted.compare_exchange_weak(current, current + 1));
+        return true;
+    }
+
+    bool has_capacity() const {
+        return number_of_admitted < limits.max_threads;
+    }
+
+    void release() {
+        --number_of_admitted;
+
+        // pairs with the increment in wait_for_capacity()
+        if (number_of_waiters == 0) {
+            return;
+        }
+        auto lock = util::make_unique_lock(mutex);
+        while (!waiters.empty()) {
+            Waiter* waiter = waiters.front();
+            waiters.erase(waiters.begin());
+            if (try_wake_waiter(*waiter, WaitStatus::ready)) {
+                break;
+            }
+        }
+        native_cond.notify_one();
+    }
+
+    /*
+     * may return before capacity is available. the caller retries.
+     */
+    WaitStatus wait_for_capacity() {
+        if (!get_current_thread()) {
+            auto lock = util::make_unique_lock(mutex);
+            ++number_of_waiters;
+            native_cond.wait(lock, [this]() {
+                return has_capacity();
+            });
+            --number_of_waiters;
+            return WaitStatus::ready;
+        }
+
+        return suspend_current_thread([this](Waiter& waiter) {
+            auto lock = util::make_unique_lock(mutex);
+            // decremented by unregister
+            ++number_of_waiters;
+            if (has_capacity()) {
+                return false;
+            }
+            waiters.push_back(&waiter);
+            return true;
+        }, [this](Waiter& waiter) {
+            auto lock = util::make_unique_lock(mutex);
+            auto it = std::find(waiters.begin(), waiters.end(), &waiter);
+            if (it != waiters.end()) {
+                waiters.erase(it);
+            }
+            --number_of_waiters;
+        }, nullptr);
+    }
+};
+
+}
+}
+}
+
+#endif //USER_THREAD_ADMISSION_HPP
@@ -1,7 +1,19 @@
         .text
         .globl orks_private_call_with_alt_stack_arg3_impl
+        .type orks_private_call_with_alt_stack_arg3_impl, @function
+# root frame of user threads.
+# the return address is marked undefined and %rbp is cleared
+# so that both CFI and frame pointer unwinders stop here.
 orks_private_call_with_alt_stack_arg3_impl:
+	.cfi_startproc
 	movq %rcx, %rsp
+	.cfi_def_cfa %rsp, 0
+	.cfi_undefined %rip
+	xorl %ebp, %ebp
 	callq *%r8
     ud2
 	ret
+	.cfi_endproc
+        .size orks_private_call_with_alt_stack_arg3_impl, .-orks_private_call_with_alt_stack_arg3_impl
+
+        .section .note.GNU-stack,"",@progbits
@@ -0,0 +1,187 @@
+#ifndef USER_THREAD_CANCELLATION_HPP
+#define USER_THREAD_CANCELLATION_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "util.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * result of blocking operations of user threads.
+ */
+enum class WaitStatus {
+    ready, cancelled, timeout
+};
+
+/*
+ * thrown by blocking operations that return a value when the waiting thread was cancelled.
+ */
+class OperationCancelled : public std::runtime_error {
+public:
+    OperationCancelled() :
+        std::runtime_error("user thread was cancelled") {
+    }
+};
+
+/*
+ * exception reported for a thread discarded before its launch.
+ * the exception being handled if the launch failed, see Worker::acquire_stack(). OperationCancelled otherwise.
+ */
+inline std::exception_ptr exception_of_discarded_thread() {
+    if (std::exception_ptr e = std::current_exception()) {
+        return e;
+    }
+    return std::make_exception_ptr(OperationCancelled());
+}
+
+// a suspended user thread. defined in user-thread-internal.hpp
+struct Waiter;
+
+/*
+ * resume the waiter with status if no one resumed it yet.
+ * return false if it was already resumed.
+ * defined in user-thread-internal.hpp
+ */
+bool try_wake_waiter(Waiter& waiter, WaitStatus status);
+
+/*
+ * shared by user threads of a cancellation tree.
+ * cancel() wakes threads blocked in cancellable waits, and is propagated to child states.
+ */
+class CancellationState {
+    std::atomic_bool cancelled = { false };
+    std::mutex mutex;
+    std::vector<Waiter*> waiters;
+    std::vector<std::weak_ptr<CancellationState>> children;
+
+public:
+    bool is_cancelled() const {
+        return cancelled.load(std::memory_order_acquire);
+    }
+
+    void cancel() {
+        std::vector<std::shared_ptr<CancellationState>> children_to_cancel;
+        {
+            auto lock = util::make_unique_lock(mutex);
+            if (cancelled) {
+                return;
+            }
+            cancelled.store(true, std::memory_order_release);
+
+            // waiters are woken under the lock so that they are not removed during the wake
+            for (Waiter* waiter : waiters) {
+                try_wake_waiter(*waiter, WaitStatus::cancelled);
+            }
+            waiters.clear();
+
+            for (auto& weak_child : children) {
+                if (auto child = weak_child.lock()) {
+                    children_to_cancel.push_back(std::move(child));
+                }
+            }
+            children.clear();
+        }
+
+        for (auto& child : children_to_cancel) {
+            child->cancel();
+        }
+    }
+
+    /*
+     * return false and does not add waiter if already cancelled.
+     */
+    bool add_waiter(Waiter* waiter) {
+        auto lock = util::make_unique_lock(mutex);
+        if (cancelled) {
+            return false;
+        }
+        waiters.push_back(waiter);
+        return true;
+    }
+
+    void remove_waiter(Waiter* waiter) {
+        auto lock = util::make_unique_lock(mutex);
+        waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter), waiters.end());
+    }
+
+    static std::shared_ptr<CancellationState> create_child(const std::shared_ptr<CancellationState>& parent) {
+        auto child = std::make_shared<CancellationState>();
+        auto lock = util::make_unique_lock(parent->mutex);
+        if (parent->cancelled) {
+            child->cancelled = true;
+            return child;
+        }
+
+        // forget finished children
+        auto& children = parent->children;
+        children.erase(std::remove_if(children.begin(), children.end(), [](const std::weak_ptr<CancellationState>& c) {
+            return c.expired();
+        }), children.end());
+
+        children.push_back(child);
+        return child;
+    }
+};
+
+/*
+ * handle of a cancellation tree.
+ * user threads inherit the token of the creating thread unless ThreadAttributes::cancellation_token is given.
+ * default constructed token is empty.
+ */
+class CancellationToken {
+    std::shared_ptr<CancellationState> state;
+
+public:
+    CancellationToken() = default;
+
+    explicit CancellationToken(std::shared_ptr<CancellationState> state) :
+        state(std::move(state)) {
+    }
+
+    static CancellationToken create() {
+        return CancellationToken(std::make_shared<CancellationState>());
+    }
+
+    /*
+     * child token is cancelled when this token is cancelled, but not vice versa.
+     */
+    CancellationToken create_child() const {
+        if (!state) {
+            return create();
+        }
+        return CancellationToken(CancellationState::create_child(state));
+    }
+
+    void cancel() const {
+        if (state) {
+            state->cancel();
+        }
+    }
+
+    bool is_cancelled() const {
+        return state && state->is_cancelled();
+    }
+
+    bool valid() const {
+        return static_cast<bool>(state);
+    }
+
+    const std::shared_ptr<CancellationState>& get_state() const {
+        return state;
+    }
+};
+
+}
+}
+}
+
+#endif //USER_THREAD_CANCELLATION_HPP
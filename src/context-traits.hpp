@@ -8,6 +8,7 @@
 #include "thread-data/thread-data.hpp"
 #include "thread-data/splitstack-thread-data.hpp"
 #include "call_with_alt_stack_arg3.h"
+#include "thread-registry.hpp"
 
 #include "config.h"
 
@@ -34,19 +35,60 @@ void call_with_alt_stack_arg3(char* altstack, std::size_t altstack_size, void* f
 }
 
 
-struct BadDesignContextTraits {
 #ifdef USE_SPLITSTACKS
-    using ThreadData = splitstack::ThreadData;
+using ThreadDataOfTraits = splitstack::ThreadData;
+#else
+using ThreadDataOfTraits = baddesign::ThreadData;
+#endif
+
+#ifdef ORKS_USERTHREAD_THREAD_REGISTRY
+// defined in user-thread.cpp
+extern ThreadRegistry<ThreadDataOfTraits> thread_registry;
 #endif
+
+struct BadDesignContextTraits {
+    using ThreadData = ThreadDataOfTraits;
     using Context = ThreadData*;
 
+    // stack_size == 0 means default stack size
+    template <typename Fn>
+    static Context make_context(Fn fn, std::size_t stack_size = 0) {
+        Context ctx = ThreadData::create(std::move(fn), stack_size);
+#ifdef ORKS_USERTHREAD_THREAD_REGISTRY
+        thread_registry.add(ctx);
+#endif
+        return ctx;
+    }
+
+#ifndef USE_SPLITSTACKS
+    /*
+     * the context has no stack of its own. ctx->shared_stack *must* be set before its launch,
+     * and it must be run only by the owner of the stack after that.
+     */
     template <typename Fn>
-    static Context make_context(Fn fn) {
-        return ThreadData::create(std::move(fn));
+    static Context make_context_on_shared_stack(Fn fn) {
+        Context ctx = ThreadData::create_on_shared_stack(std::move(fn));
+#ifdef ORKS_USERTHREAD_THREAD_REGISTRY
+        thread_registry.add(ctx);
+#endif
+        return ctx;
     }
+#endif
 
-    static Context switch_context(Context next_thread, void* transfer_data = nullptr) {
-        return &switch_context_impl(*next_thread, transfer_data);
+    /*
+     * make a context that represents a native thread.
+     * it can be used as current_thread of switch_context() but can not be launched.
+     */
+    static void init_native_context(ThreadData& native) {
+        native.state = ThreadState::running;
+    }
+
+    /*
+     * save current context to current_thread and jump to next_thread.
+     * return the context that jumped back to current_thread.
+     */
+    static Context switch_context(Context current_thread, Context next_thread, void* transfer_data = nullptr) {
+        return &switch_context_impl(*current_thread, *next_thread, transfer_data);
     }
 
     static bool is_finished(Context ctx) {
@@ -54,44 +96,54 @@ struct BadDesignContextTraits {
     }
 
     static void destroy_context(Context ctx) {
+#ifdef ORKS_USERTHREAD_THREAD_REGISTRY
+        thread_registry.remove(ctx);
+#endif
         ThreadData::destroy((*ctx));
     }
 
-    void* get_transferred_data(Context ctx) {
-        return ctx->transferred_data;
+    static bool is_cancelled_before_launch(Context ctx) {
+        return ctx->state == ThreadState::before_launch && ctx->cancellation && ctx->cancellation->is_cancelled();
     }
 
-private:
-    static ThreadData& switch_context_impl(ThreadData& next_thread,
-                                           void* transfer_data = nullptr,
-                                           ThreadData* finished_thread = nullptr) {
-
-        ThreadData current_thread_ {nullptr, nullptr};
-        ThreadData* current_thread;
+    // destroy a context that was never launched
+    static void discard_context(Context ctx) {
+#ifdef ORKS_USERTHREAD_THREAD_REGISTRY
+        thread_registry.remove(ctx);
+#endif
+        ThreadData::discard(*ctx);
+    }
 
-        if (finished_thread == nullptr) {
-            current_thread = &current_thread_;
-            debug::printf("save current thread at %p\n", current_thread);
+    /*
+     * allocate the stack of a context before its launch. throws if the allocation fails.
+     * no-op if it has one. launching a context without calling this allocates it in the middle of the switch.
+     */
+    static void acquire_stack(Context ctx) {
+        ctx->acquire_stack();
+    }
 
-            current_thread->state = ThreadState::running;
+    static void* get_transferred_data(Context ctx) {
+        return ctx->transferred_data;
+    }
 
-        } else {
-            current_thread = finished_thread;
-            debug::printf("current thread %p is finished\n", current_thread);
-        }
+private:
+    static ThreadData& switch_context_impl(ThreadData& current_thread,
+                                           ThreadData& next_thread,
+                                           void* transfer_data = nullptr) {
 
+        debug::printf("save current thread at %p\n", &current_thread);
 
         ThreadData* previous_thread = 0;
         next_thread.transferred_data = transfer_data;
         if (next_thread.state == ThreadState::before_launch) {
             debug::printf("launch user thread!\n");
 
-            previous_thread = &context_switch_new_context(*current_thread, next_thread);
+            previous_thread = &context_switch_new_context(current_thread, next_thread);
 
         } else if (next_thread.state == ThreadState::running) {
             debug::printf("resume user thread %p!\n", &next_thread);
 
-            previous_thread = &context_switch(*current_thread, next_thread);
+            previous_thread = &context_switch(current_thread, next_thread);
 
         } else {
             debug::out << "next_thread " << &next_thread << " invalid state: " << static_cast<int>(next_thread.state)
@@ -119,6 +171,14 @@ private:
             return *from.pass_on_longjmp;
         }
         to.pass_on_longjmp = &from;
+#ifndef USE_SPLITSTACKS
+        if (occupy_shared_stack(to)) {
+            // this may be running on the shared stack
+            SharedStack& shared = *to.shared_stack;
+            call_with_alt_stack_arg3(shared.get_scratch(), shared.get_scratch_size(),
+                                     reinterpret_cast<void*>(restore_frames_and_jump), &to, nullptr, nullptr);
+        }
+#endif
         mylongjmp(to.env);
 
         const auto NEVER_COME_HERE = false;
@@ -131,6 +191,9 @@ private:
     __attribute__((always_inline))
     static ThreadData& context_switch_new_context(ThreadData& from, ThreadData& new_ctx) {
 
+        // no-op if acquired before the switch. before saving the context, because it allocates
+        new_ctx.acquire_stack();
+
         from.save_extra_context();
 
         if (mysetjmp(from.env)) {
@@ -140,6 +203,9 @@ private:
             return *from.pass_on_longjmp;
         }
         new_ctx.pass_on_longjmp = &from;
+#ifndef USE_SPLITSTACKS
+        occupy_shared_stack(new_ctx);
+#endif
         assert(new_ctx.get_stack() != 0);
         assert(new_ctx.get_stack_size() != 0);
         char* stack_frame = new_ctx.get_stack();
@@ -155,6 +221,30 @@ private:
     __attribute__((no_split_stack))
     static void entry_thread(ThreadData& thread_data);
 
+#ifndef USE_SPLITSTACKS
+    /*
+     * called after the registers of the switching thread were saved.
+     * the frames of the occupier are saved unless it ended.
+     * return true if the frames of next_thread must be restored.
+     */
+    static bool occupy_shared_stack(ThreadData& next_thread) {
+        SharedStack* shared = next_thread.shared_stack;
+        if (!shared || shared->occupier == &next_thread) {
+            return false;
+        }
+        if (shared->occupier && shared->occupier->state != ThreadState::ended) {
+            shared->occupier->save_frames();
+        }
+        shared->occupier = &next_thread;
+        return next_thread.state == ThreadState::running;
+    }
+
+    static void restore_frames_and_jump(ThreadData& thread_data) {
+        thread_data.restore_frames();
+        mylongjmp(thread_data.env);
+    }
+#endif
+
 };
 
 inline
@@ -174,7 +264,7 @@ void BadDesignContextTraits::entry_thread(ThreadData& thread_data) {
     thread_data.state = ThreadState::ended;
     debug::printf("end: %p\n", &thread_data);
 
-    switch_context_impl(*next, thread_data.transferred_data, &thread_data);
+    switch_context_impl(thread_data, *next, thread_data.transferred_data);
     // no return
     // this thread context will be deleted by next thread
 }
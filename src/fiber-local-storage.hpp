@@ -0,0 +1,151 @@
+#ifndef USER_THREAD_FIBER_LOCAL_STORAGE_HPP
+#define USER_THREAD_FIBER_LOCAL_STORAGE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "util.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+using FiberLocalKey = std::size_t;
+
+/*
+ * registry of dynamic fiber local keys and their destructors.
+ * deleted keys are reused like pthread keys. each key has a generation that is advanced by delete_key(),
+ * and values are stored with the generation they were set in,
+ * so that values left under a deleted key are never seen through the key that reuses it.
+ */
+class FiberLocalKeyRegistry {
+public:
+    static constexpr std::size_t max_keys = 1024;
+    using Destructor = void (*)(void*);
+
+private:
+    std::mutex mutex;
+    std::size_t number_of_keys = 0;
+    std::vector<FiberLocalKey> free_keys;
+    std::array<std::atomic<Destructor>, max_keys> destructors {};
+    std::array<std::atomic<std::uint64_t>, max_keys> generations {};
+
+public:
+    FiberLocalKey create_key(Destructor destructor) {
+        auto lock = util::make_unique_lock(mutex);
+        FiberLocalKey key;
+        if (!free_keys.empty()) {
+            key = free_keys.back();
+            free_keys.pop_back();
+        } else if (number_of_keys < max_keys) {
+            key = number_of_keys++;
+        } else {
+            throw std::length_error("create_fiber_local_key: too many keys");
+        }
+        destructors[key] = destructor;
+        return key;
+    }
+
+    void delete_key(FiberLocalKey key) {
+        auto lock = util::make_unique_lock(mutex);
+        if (key >= number_of_keys) {
+            throw std::out_of_range("delete_fiber_local_key: no such key");
+        }
+        destructors[key] = nullptr;
+        ++generations[key];
+        free_keys.push_back(key);
+    }
+
+    Destructor get_destructor(FiberLocalKey key) {
+        return destructors[key];
+    }
+
+    std::uint64_t get_generation(FiberLocalKey key) {
+        return generations[key].load(std::memory_order_relaxed);
+    }
+};
+
+inline FiberLocalKeyRegistry& get_fiber_local_key_registry() {
+    static FiberLocalKeyRegistry registry;
+    return registry;
+}
+
+/*
+ * storage of each user thread, placed in ThreadData.
+ * fixed slots are raw void* slots without destructors for the fastest access.
+ * values of dynamic keys are allocated on first set() and destructed at the end of the thread.
+ */
+class FiberLocalStorage {
+public:
+    static constexpr std::size_t number_of_fixed_slots = 8;
+
+private:
+    struct Value {
+        void* value = nullptr;
+        // FiberLocalKeyRegistry::get_generation() of the key at set()
+        std::uint64_t generation = 0;
+    };
+
+    std::array<void*, number_of_fixed_slots> fixed_slots {};
+    std::unique_ptr<std::vector<Value>> values;
+
+public:
+    void*& fixed_slot(std::size_t index) {
+        return fixed_slots[index];
+    }
+
+    // a value set under a deleted key is stale, and is not seen through the key that reuses it
+    void* get(FiberLocalKey key) const {
+        if (!values || key >= values->size()) {
+            return nullptr;
+        }
+        const Value& v = (*values)[key];
+        return v.generation == get_fiber_local_key_registry().get_generation(key) ? v.value : nullptr;
+    }
+
+    void set(FiberLocalKey key, void* value) {
+        if (!values) {
+            values = std::make_unique<std::vector<Value>>();
+        }
+        if (key >= values->size()) {
+            values->resize(key + 1);
+        }
+        (*values)[key] = Value { value, get_fiber_local_key_registry().get_generation(key) };
+    }
+
+    /*
+     * call destructors of non null values.
+     * values set by destructors are also destructed, up to max_destructor_iterations times
+     * like pthread keys.
+     */
+    void run_destructors() {
+        constexpr int max_destructor_iterations = 4;
+        auto& registry = get_fiber_local_key_registry();
+        bool called = true;
+        for (int i = 0; values && called && i < max_destructor_iterations; ++i) {
+            called = false;
+            for (FiberLocalKey key = 0; key < values->size(); ++key) {
+                void* value = get(key);
+                auto destructor = registry.get_destructor(key);
+                (*values)[key] = Value {};
+                if (value && destructor) {
+                    destructor(value);
+                    called = true;
+                }
+            }
+        }
+        fixed_slots.fill(nullptr);
+    }
+};
+
+}
+}
+}
+
+#endif //USER_THREAD_FIBER_LOCAL_STORAGE_HPP
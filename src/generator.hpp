@@ -0,0 +1,233 @@
+#ifndef USER_THREAD_GENERATOR_HPP
+#define USER_THREAD_GENERATOR_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#include "user-thread-internal.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * a stackful generator. the body runs on its own stack, and switches directly to and from the consumer.
+ * no work queue or worker is involved, so the body runs as a part of the consumer.
+ * a value passed to yield is handed to the consumer by address, without being copied.
+ * it is valid until the consumer advances the generator.
+ *
+ * usable from native threads and user threads. the body must not yield inside a catch handler,
+ * and must not suspend a consumer that runs on a shared stack.
+ */
+template <typename T>
+class Generator {
+    using ContextTraits = BadDesignContextTraits;
+    using Context = ContextTraits::Context;
+
+    // passed to the generator at each resume. lives on the stack of the consumer until the next yield.
+    struct Resume {
+        Context consumer;
+        bool cancel;
+        std::exception_ptr exception;
+    };
+
+    // thrown from yield to unwind the body of a generator destroyed before its end
+    struct Cancelled {
+    };
+
+public:
+    class Yield {
+        Context generator;
+        Resume* resume;
+
+        Yield(Context generator, Resume* resume) : generator(generator), resume(resume) {
+        }
+
+        friend class Generator;
+
+    public:
+        void operator()(T& value) {
+            ContextTraits::switch_context(generator, resume->consumer, std::addressof(value));
+            resume = static_cast<Resume*>(ContextTraits::get_transferred_data(generator));
+            if (resume->cancel) {
+                throw Cancelled {};
+            }
+        }
+
+        // the temporary lives until the consumer advances the generator
+        void operator()(T&& value) {
+            (*this)(value);
+        }
+    };
+
+    class iterator {
+        Generator* generator = nullptr;
+
+        explicit iterator(Generator* generator) : generator(generator) {
+        }
+
+        friend class Generator;
+
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = typename std::remove_cv<T>::type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+        iterator() = default;
+
+        reference operator*() const {
+            return *generator->current;
+        }
+
+        pointer operator->() const {
+            return generator->current;
+        }
+
+        iterator& operator++() {
+            if (!generator->advance()) {
+                generator = nullptr;
+            }
+            return *this;
+        }
+
+        void operator++(int) {
+            ++*this;
+        }
+
+        bool operator==(const iterator& other) const {
+            return generator == other.generator;
+        }
+
+        bool operator!=(const iterator& other) const {
+            return generator != other.generator;
+        }
+    };
+
+    /*
+     * body(yield) is called on the first advance, with a Generator<T>::Yield.
+     * stack_size == 0 means the default stack size.
+     */
+    template <typename Body>
+    explicit Generator(Body body, std::size_t stack_size = 0) {
+        context = ContextTraits::make_context([body = std::move(body)](Context consumer) mutable -> Context {
+            // the first switch passes the context of the generator, which the entry function does not know
+            auto first = static_cast<std::pair<Context, Resume*>*>(ContextTraits::get_transferred_data(consumer));
+            Yield yield(first->first, first->second);
+            try {
+                body(yield);
+            } catch (Cancelled&) {
+            } catch (...) {
+                yield.resume->exception = std::current_exception();
+            }
+            return yield.resume->consumer;
+        }, stack_size);
+        context->spawn_site = reinterpret_cast<const void*>(&spawn_site_of<Body>);
+    }
+
+    Generator(Generator&& other) noexcept
+        : context(other.context)
+        , current(other.current)
+        , started(other.started) {
+        other.context = nullptr;
+    }
+
+    Generator& operator=(Generator&& other) noexcept {
+        if (this != &other) {
+            destroy();
+            context = other.context;
+            current = other.current;
+            started = other.started;
+            other.context = nullptr;
+        }
+        return *this;
+    }
+
+    Generator(const Generator&) = delete;
+    Generator& operator=(const Generator&) = delete;
+
+    // unwinds the body if it has not finished
+    ~Generator() {
+        destroy();
+    }
+
+    /*
+     * runs the body to the first value at the first call.
+     * an exception from the body is thrown from begin() or operator++ of the iterator.
+     */
+    iterator begin() {
+        if (!started) {
+            started = true;
+            advance();
+        }
+        return iterator(context ? this : nullptr);
+    }
+
+    iterator end() {
+        return iterator();
+    }
+
+private:
+    Context context = nullptr;
+    T* current = nullptr;
+    bool started = false;
+
+    // runs the body to its next value. returns false at the end.
+    bool advance() {
+        assert(context);
+        Resume resume { nullptr, false, nullptr };
+        current = switch_to_generator(resume);
+        if (current) {
+            return true;
+        }
+        if (resume.exception) {
+            std::rethrow_exception(resume.exception);
+        }
+        return false;
+    }
+
+    // returns the yielded value, or nullptr if the body finished. then the context is destroyed.
+    T* switch_to_generator(Resume& resume) {
+        // the generator switches back to this context. it is only a place to save registers.
+        ContextTraits::ThreadData consumer {nullptr, nullptr};
+        ContextTraits::init_native_context(consumer);
+        std::pair<Context, Resume*> first { context, &resume };
+        consumer.transferred_data = &first;
+        resume.consumer = &consumer;
+
+        ContextTraits::switch_context(&consumer, context, &resume);
+
+        if (!ContextTraits::is_finished(context)) {
+            return static_cast<T*>(ContextTraits::get_transferred_data(&consumer));
+        }
+        ContextTraits::destroy_context(context);
+        context = nullptr;
+        return nullptr;
+    }
+
+    void destroy() {
+        if (!context) {
+            return;
+        }
+        if (!started) {
+            ContextTraits::discard_context(context);
+            context = nullptr;
+            return;
+        }
+        // the body may catch Cancelled and yield again
+        Resume resume { nullptr, true, nullptr };
+        while (switch_to_generator(resume)) {
+        }
+    }
+};
+
+}
+}
+}
+
+#endif //USER_THREAD_GENERATOR_HPP
@@ -0,0 +1,159 @@
+#ifndef USER_THREAD_HANDOFF_HPP
+#define USER_THREAD_HANDOFF_HPP
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include "util.hpp"
+#include "sync.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * an endpoint of directed handoff between user threads.
+ * a thread waits on it by wait(), and another thread switches directly to that thread by yield_to() with a pointer,
+ * which wait() returns. the work queues are not involved, so a message costs one context switch.
+ * copies refer to the same endpoint, which lives while any copy does.
+ * one thread at a time may wait on it. the thread is woken by cancellation as well.
+ * data of a thread on a shared stack *must not* point to its stack: the frames are moved out when the target runs.
+ */
+class HandoffPoint {
+    struct State {
+        std::mutex mutex;
+        // the thread in wait()
+        Waiter* receiver = nullptr;
+        // passed to receiver by the thread that took it over
+        void* data = nullptr;
+        // threads in yield_to() waiting for a receiver
+        std::deque<Waiter*> senders;
+    };
+
+    std::shared_ptr<State> state;
+
+public:
+    HandoffPoint() :
+        state(std::make_shared<State>()) {
+    }
+
+    /*
+     * suspend the calling user thread until a thread hands off to this point. return the data of the handoff.
+     * throws OperationCancelled if the calling thread was cancelled.
+     */
+    void* wait() {
+        check_caller("HandoffPoint::wait");
+        return receive(nullptr);
+    }
+
+    /*
+     * switch directly to the thread waiting on this point, whose wait() returns data.
+     * the calling thread is queued as if by scheduling_yield().
+     * if no thread waits yet, the calling thread is suspended until one does.
+     * a receiver pinned to another worker is resumed there, and the calling thread continues.
+     * throws OperationCancelled if the calling thread was cancelled before the handoff.
+     */
+    void yield_to(void* data) {
+        check_caller("HandoffPoint::yield_to");
+        if (Work receiver = hand_to_receiver(data)) {
+            get_worker_of_this_native_thread().hand_off(receiver);
+        }
+    }
+
+    /*
+     * yield_to() and then reply_point.wait(), in one context switch.
+     * for request and reply between a pair of threads.
+     */
+    void* yield_to_and_wait(void* data, HandoffPoint& reply_point) {
+        check_caller("HandoffPoint::yield_to_and_wait");
+        if (reply_point.state == state) {
+            throw std::invalid_argument("HandoffPoint::yield_to_and_wait: the reply point is this point");
+        }
+        return reply_point.receive(hand_to_receiver(data));
+    }
+
+private:
+    static void check_caller(const char* what) {
+        if (!get_current_thread()) {
+            throw std::logic_error(std::string(what) + ": not called from a user thread");
+        }
+    }
+
+    // next is a receiver of another point that is switched to instead of a queued thread
+    void* receive(Work next) {
+        State& s = *state;
+        void* data = nullptr;
+        const WaitStatus status = suspend_current_thread([&s](Waiter & waiter) {
+            auto lock = util::make_unique_lock(s.mutex);
+            assert(!s.receiver);
+            s.receiver = &waiter;
+            // one of the senders retries
+            while (!s.senders.empty()) {
+                Waiter* sender = s.senders.front();
+                s.senders.pop_front();
+                if (try_wake_waiter(*sender, WaitStatus::ready)) {
+                    break;
+                }
+            }
+            return true;
+        }, [&s, &data](Waiter & waiter) {
+            auto lock = util::make_unique_lock(s.mutex);
+            if (s.receiver == &waiter) {
+                s.receiver = nullptr;
+            }
+            data = s.data;
+        }, nullptr, next);
+
+        if (status == WaitStatus::cancelled) {
+            throw OperationCancelled();
+        }
+        return data;
+    }
+
+    /*
+     * take the receiver over and pass data to it. suspend the calling thread until there is one.
+     * return the receiver to switch to, or nullptr if it is resumed by its registration.
+     */
+    Work hand_to_receiver(void* data) {
+        State& s = *state;
+        for (;;) {
+            {
+                auto lock = util::make_unique_lock(s.mutex);
+                if (Waiter* receiver = s.receiver) {
+                    s.receiver = nullptr;
+                    Work thread;
+                    if (try_take_over_waiter(*receiver, WaitStatus::ready, thread)) {
+                        s.data = data;
+                        return thread;
+                    }
+                    // woken by cancellation
+                }
+            }
+
+            const WaitStatus status = suspend_current_thread([&s](Waiter & waiter) {
+                auto lock = util::make_unique_lock(s.mutex);
+                if (s.receiver) {
+                    return false;
+                }
+                s.senders.push_back(&waiter);
+                return true;
+            }, [&s](Waiter & waiter) {
+                auto lock = util::make_unique_lock(s.mutex);
+                s.senders.erase(std::remove(s.senders.begin(), s.senders.end(), &waiter), s.senders.end());
+            }, nullptr);
+            if (status == WaitStatus::cancelled) {
+                throw OperationCancelled();
+            }
+        }
+    }
+};
+
+}
+}
+}
+
+#endif //USER_THREAD_HANDOFF_HPP
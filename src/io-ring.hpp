@@ -0,0 +1,400 @@
+#ifndef USER_THREAD_IO_RING_HPP
+#define USER_THREAD_IO_RING_HPP
+
+#include <algorithm>
+#include <bitset>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "util.hpp"
+
+#ifdef ORKS_USERTHREAD_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * completion of an I/O request submitted to IoRing.
+ * its address is the user_data of the request.
+ */
+struct IoCompletion {
+    // result is the return value of the system call, or -errno
+    void (*on_complete)(IoCompletion& self, std::int32_t result);
+};
+
+#ifdef ORKS_USERTHREAD_IO_URING
+
+/*
+ * io_uring instance of one worker, without liburing.
+ * must be used only from the native thread of the worker, except register_*() and request_cancel().
+ * submissions are queued by try_prepare() and entered to the kernel at once by submit().
+ */
+class IoRing {
+    int ring_fd = -1;
+    io_uring_params params {};
+
+    void* sq_ring = MAP_FAILED;
+    std::size_t sq_ring_size = 0;
+    void* cq_ring = MAP_FAILED;
+    std::size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    // prepared but not entered yet
+    unsigned number_of_prepared = 0;
+    // entered but not reaped yet
+    unsigned number_of_in_flight = 0;
+
+    // opcodes of the running kernel. see probe()
+    std::bitset<256> supported_opcodes;
+
+    // requests to cancel and completions of the cancels, from any native thread. see request_cancel()
+    std::mutex cancel_mutex;
+    std::vector<std::pair<IoCompletion*, IoCompletion*>> cancels;
+
+public:
+    // bumped by the registry each time registered files or buffers are applied
+    std::uint64_t registration_generation = 0;
+
+    /*
+     * throws std::system_error if io_uring is not available on the running kernel.
+     */
+    explicit IoRing(unsigned entries) {
+        const int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+        }
+        ring_fd = fd;
+
+        try {
+            map_rings();
+        } catch (...) {
+            unmap_rings();
+            throw;
+        }
+        probe();
+    }
+
+    IoRing(const IoRing&) = delete;
+
+    ~IoRing() {
+        unmap_rings();
+    }
+
+    /*
+     * return false if the request can not be queued now, because the submission queue is full
+     * or more requests are in flight than the completion queue can hold.
+     */
+    bool try_prepare(const io_uring_sqe& sqe) {
+        if (number_of_prepared + number_of_in_flight >= params.cq_entries) {
+            return false;
+        }
+        const unsigned tail = *sq_tail;
+        if (tail - load_acquire(sq_head) >= params.sq_entries) {
+            return false;
+        }
+        const unsigned index = tail & sq_mask;
+        sqes[index] = sqe;
+        sq_array[index] = index;
+        store_release(sq_tail, tail + 1);
+        ++number_of_prepared;
+        return true;
+    }
+
+    unsigned get_number_of_prepared() const {
+        return number_of_prepared;
+    }
+
+    // requests of other opcodes are offloaded
+    bool supports(unsigned opcode) const {
+        return opcode < supported_opcodes.size() && supported_opcodes.test(opcode);
+    }
+
+    /*
+     * cancel the request of target by IORING_OP_ASYNC_CANCEL. may be called from any native thread.
+     * the cancel is prepared at the next scheduling point of the worker, and completes to cancel.
+     * target still completes, with -ECANCELED unless it was too late.
+     * return false if the kernel can not cancel requests. cancel does not complete then.
+     */
+    bool request_cancel(IoCompletion& target, IoCompletion& cancel) {
+        if (!supports(IORING_OP_ASYNC_CANCEL)) {
+            return false;
+        }
+        auto lock = util::make_unique_lock(cancel_mutex);
+        cancels.emplace_back(&target, &cancel);
+        return true;
+    }
+
+    // prepare cancels requested by request_cancel(). the ones that do not fit are retried by next call.
+    void prepare_cancels() {
+        auto lock = util::make_unique_lock(cancel_mutex);
+        while (!cancels.empty()) {
+            io_uring_sqe sqe {};
+            sqe.opcode = IORING_OP_ASYNC_CANCEL;
+            sqe.fd = -1;
+            sqe.addr = reinterpret_cast<std::uintptr_t>(cancels.back().first);
+            sqe.user_data = reinterpret_cast<std::uintptr_t>(cancels.back().second);
+            if (!try_prepare(sqe)) {
+                return;
+            }
+            cancels.pop_back();
+        }
+    }
+
+    // prepared or in flight
+    bool is_busy() const {
+        return number_of_prepared + number_of_in_flight != 0;
+    }
+
+    /*
+     * enter prepared requests to the kernel.
+     * requests that the kernel did not take now are retried by next submit().
+     */
+    void submit() {
+        if (number_of_prepared != 0) {
+            enter(number_of_prepared, 0, 0, nullptr);
+        }
+    }
+
+    /*
+     * call IoCompletion::on_complete of completed requests without blocking.
+     * return the number of them.
+     */
+    unsigned reap() {
+        unsigned head = *cq_head;
+        const unsigned tail = load_acquire(cq_tail);
+        const unsigned n = tail - head;
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes[head & cq_mask];
+            auto* completion = reinterpret_cast<IoCompletion*>(static_cast<std::uintptr_t>(cqe.user_data));
+            const std::int32_t result = cqe.res;
+            // release the entry before the completion resumes a thread
+            store_release(cq_head, head + 1);
+            completion->on_complete(*completion, result);
+        }
+        number_of_in_flight -= n;
+        return n;
+    }
+
+    /*
+     * submit prepared requests and block until a request completes or timeout.
+     * the timeout is ignored if the kernel can not wait with timeout (older than 5.11).
+     */
+    void submit_and_wait(std::chrono::microseconds timeout) {
+        if (!(params.features & IORING_FEAT_EXT_ARG)) {
+            enter(number_of_prepared, 1, IORING_ENTER_GETEVENTS, nullptr);
+            return;
+        }
+
+        __kernel_timespec ts {};
+        ts.tv_sec = timeout.count() / 1000000;
+        ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+        io_uring_getevents_arg arg {};
+        arg.ts = reinterpret_cast<std::uintptr_t>(&ts);
+        enter(number_of_prepared, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+    }
+
+    /*
+     * replace registered files. requests with IOSQE_FIXED_FILE use indexes of fds.
+     * throws std::system_error.
+     */
+    void register_files(const std::vector<int>& fds) {
+        ::syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_FILES, nullptr, 0);
+        if (!fds.empty()) {
+            register_or_throw(IORING_REGISTER_FILES, fds.data(), fds.size(), "io_uring_register files");
+        }
+    }
+
+    /*
+     * replace registered buffers used by IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED.
+     * throws std::system_error.
+     */
+    void register_buffers(const std::vector<iovec>& buffers) {
+        ::syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        if (!buffers.empty()) {
+            register_or_throw(IORING_REGISTER_BUFFERS, buffers.data(), buffers.size(), "io_uring_register buffers");
+        }
+    }
+
+private:
+    static unsigned load_acquire(const unsigned* p) {
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    }
+
+    static void store_release(unsigned* p, unsigned value) {
+        __atomic_store_n(p, value, __ATOMIC_RELEASE);
+    }
+
+    void enter(unsigned to_submit, unsigned min_complete, unsigned flags, io_uring_getevents_arg* arg) {
+        const int submitted = static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                                                         arg, arg ? sizeof(*arg) : 0));
+        if (submitted > 0) {
+            number_of_prepared -= submitted;
+            number_of_in_flight += submitted;
+        }
+        // EAGAIN, EBUSY, EINTR and ETIME are retried by the caller at next scheduling point
+    }
+
+    void register_or_throw(unsigned opcode, const void* arg, std::size_t n, const char* what) {
+        if (::syscall(__NR_io_uring_register, ring_fd, opcode, arg, n) < 0) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+    }
+
+    /*
+     * record the opcodes the kernel supports by IORING_REGISTER_PROBE.
+     * kernels older than 5.6 can not probe, and are assumed to support only the opcodes of 5.1.
+     */
+    void probe() {
+        constexpr unsigned number_of_ops = 256;
+        const std::size_t size = sizeof(io_uring_probe) + number_of_ops * sizeof(io_uring_probe_op);
+        // zeroed, as the kernel requires
+        std::unique_ptr<char[]> buffer(new char[size]());
+        auto* p = reinterpret_cast<io_uring_probe*>(buffer.get());
+        if (::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, p, number_of_ops) < 0) {
+            for (unsigned opcode : {
+                        IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_FSYNC, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED
+                    }) {
+                supported_opcodes.set(opcode);
+            }
+            return;
+        }
+        for (unsigned i = 0; i < std::min<unsigned>(p->ops_len, number_of_ops); ++i) {
+            if (p->ops[i].flags & IO_URING_OP_SUPPORTED) {
+                supported_opcodes.set(p->ops[i].op);
+            }
+        }
+    }
+
+    void* map(std::size_t size, off_t offset) {
+        void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        if (p == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap io_uring");
+        }
+        return p;
+    }
+
+    void map_rings() {
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = map(cq_ring_size, IORING_OFF_CQ_RING);
+        }
+        sqes = static_cast<io_uring_sqe*>(map(params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+
+        char* sq = static_cast<char*>(sq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        char* cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    void unmap_rings() {
+        if (sqes != MAP_FAILED) {
+            ::munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        }
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            ::munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != MAP_FAILED) {
+            ::munmap(sq_ring, sq_ring_size);
+        }
+        if (ring_fd >= 0) {
+            ::close(ring_fd);
+        }
+    }
+};
+
+#else
+
+/*
+ * built without io_uring. I/O of user threads always uses the blocking offload.
+ */
+class IoRing {
+public:
+    std::uint64_t registration_generation = 0;
+
+    explicit IoRing(unsigned) {
+        throw std::system_error(ENOSYS, std::generic_category(), "io_uring_setup");
+    }
+
+    unsigned get_number_of_prepared() const {
+        return 0;
+    }
+
+    bool supports(unsigned) const {
+        return false;
+    }
+
+    bool request_cancel(IoCompletion&, IoCompletion&) {
+        return false;
+    }
+
+    void prepare_cancels() {
+    }
+
+    bool is_busy() const {
+        return false;
+    }
+
+    void submit() {
+    }
+
+    unsigned reap() {
+        return 0;
+    }
+
+    void submit_and_wait(std::chrono::microseconds) {
+    }
+
+    void register_files(const std::vector<int>&) {
+    }
+
+    void register_buffers(const std::vector<iovec>&) {
+    }
+};
+
+#endif
+
+}
+}
+}
+
+#endif //USER_THREAD_IO_RING_HPP
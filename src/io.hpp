@@ -0,0 +1,490 @@
+#ifndef USER_THREAD_IO_HPP
+#define USER_THREAD_IO_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "util.hpp"
+#include "io-ring.hpp"
+#include "user-thread-internal.hpp"
+#include "sync.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+// index of a file registered by register_io_files()
+struct RegisteredFile {
+    int index;
+};
+
+/*
+ * parameters of one I/O request, common to io_uring and the blocking offload.
+ */
+struct IoOperation {
+    enum Opcode {
+        read, write, fsync, openat
+    };
+
+    // the most one read or write transfers on Linux. longer ones are split by read_at() and write_at()
+    static constexpr std::size_t max_length = 0x7ffff000;
+
+    Opcode opcode;
+    // dirfd of openat. index of registered files if fixed_file.
+    int fd;
+    bool fixed_file = false;
+    void* buffer = nullptr;
+    // at most max_length
+    std::size_t length = 0;
+    off_t offset = 0;
+    // index of registered buffers, or -1
+    int buffer_index = -1;
+    const char* path = nullptr;
+    int flags = 0;
+    mode_t mode = 0;
+
+    /*
+     * return the result of the system call or -errno.
+     * fd is the resolved one if fixed_file.
+     */
+    std::int32_t call_blocking(int resolved_fd) const {
+        assert(length <= max_length);
+        long result = -1;
+        switch (opcode) {
+        case read:
+            result = ::pread(resolved_fd, buffer, length, offset);
+            break;
+        case write:
+            result = ::pwrite(resolved_fd, buffer, length, offset);
+            break;
+        case fsync:
+            result = ::fsync(resolved_fd);
+            break;
+        case openat:
+            result = ::openat(resolved_fd, path, flags, mode);
+            break;
+        }
+        return result < 0 ? -errno : static_cast<std::int32_t>(result);
+    }
+
+#ifdef ORKS_USERTHREAD_IO_URING
+    io_uring_sqe make_sqe(IoCompletion& completion) const {
+        io_uring_sqe sqe {};
+        sqe.fd = fd;
+        sqe.flags = fixed_file ? IOSQE_FIXED_FILE : 0;
+        sqe.user_data = reinterpret_cast<std::uintptr_t>(&completion);
+        switch (opcode) {
+        case read:
+        case write:
+            if (buffer_index >= 0) {
+                sqe.opcode = opcode == read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                sqe.buf_index = static_cast<std::uint16_t>(buffer_index);
+            } else {
+                sqe.opcode = opcode == read ? IORING_OP_READ : IORING_OP_WRITE;
+            }
+            sqe.addr = reinterpret_cast<std::uintptr_t>(buffer);
+            assert(length <= max_length);
+            sqe.len = static_cast<std::uint32_t>(length);
+            sqe.off = offset;
+            break;
+        case fsync:
+            sqe.opcode = IORING_OP_FSYNC;
+            break;
+        case openat:
+            sqe.opcode = IORING_OP_OPENAT;
+            sqe.addr = reinterpret_cast<std::uintptr_t>(path);
+            sqe.len = mode;
+            sqe.open_flags = flags;
+            break;
+        }
+        return sqe;
+    }
+#endif
+};
+
+/*
+ * process wide registered files and buffers.
+ * each ring applies them lazily at its next request, on the native thread of its worker.
+ */
+class IoRegistry {
+    std::mutex mutex;
+    std::vector<int> files;
+    std::vector<iovec> buffers;
+    std::uint64_t generation = 0;
+
+public:
+    void set_files(std::vector<int> fds) {
+        auto lock = util::make_unique_lock(mutex);
+        files = std::move(fds);
+        ++generation;
+    }
+
+    void set_buffers(std::vector<iovec> new_buffers) {
+        auto lock = util::make_unique_lock(mutex);
+        buffers = std::move(new_buffers);
+        ++generation;
+    }
+
+    // return -EBADF if not registered
+    int resolve_file(int index) {
+        auto lock = util::make_unique_lock(mutex);
+        if (index < 0 || static_cast<std::size_t>(index) >= files.size()) {
+            return -EBADF;
+        }
+        return files[index];
+    }
+
+    /*
+     * return false if the ring could not register them.
+     * the request is offloaded then.
+     */
+    bool apply_to(IoRing& ring) {
+        auto lock = util::make_unique_lock(mutex);
+        if (ring.registration_generation == generation) {
+            return true;
+        }
+        try {
+            ring.register_files(files);
+            ring.register_buffers(buffers);
+        } catch (const std::system_error&) {
+            return false;
+        }
+        ring.registration_generation = generation;
+        return true;
+    }
+};
+
+inline IoRegistry& get_io_registry() {
+    static IoRegistry registry;
+    return registry;
+}
+
+/*
+ * native threads that run blocking system calls for user threads,
+ * used when io_uring is not available or its queues are full.
+ */
+class BlockingOffload {
+    struct Job {
+        IoOperation operation;
+        IoCompletion* completion;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+
+public:
+    explicit BlockingOffload(unsigned number_of_threads) {
+        for (unsigned i = 0; i < number_of_threads; ++i) {
+            threads.emplace_back([this]() {
+                run();
+            });
+        }
+    }
+
+    BlockingOffload(const BlockingOffload&) = delete;
+
+    ~BlockingOffload() {
+        {
+            auto lock = util::make_unique_lock(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void add(const IoOperation& operation, IoCompletion& completion) {
+        {
+            auto lock = util::make_unique_lock(mutex);
+            jobs.push_back(Job { operation, &completion });
+        }
+        cond.notify_one();
+    }
+
+    /*
+     * remove the job of completion if no thread took it yet.
+     * return false if it is running or completed. it completes as usual then.
+     */
+    bool remove(IoCompletion& completion) {
+        auto lock = util::make_unique_lock(mutex);
+        auto it = std::find_if(jobs.begin(), jobs.end(), [&completion](const Job & job) {
+            return job.completion == &completion;
+        });
+        if (it == jobs.end()) {
+            return false;
+        }
+        jobs.erase(it);
+        return true;
+    }
+
+private:
+    void run() {
+        auto lock = util::make_unique_lock(mutex);
+        while (true) {
+            cond.wait(lock, [this]() {
+                return stopping || !jobs.empty();
+            });
+            if (jobs.empty()) {
+                return;
+            }
+            Job job = jobs.front();
+            jobs.pop_front();
+
+            lock.unlock();
+            const auto result = call_resolved(job.operation);
+            job.completion->on_complete(*job.completion, result);
+            lock.lock();
+        }
+    }
+
+public:
+    static std::int32_t call_resolved(const IoOperation& operation) {
+        int fd = operation.fd;
+        if (operation.fixed_file) {
+            fd = get_io_registry().resolve_file(operation.fd);
+            if (fd < 0) {
+                return fd;
+            }
+        }
+        return operation.call_blocking(fd);
+    }
+};
+
+inline BlockingOffload& get_blocking_offload() {
+    static BlockingOffload offload(std::max(4u, std::thread::hardware_concurrency()));
+    return offload;
+}
+
+/*
+ * run the request and return the result of the system call or -errno.
+ * user threads are suspended until it completes, without blocking their worker.
+ * the request is submitted to the io_uring of the worker if the kernel supports its opcode,
+ * or else to the blocking offload.
+ * cancellation of the calling thread cancels the request by IORING_OP_ASYNC_CANCEL, or removes it from the offload
+ * if it is not running yet. the thread still waits until the kernel finished with the buffer,
+ * and -ECANCELED is returned unless the request completed anyway.
+ */
+inline std::int32_t perform_io(const IoOperation& operation) {
+    Work self = get_current_thread();
+    if (!self) {
+        return BlockingOffload::call_resolved(operation);
+    }
+
+    struct Request : IoCompletion {
+        struct Cancel : IoCompletion {
+            Request* request;
+        };
+
+        Cancel cancel;
+        std::mutex mutex;
+        // the request, and its cancel if requested, not completed yet
+        int pending = 1;
+        std::int32_t result = -ECANCELED;
+        // woken when pending becomes 0
+        Waiter* waiter = nullptr;
+
+        Request() {
+            on_complete = [](IoCompletion & completion, std::int32_t result) {
+                static_cast<Request&>(completion).complete(&result);
+            };
+            cancel.request = this;
+            cancel.on_complete = [](IoCompletion & completion, std::int32_t) {
+                static_cast<Cancel&>(completion).request->complete(nullptr);
+            };
+        }
+
+        // result is nullptr for the cancel. the woken thread takes the lock before it destroys this.
+        void complete(const std::int32_t* completed_result) {
+            auto lock = util::make_unique_lock(mutex);
+            if (completed_result) {
+                result = *completed_result;
+            }
+            if (--pending == 0 && waiter) {
+                try_wake_waiter(*waiter, WaitStatus::ready);
+            }
+        }
+    };
+
+    WaitRecord<Request> record(self);
+    Request& request = *record;
+    IoRing* submitted_ring = nullptr;
+    bool offloaded = false;
+    const WaitStatus status = suspend_current_thread([&](Waiter & waiter) {
+        // on the same worker after the switch. the ring is entered at its next scheduling point.
+        request.waiter = &waiter;
+#ifdef ORKS_USERTHREAD_IO_URING
+        IoRing* ring = get_worker_of_this_native_thread().get_io_ring();
+        const io_uring_sqe sqe = operation.make_sqe(request);
+        const bool uses_registered = operation.fixed_file || operation.buffer_index >= 0;
+        if (ring && ring->supports(sqe.opcode) && (!uses_registered || get_io_registry().apply_to(*ring)) &&
+                ring->try_prepare(sqe)) {
+            submitted_ring = ring;
+        }
+#endif
+        if (!submitted_ring) {
+            get_blocking_offload().add(operation, request);
+            offloaded = true;
+        }
+        return true;
+    }, [&request](Waiter&) {
+        auto lock = util::make_unique_lock(request.mutex);
+        request.waiter = nullptr;
+    }, nullptr);
+
+    if (status == WaitStatus::cancelled && (submitted_ring || offloaded)) {
+        auto lock = util::make_unique_lock(request.mutex);
+        if (request.pending != 0) {
+            if (submitted_ring && submitted_ring->request_cancel(request, request.cancel)) {
+                ++request.pending;
+            } else if (offloaded && get_blocking_offload().remove(request)) {
+                request.pending = 0;
+            }
+        }
+        lock.unlock();
+
+        // the kernel may still use the buffer
+        suspend_current_thread_until_woken([&request](Waiter & waiter) {
+            auto lock = util::make_unique_lock(request.mutex);
+            if (request.pending == 0) {
+                return false;
+            }
+            request.waiter = &waiter;
+            return true;
+        });
+        // woken by complete() that may still hold the lock
+        lock.lock();
+    }
+    return request.result;
+}
+
+/*
+ * throws OperationCancelled if the request was cancelled, and std::system_error if it failed.
+ */
+inline std::int32_t perform_io_or_throw(const IoOperation& operation, const char* what) {
+    const auto result = perform_io(operation);
+    if (result == -ECANCELED) {
+        throw OperationCancelled();
+    }
+    if (result < 0) {
+        throw std::system_error(-result, std::generic_category(), what);
+    }
+    return result;
+}
+
+/*
+ * read or write in requests of at most IoOperation::max_length, until the whole length or a short transfer.
+ * return the bytes transferred.
+ */
+inline std::size_t perform_rw_io(IoOperation operation, const char* what) {
+    const std::size_t length = operation.length;
+    std::size_t done = 0;
+    while (true) {
+        const std::size_t rest = length - done;
+        operation.length = rest < IoOperation::max_length ? rest : IoOperation::max_length;
+        const std::size_t n = perform_io_or_throw(operation, what);
+        done += n;
+        if (n < operation.length || done == length) {
+            return done;
+        }
+        operation.buffer = static_cast<char*>(operation.buffer) + n;
+        operation.offset += n;
+    }
+}
+
+inline IoOperation make_io_operation(IoOperation::Opcode opcode, int fd) {
+    IoOperation operation;
+    operation.opcode = opcode;
+    operation.fd = fd;
+    return operation;
+}
+
+inline IoOperation make_io_operation(IoOperation::Opcode opcode, RegisteredFile file) {
+    IoOperation operation;
+    operation.opcode = opcode;
+    operation.fd = file.index;
+    operation.fixed_file = true;
+    return operation;
+}
+
+/*
+ * pread() that suspends only the calling user thread.
+ * file is a fd or RegisteredFile. buffer_index is an index of register_io_buffers() that contains buffer, or -1.
+ * throws std::system_error.
+ */
+template <typename File>
+std::size_t read_at(File file, void* buffer, std::size_t length, off_t offset, int buffer_index = -1) {
+    auto operation = make_io_operation(IoOperation::read, file);
+    operation.buffer = buffer;
+    operation.length = length;
+    operation.offset = offset;
+    operation.buffer_index = buffer_index;
+    return perform_rw_io(operation, "read_at");
+}
+
+// pwrite() that suspends only the calling user thread. see read_at()
+template <typename File>
+std::size_t write_at(File file, const void* buffer, std::size_t length, off_t offset, int buffer_index = -1) {
+    auto operation = make_io_operation(IoOperation::write, file);
+    operation.buffer = const_cast<void*>(buffer);
+    operation.length = length;
+    operation.offset = offset;
+    operation.buffer_index = buffer_index;
+    return perform_rw_io(operation, "write_at");
+}
+
+/*
+ * fsync() that suspends only the calling user thread.
+ * not named fsync, so that unqualified calls never silently pick the blocking one.
+ */
+template <typename File>
+void sync_file(File file) {
+    perform_io_or_throw(make_io_operation(IoOperation::fsync, file), "sync_file");
+}
+
+// openat() that suspends only the calling user thread. return the new fd.
+inline int open_at(int dirfd, const char* path, int flags, mode_t mode = 0) {
+    auto operation = make_io_operation(IoOperation::openat, dirfd);
+    operation.path = path;
+    operation.flags = flags;
+    operation.mode = mode;
+    return perform_io_or_throw(operation, "open_at");
+}
+
+/*
+ * replace the registered files of all workers. RegisteredFile{i} refers fds[i].
+ * must not be called while requests with registered files are running.
+ */
+inline void register_io_files(std::vector<int> fds) {
+    get_io_registry().set_files(std::move(fds));
+}
+
+/*
+ * replace the registered buffers of all workers. buffer_index i of read_at() and write_at() refers buffers[i].
+ * must not be called while requests with registered buffers are running.
+ */
+inline void register_io_buffers(std::vector<iovec> buffers) {
+    get_io_registry().set_buffers(std::move(buffers));
+}
+
+}
+}
+}
+
+#endif //USER_THREAD_IO_HPP
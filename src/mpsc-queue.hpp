@@ -0,0 +1,89 @@
+#ifndef USER_THREAD_MPSC_QUEUE_HPP
+#define USER_THREAD_MPSC_QUEUE_HPP
+
+#include <atomic>
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * lock-free multi producer queue.
+ * consumers take all elements at once, so more than one consumer is also safe (no ABA problem).
+ */
+template <typename T>
+class MpscQueue {
+    struct Node {
+        T value;
+        Node* next;
+    };
+
+    std::atomic<Node*> head = { nullptr };
+
+public:
+    MpscQueue() = default;
+    MpscQueue(const MpscQueue&) = delete;
+
+    ~MpscQueue() {
+        consume_all([](T&) {});
+    }
+
+    void push(T t) {
+        Node* node = new Node { std::move(t), head.load(std::memory_order_relaxed) };
+        while (!head.compare_exchange_weak(node->next, node,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+        }
+    }
+
+    /*
+     * push all elements with one atomic operation.
+     * they are consumed in the reverse order like separate pushes.
+     */
+    template <typename InputIterator>
+    void push_bulk(InputIterator first, InputIterator last) {
+        if (first == last) {
+            return;
+        }
+        Node* oldest = new Node { *first, nullptr };
+        Node* newest = oldest;
+        for (++first; first != last; ++first) {
+            newest = new Node { *first, newest };
+        }
+
+        oldest->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(oldest->next, newest,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+        }
+    }
+
+    /*
+     * call f(T&) for all elements from the newest to the oldest.
+     * return false if queue was empty.
+     */
+    template <typename F>
+    bool consume_all(F f) {
+        Node* node = head.exchange(nullptr, std::memory_order_acquire);
+        if (node == nullptr) {
+            return false;
+        }
+        while (node) {
+            Node* next = node->next;
+            f(node->value);
+            delete node;
+            node = next;
+        }
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == nullptr;
+    }
+};
+
+}
+}
+}
+
+#endif //USER_THREAD_MPSC_QUEUE_HPP
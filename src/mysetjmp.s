@@ -1,6 +1,8 @@
         .text
         .globl mysetjmp
+        .type mysetjmp, @function
 mysetjmp:
+	.cfi_startproc
 	movq %rbx, 0(%rdi)
 	movq %rbp, 16(%rdi)
 	movq %r12, 24(%rdi)
@@ -8,17 +10,22 @@ mysetjmp:
 	movq %r14, 40(%rdi)
 	movq %r15, 48(%rdi)
 
-        popq %rcx
-	movq %rsp, 8(%rdi)
+	# save %rsp and the return address as if returned
+	movq (%rsp), %rcx
+	leaq 8(%rsp), %rdx
+	movq %rdx, 8(%rdi)
 	movq %rcx, 56(%rdi)
-	pushq %rcx
 
         mov $0, %rax
 	ret
+	.cfi_endproc
+        .size mysetjmp, .-mysetjmp
 
         .text
         .globl mylongjmp
+        .type mylongjmp, @function
 mylongjmp:
+	.cfi_startproc
 	movq 0(%rdi), %rbx
 	movq 8(%rdi), %rsp
 	movq 16(%rdi), %rbp
@@ -30,3 +37,7 @@ mylongjmp:
         mov $1, %rax
 	jmp *56(%rdi)  # return
         ret
+	.cfi_endproc
+        .size mylongjmp, .-mylongjmp
+
+        .section .note.GNU-stack,"",@progbits
@@ -0,0 +1,302 @@
+#ifndef USER_THREAD_PIPELINE_HPP
+#define USER_THREAD_PIPELINE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "util.hpp"
+#include "sync.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+enum class FilterMode {
+    // items are processed concurrently
+    parallel,
+    // one item at a time, in the order the source produced them
+    serial_in_order,
+    // one item at a time, in any order
+    serial_out_of_order
+};
+
+/*
+ * passed to the source filter. call stop() instead of returning an item at the end of the stream.
+ */
+class FlowControl {
+    bool stopped = false;
+
+public:
+    void stop() {
+        stopped = true;
+    }
+
+    bool is_stopped() const {
+        return stopped;
+    }
+};
+
+/*
+ * serializes a stage in the order of sequence numbers.
+ * a token waiting for its turn suspends its user thread.
+ */
+class InOrderGate {
+    std::mutex mutex;
+    std::uint64_t next = 0;
+    std::map<std::uint64_t, Waiter*> waiters;
+
+public:
+    void enter(std::uint64_t sequence) {
+        suspend_current_thread_until_woken([this, sequence](Waiter & waiter) {
+            auto lock = util::make_unique_lock(mutex);
+            if (next == sequence) {
+                return false;
+            }
+            waiters.emplace(sequence, &waiter);
+            return true;
+        });
+    }
+
+    void leave(std::uint64_t sequence) {
+        auto lock = util::make_unique_lock(mutex);
+        next = sequence + 1;
+        auto it = waiters.find(next);
+        if (it != waiters.end()) {
+            Waiter* waiter = it->second;
+            waiters.erase(it);
+            try_wake_waiter(*waiter, WaitStatus::ready);
+        }
+    }
+};
+
+/*
+ * mutual exclusion that suspends the waiting user thread. ownership is handed to waiters in FIFO order.
+ */
+class ExclusiveGate {
+    std::mutex mutex;
+    bool busy = false;
+    std::deque<Waiter*> waiters;
+
+public:
+    void enter() {
+        suspend_current_thread_until_woken([this](Waiter & waiter) {
+            auto lock = util::make_unique_lock(mutex);
+            if (!busy) {
+                busy = true;
+                return false;
+            }
+            waiters.push_back(&waiter);
+            return true;
+        });
+    }
+
+    void leave() {
+        auto lock = util::make_unique_lock(mutex);
+        if (waiters.empty()) {
+            busy = false;
+            return;
+        }
+        Waiter* waiter = waiters.front();
+        waiters.pop_front();
+        try_wake_waiter(*waiter, WaitStatus::ready);
+    }
+};
+
+struct PipelineStage {
+    FilterMode mode;
+    InOrderGate in_order;
+    ExclusiveGate exclusive;
+
+    explicit PipelineStage(FilterMode mode) :
+        mode(mode) {
+    }
+
+    void enter(std::uint64_t sequence) {
+        if (mode == FilterMode::serial_in_order) {
+            in_order.enter(sequence);
+        } else if (mode == FilterMode::serial_out_of_order) {
+            exclusive.enter();
+        }
+    }
+
+    void leave(std::uint64_t sequence) {
+        if (mode == FilterMode::serial_in_order) {
+            in_order.leave(sequence);
+        } else if (mode == FilterMode::serial_out_of_order) {
+            exclusive.leave();
+        }
+    }
+};
+
+// state of one run of a pipeline, shared by its tokens
+struct PipelineRun {
+    std::vector<std::unique_ptr<PipelineStage>> stages;
+    std::atomic_bool stopping = { false };
+    // guarded by the gate of the source
+    std::uint64_t next_sequence = 0;
+};
+
+// an item passing the stages, carried by one user thread
+struct PipelineToken {
+    PipelineRun* run;
+    std::uint64_t sequence = 0;
+    bool has_sequence = false;
+    // the last stage entered
+    std::size_t stage = 0;
+};
+
+// thrown through the filters of a token when the source is exhausted
+struct PipelineStopped {
+};
+
+struct PipelineUnit {
+};
+
+// value passed between filters. void is passed as PipelineUnit.
+template <typename T>
+using PipelineValue = typename std::conditional<std::is_void<T>::value, PipelineUnit, T>::type;
+
+template <typename In, typename Out>
+struct FilterCall {
+    template <typename Fn>
+    static PipelineValue<Out> call(Fn& fn, PipelineValue<In>&& value) {
+        return fn(std::move(value));
+    }
+};
+
+template <typename In>
+struct FilterCall<In, void> {
+    template <typename Fn>
+    static PipelineUnit call(Fn& fn, PipelineValue<In>&& value) {
+        fn(std::move(value));
+        return PipelineUnit {};
+    }
+};
+
+/*
+ * stages from In to Out of a pipeline. compose them with operator&.
+ * a filter from void is the source, and must be the first.
+ */
+template <typename In, typename Out>
+struct Filter {
+    using Body = std::function<PipelineValue<Out>(PipelineValue<In>&&, PipelineToken&, std::size_t first_stage)>;
+
+    std::vector<FilterMode> modes;
+    Body body;
+};
+
+template <typename In, typename Out>
+struct MakeFilter {
+    template <typename Fn>
+    static Filter<In, Out> make(FilterMode mode, Fn fn) {
+        return Filter<In, Out> { { mode }, [fn](PipelineValue<In> && value, PipelineToken & token, std::size_t index) mutable {
+            PipelineStage& stage = *token.run->stages[index];
+            token.stage = index;
+            stage.enter(token.sequence);
+            auto leave = util::make_scope_exit([&stage, &token]() {
+                stage.leave(token.sequence);
+            });
+            return FilterCall<In, Out>::call(fn, std::move(value));
+        }
+                                 };
+    }
+};
+
+// the source is always serialized, because it numbers the items
+template <typename Out>
+struct MakeFilter<void, Out> {
+    template <typename Fn>
+    static Filter<void, Out> make(FilterMode mode, Fn fn) {
+        return Filter<void, Out> { { mode }, [fn](PipelineUnit&&, PipelineToken & token, std::size_t index) mutable {
+            PipelineRun& run = *token.run;
+            PipelineStage& stage = *run.stages[index];
+            token.stage = index;
+            stage.exclusive.enter();
+            auto leave = util::make_scope_exit([&stage]() {
+                stage.exclusive.leave();
+            });
+
+            if (run.stopping) {
+                throw PipelineStopped();
+            }
+            FlowControl flow_control;
+            PipelineValue<Out> value = fn(flow_control);
+            if (flow_control.is_stopped()) {
+                run.stopping = true;
+                throw PipelineStopped();
+            }
+            token.sequence = run.next_sequence++;
+            token.has_sequence = true;
+            return value;
+        }
+                                 };
+    }
+};
+
+/*
+ * Fn is Out(In), Out(FlowControl&) if In is void, or void(In) if Out is void.
+ */
+template <typename In, typename Out, typename Fn>
+Filter<In, Out> make_filter(FilterMode mode, Fn fn) {
+    return MakeFilter<In, Out>::make(mode, std::move(fn));
+}
+
+template <typename In, typename Mid, typename Out>
+Filter<In, Out> operator&(Filter<In, Mid> first, Filter<Mid, Out> second) {
+    const std::size_t number_of_first = first.modes.size();
+    Filter<In, Out> filter;
+    filter.modes = first.modes;
+    filter.modes.insert(filter.modes.end(), second.modes.begin(), second.modes.end());
+    filter.body = [first = std::move(first.body), second = std::move(second.body), number_of_first](
+    PipelineValue<In> && value, PipelineToken & token, std::size_t index) {
+        return second(first(std::move(value), token, index), token, index + number_of_first);
+    };
+    return filter;
+}
+
+/*
+ * body of a token: carry items from the source through all stages until the source stops.
+ * each item is processed depth-first by the same user thread, so it stays in the cache of the worker.
+ */
+inline void run_pipeline_token(PipelineRun& run, const Filter<void, void>::Body& body) {
+    while (true) {
+        PipelineToken token { &run };
+        std::exception_ptr exception;
+        try {
+            body(PipelineUnit {}, token, 0);
+            continue;
+        } catch (const PipelineStopped&) {
+            return;
+        } catch (...) {
+            // not rethrown here: the gates below may resume this thread on another native thread
+            exception = std::current_exception();
+        }
+
+        run.stopping = true;
+        // let later items pass the ordered stages this item did not reach
+        if (token.has_sequence) {
+            for (std::size_t i = token.stage + 1; i < run.stages.size(); ++i) {
+                if (run.stages[i]->mode == FilterMode::serial_in_order) {
+                    run.stages[i]->enter(token.sequence);
+                    run.stages[i]->leave(token.sequence);
+                }
+            }
+        }
+        std::rethrow_exception(exception);
+    }
+}
+
+}
+}
+}
+
+#endif //USER_THREAD_PIPELINE_HPP
@@ -0,0 +1,97 @@
+#ifndef USER_THREAD_PREEMPTION_HPP
+#define USER_THREAD_PREEMPTION_HPP
+
+#include <cerrno>
+#include <chrono>
+#include <system_error>
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// glibc older than 2.35 does not define this
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace orks {
+namespace userthread {
+namespace detail {
+namespace preemption {
+
+/*
+ * signal used by preemption timers.
+ * SIGURG is ignored by default and rarely used by applications (golang uses it for the same purpose).
+ */
+constexpr int preemption_signal = SIGURG;
+
+inline pid_t get_native_thread_id() {
+    return static_cast<pid_t>(::syscall(SYS_gettid));
+}
+
+/*
+ * install process wide signal handler for preemption_signal.
+ * handler is called on the worker that the timer targets.
+ * defined in user-thread.cpp
+ */
+void install_signal_handler();
+
+/*
+ * periodic timer that sends preemption_signal to one native thread.
+ * The timer only sets a flag (see Worker::on_preemption_tick).
+ * The running user thread is switched out at next preemption_point().
+ *
+ * Switching in the signal handler is not done
+ * because interrupted code may hold the lock of a work queue or malloc arena.
+ */
+class PreemptionTimer {
+    timer_t timer_id;
+    bool created = false;
+
+public:
+    PreemptionTimer() = default;
+    PreemptionTimer(const PreemptionTimer&) = delete;
+
+    ~PreemptionTimer() {
+        stop();
+    }
+
+    void start(pid_t native_thread_id, std::chrono::microseconds time_slice) {
+        stop();
+
+        sigevent sev {};
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = preemption_signal;
+        sev.sigev_notify_thread_id = native_thread_id;
+        if (::timer_create(CLOCK_MONOTONIC, &sev, &timer_id) != 0) {
+            throw std::system_error(errno, std::generic_category(), "timer_create");
+        }
+        created = true;
+
+        const auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(time_slice).count();
+        itimerspec spec {};
+        spec.it_interval.tv_sec = nsec / 1000000000;
+        spec.it_interval.tv_nsec = nsec % 1000000000;
+        spec.it_value = spec.it_interval;
+        if (::timer_settime(timer_id, 0, &spec, nullptr) != 0) {
+            const int err = errno;
+            stop();
+            throw std::system_error(err, std::generic_category(), "timer_settime");
+        }
+    }
+
+    void stop() {
+        if (created) {
+            ::timer_delete(timer_id);
+            created = false;
+        }
+    }
+};
+
+}
+}
+}
+}
+
+#endif //USER_THREAD_PREEMPTION_HPP
@@ -0,0 +1,122 @@
+#ifndef USER_THREAD_STACK_PROFILE_HPP
+#define USER_THREAD_STACK_PROFILE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#include "config.h"
+#include "util.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * histogram of stack high watermarks.
+ * counts[i] is the number of threads that used (2^(i-1), 2^i] bytes of stack.
+ */
+struct StackUsageHistogram {
+    static constexpr std::size_t number_of_buckets = 32;
+
+    std::array<std::uint64_t, number_of_buckets> counts {};
+    std::uint64_t number_of_threads = 0;
+    std::size_t max_used = 0;
+    // threads that used more than near_overflow_ratio of its stack
+    std::uint64_t near_overflow_count = 0;
+
+    static std::size_t bucket_of(std::size_t used) {
+        std::size_t i = 0;
+        while (i + 1 < number_of_buckets && (std::size_t(1) << i) < used) {
+            ++i;
+        }
+        return i;
+    }
+
+    static std::size_t bucket_upper_bound(std::size_t bucket) {
+        return std::size_t(1) << bucket;
+    }
+
+    void record(std::size_t used, bool near_overflow) {
+        ++counts[bucket_of(used)];
+        ++number_of_threads;
+        if (used > max_used) {
+            max_used = used;
+        }
+        if (near_overflow) {
+            ++near_overflow_count;
+        }
+    }
+};
+
+struct StackUsageProfile {
+    StackUsageHistogram all;
+    // keyed by the entry function of threads. empty unless profiling by spawn site is enabled.
+    std::map<const void*, StackUsageHistogram> by_spawn_site;
+};
+
+/*
+ * aggregates stack high watermarks measured at thread destruction.
+ * only used if ORKS_USERTHREAD_STACK_PROFILE is defined.
+ */
+class StackProfiler {
+    std::mutex mutex;
+    StackUsageProfile profile;
+    std::atomic_bool by_spawn_site = { false };
+
+public:
+    static constexpr unsigned char paint_pattern = 0xa5;
+    static constexpr double near_overflow_ratio = 0.9;
+
+    static void paint(char* begin, char* end) {
+        std::memset(begin, paint_pattern, end - begin);
+    }
+
+    /*
+     * return used bytes of the stack [begin, end) that grows toward begin.
+     */
+    static std::size_t measure(const char* begin, const char* end) {
+        const char* p = begin;
+        while (p < end && static_cast<unsigned char>(*p) == paint_pattern) {
+            ++p;
+        }
+        return end - p;
+    }
+
+    void record(const void* spawn_site, std::size_t used, std::size_t stack_size) {
+        const bool near_overflow = used > stack_size * near_overflow_ratio;
+        auto lock = util::make_unique_lock(mutex);
+        profile.all.record(used, near_overflow);
+        if (by_spawn_site) {
+            profile.by_spawn_site[spawn_site].record(used, near_overflow);
+        }
+    }
+
+    void set_profile_by_spawn_site(bool enable) {
+        by_spawn_site = enable;
+    }
+
+    StackUsageProfile snapshot() {
+        auto lock = util::make_unique_lock(mutex);
+        return profile;
+    }
+
+    void reset() {
+        auto lock = util::make_unique_lock(mutex);
+        profile = StackUsageProfile {};
+    }
+};
+
+inline StackProfiler& get_stack_profiler() {
+    static StackProfiler profiler;
+    return profiler;
+}
+
+}
+}
+}
+
+#endif //USER_THREAD_STACK_PROFILE_HPP
@@ -3,9 +3,13 @@
 
 #include <cstdlib>
 #include <memory>
+#include <mutex>
 #include <utility>
+#include <vector>
 #include <boost/utility/value_init.hpp>
 
+#include "util.hpp"
+
 namespace orks {
 namespace userthread {
 namespace detail {
@@ -47,7 +51,8 @@ struct SimpleStackAllocator {
 
     };
 
-    static Stack allocate() {
+    // requested_size is ignored. all stacks have stack_size bytes.
+    static Stack allocate(std::size_t requested_size = stack_size) {
 
         return Stack{
             std::unique_ptr < char[], SimpleStackAllocator::Deleter>(new char[stack_size]),
@@ -59,6 +64,106 @@ struct SimpleStackAllocator {
         delete[] p;
     }
 
+};
+
+/*
+ * stacks are rounded up to power of two size classes from min_stack_size to max_stack_size.
+ * each size class has its own free list, so freed stacks are reused by threads of the same class.
+ */
+struct SizeClassStackAllocator {
+    static constexpr std::size_t stack_size = 0x4000;
+    static constexpr std::size_t min_stack_size = 0x1000;
+    static constexpr std::size_t max_stack_size = 0x4000000;
+    static constexpr std::size_t number_of_size_classes = 15;
+    // max number of cached stacks per size class
+    static constexpr std::size_t max_cached_stacks = 1024;
+
+    static_assert((min_stack_size << (number_of_size_classes - 1)) == max_stack_size,
+                  "size classes must cover [min_stack_size, max_stack_size]");
+
+    struct Deleter {
+        std::size_t size;
+        void operator()(char* p) {
+            SizeClassStackAllocator::deallocate(p, size);
+        }
+    };
+
+    struct Stack {
+        std::unique_ptr<char[], SizeClassStackAllocator::Deleter> stack;
+        reinitialize_on_move<std::size_t> size;
+
+    };
+
+    static std::size_t size_class_of(std::size_t size) {
+        std::size_t size_class = 0;
+        while (size_class + 1 < number_of_size_classes && (min_stack_size << size_class) < size) {
+            ++size_class;
+        }
+        return size_class;
+    }
+
+    static std::size_t size_of_class(std::size_t size_class) {
+        return min_stack_size << size_class;
+    }
+
+    // requested_size larger than max_stack_size is clamped to max_stack_size
+    static Stack allocate(std::size_t requested_size = stack_size) {
+        const std::size_t size = size_of_class(size_class_of(requested_size));
+        char* p = get_free_list(size).pop();
+        if (p == nullptr) {
+            p = new char[size];
+        }
+
+        return Stack{
+            std::unique_ptr < char[], SizeClassStackAllocator::Deleter>(p, Deleter {size}),
+            size
+        };
+    }
+
+    static void deallocate(char* p, std::size_t size) {
+        if (!get_free_list(size).push(p)) {
+            delete[] p;
+        }
+    }
+
+private:
+    class FreeList {
+        std::mutex mutex;
+        std::vector<char*> stacks;
+
+    public:
+        ~FreeList() {
+            for (char* p : stacks) {
+                delete[] p;
+            }
+        }
+
+        char* pop() {
+            auto lock = util::make_unique_lock(mutex);
+            if (stacks.empty()) {
+                return nullptr;
+            }
+            char* p = stacks.back();
+            stacks.pop_back();
+            return p;
+        }
+
+        // return false if the free list is full
+        bool push(char* p) {
+            auto lock = util::make_unique_lock(mutex);
+            if (stacks.size() >= max_cached_stacks) {
+                return false;
+            }
+            stacks.push_back(p);
+            return true;
+        }
+    };
+
+    static FreeList& get_free_list(std::size_t size) {
+        static FreeList free_lists[number_of_size_classes];
+        return free_lists[size_class_of(size)];
+    }
+
 };
 }
 }
@@ -0,0 +1,304 @@
+#ifndef USER_THREAD_SYNC_HPP
+#define USER_THREAD_SYNC_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "util.hpp"
+#include "cancellation.hpp"
+#include "user-thread-internal.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * the functions and objects here suspend the calling user thread.
+ * they must not be called inside a catch handler. the exception being handled is recorded per native thread,
+ * so another user thread run on the worker meanwhile sees it, and a thread resumed on another worker loses it.
+ * store std::current_exception() and wait after the handler instead. debug builds assert it.
+ */
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+/*
+ * native thread that wakes waiters at their deadlines.
+ * started at the first timed wait of user threads.
+ */
+class SleepTimer {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::multimap<Deadline, Waiter*> waiters;
+    bool stopping = false;
+    std::thread thread;
+
+public:
+    SleepTimer() :
+        thread([this]() {
+        run();
+    }) {
+    }
+
+    SleepTimer(const SleepTimer&) = delete;
+
+    ~SleepTimer() {
+        {
+            auto lock = util::make_unique_lock(mutex);
+            stopping = true;
+        }
+        cond.notify_one();
+        thread.join();
+    }
+
+    void add(Deadline deadline, Waiter* waiter) {
+        auto lock = util::make_unique_lock(mutex);
+        auto it = waiters.emplace(deadline, waiter);
+        if (it == waiters.begin()) {
+            cond.notify_one();
+        }
+    }
+
+    void remove(Deadline deadline, Waiter* waiter) {
+        auto lock = util::make_unique_lock(mutex);
+        auto range = waiters.equal_range(deadline);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == waiter) {
+                waiters.erase(it);
+                return;
+            }
+        }
+    }
+
+private:
+    void run() {
+        auto lock = util::make_unique_lock(mutex);
+        while (!stopping) {
+            if (waiters.empty()) {
+                cond.wait(lock);
+                continue;
+            }
+
+            auto first = waiters.begin();
+            if (first->first <= std::chrono::steady_clock::now()) {
+                try_wake_waiter(*first->second, WaitStatus::timeout);
+                waiters.erase(first);
+            } else {
+                cond.wait_until(lock, first->first);
+            }
+        }
+    }
+};
+
+inline SleepTimer& get_sleep_timer() {
+    static SleepTimer timer;
+    return timer;
+}
+
+/*
+ * suspend the calling user thread until it is woken by try_wake_waiter().
+ * register_waiter(Waiter&) registers the waiter to the object waited on. it returns false if the object is already ready.
+ * unregister_waiter(Waiter&) is called after the thread is resumed.
+ * the wait is also woken by cancellation of the calling thread, and by the deadline if not nullptr.
+ * next, if not nullptr, is a thread taken over by try_take_over_waiter(). it is switched to directly,
+ * or resumed if the wait is cancelled at once.
+ */
+template <typename Register, typename Unregister>
+WaitStatus suspend_current_thread(Register register_waiter, Unregister unregister_waiter, const Deadline* deadline,
+                                  Work next = nullptr) {
+    Work self = get_current_thread();
+    const auto cancellation = self->cancellation;
+    if (cancellation && cancellation->is_cancelled()) {
+        if (next) {
+            Worker::resume(next);
+        }
+        return WaitStatus::cancelled;
+    }
+
+    Worker& worker = get_worker_of_this_native_thread();
+    WaitRecord<Waiter> record(self, self);
+    Waiter& waiter = *record;
+    worker.suspend([&](Work) {
+        const bool registered = register_waiter(waiter);
+        if (deadline) {
+            get_sleep_timer().add(*deadline, &waiter);
+        }
+        const bool cancellable = !cancellation || cancellation->add_waiter(&waiter);
+
+        if (!registered) {
+            try_wake_waiter(waiter, WaitStatus::ready);
+        } else if (!cancellable) {
+            try_wake_waiter(waiter, WaitStatus::cancelled);
+        }
+        waiter.finish_registration();
+    }, next);
+
+    // resumed. possibly on another worker.
+    unregister_waiter(waiter);
+    if (deadline) {
+        get_sleep_timer().remove(*deadline, &waiter);
+    }
+    if (cancellation) {
+        cancellation->remove_waiter(&waiter);
+    }
+    return waiter.status;
+}
+
+/*
+ * suspend the calling user thread until it is woken by try_wake_waiter().
+ * unlike suspend_current_thread(), not woken by cancellation, for waits that other threads rely on to complete.
+ * register_waiter(Waiter&) returns false if the object is already ready.
+ * the waker removes the waiter from the object before waking it.
+ */
+template <typename Register>
+void suspend_current_thread_until_woken(Register register_waiter) {
+    Work self = get_current_thread();
+    WaitRecord<Waiter> record(self, self);
+    Waiter& waiter = *record;
+    get_worker_of_this_native_thread().suspend([&](Work) {
+        if (!register_waiter(waiter)) {
+            try_wake_waiter(waiter, WaitStatus::ready);
+        }
+        waiter.finish_registration();
+    });
+}
+
+/*
+ * callback of Event::set().
+ * called under the lock of the event. must not block.
+ */
+struct EventListener {
+    void (*on_set)(EventListener& self);
+};
+
+/*
+ * one-shot event.
+ * user threads waiting on it are suspended instead of blocking their worker, and are woken by cancellation.
+ * native threads can also wait on it, without cancellation.
+ * user threads must not wait inside a catch handler.
+ */
+class Event {
+    std::mutex mutex;
+    std::condition_variable native_cond;
+    std::atomic_bool is_set_ = { false };
+    std::vector<Waiter*> waiters;
+    std::vector<EventListener*> listeners;
+
+public:
+    Event() = default;
+    Event(const Event&) = delete;
+
+    void set() {
+        auto lock = util::make_unique_lock(mutex);
+        if (is_set_) {
+            return;
+        }
+        is_set_.store(true, std::memory_order_release);
+        for (Waiter* waiter : waiters) {
+            try_wake_waiter(*waiter, WaitStatus::ready);
+        }
+        waiters.clear();
+        for (EventListener* listener : listeners) {
+            listener->on_set(*listener);
+        }
+        listeners.clear();
+        native_cond.notify_all();
+    }
+
+    /*
+     * return false and does not add listener if already set.
+     * the listener must be removed before it is destructed, even if it was called.
+     */
+    bool add_listener(EventListener* listener) {
+        auto lock = util::make_unique_lock(mutex);
+        if (is_set_) {
+            return false;
+        }
+        listeners.push_back(listener);
+        return true;
+    }
+
+    /*
+     * after return, listener is not called and not running.
+     */
+    void remove_listener(EventListener* listener) {
+        auto lock = util::make_unique_lock(mutex);
+        listeners.erase(std::remove(listeners.begin(), listeners.end(), listener), listeners.end());
+    }
+
+    bool is_set() const {
+        return is_set_.load(std::memory_order_acquire);
+    }
+
+    WaitStatus wait() {
+        return wait_impl(nullptr);
+    }
+
+    template <class Rep, class Period>
+    WaitStatus wait_for(const std::chrono::duration<Rep, Period>& rel_time) {
+        const Deadline deadline = std::chrono::steady_clock::now() + rel_time;
+        return wait_impl(&deadline);
+    }
+
+private:
+    WaitStatus wait_impl(const Deadline* deadline) {
+        if (is_set()) {
+            return WaitStatus::ready;
+        }
+
+        if (!get_current_thread()) {
+            auto lock = util::make_unique_lock(mutex);
+            auto pred = [this]() {
+                return is_set();
+            };
+            if (!deadline) {
+                native_cond.wait(lock, pred);
+                return WaitStatus::ready;
+            }
+            return native_cond.wait_until(lock, *deadline, pred) ? WaitStatus::ready : WaitStatus::timeout;
+        }
+
+        return suspend_current_thread([this](Waiter& waiter) {
+            auto lock = util::make_unique_lock(mutex);
+            if (is_set_) {
+                return false;
+            }
+            waiters.push_back(&waiter);
+            return true;
+        }, [this](Waiter& waiter) {
+            auto lock = util::make_unique_lock(mutex);
+            waiters.erase(std::remove(waiters.begin(), waiters.end(), &waiter), waiters.end());
+        }, deadline);
+    }
+};
+
+/*
+ * suspend the calling user thread for rel_time without blocking its worker.
+ * return WaitStatus::cancelled if woken by cancellation, or WaitStatus::ready.
+ * native threads simply sleep.
+ */
+template <class Rep, class Period>
+WaitStatus sleep_for(const std::chrono::duration<Rep, Period>& rel_time) {
+    if (!get_current_thread()) {
+        std::this_thread::sleep_for(rel_time);
+        return WaitStatus::ready;
+    }
+
+    const Deadline deadline = std::chrono::steady_clock::now() + rel_time;
+    const auto status = suspend_current_thread([](Waiter&) {
+        return true;
+    }, [](Waiter&) {
+    }, &deadline);
+    return status == WaitStatus::cancelled ? WaitStatus::cancelled : WaitStatus::ready;
+}
+
+}
+}
+}
+
+#endif //USER_THREAD_SYNC_HPP
@@ -1,16 +1,22 @@
 #pragma once
 
 #include <cassert>
+#include <new>
 #include <user-thread-debug.hpp>
 
 #include "thread-data.hpp"
 #include "../stack-address-tools.hpp"
 #include "../splitstackapi.h"
 #include "../mysetjmp.h"
+#include "../fiber-local-storage.hpp"
+#include "../cancellation.hpp"
 
 namespace orks {
 namespace userthread {
 namespace detail {
+
+class Worker;
+
 namespace baddesign {
 namespace splitstack {
 
@@ -30,12 +36,39 @@ public:
     ThreadData* pass_on_longjmp = 0;
     void* transferred_data = nullptr;
 
+    // entry function of this thread. stack profiling is not supported with split stacks.
+    const void* spawn_site = nullptr;
+
+    FiberLocalStorage fiber_local_storage;
+
+    // inherited from the creating thread. null if the thread is not cancellable.
+    std::shared_ptr<CancellationState> cancellation;
+
+    // the worker that ran this thread last. woken threads are sent back to it.
+    Worker* last_worker = nullptr;
+    // never stolen: run only by last_worker. see WorkerManager::start_thread_function_on()
+    bool pinned = false;
+
+    // when this thread yielded last, and the longest time it waited to be run again after a yield
+    std::chrono::steady_clock::time_point yielded_at;
+    std::chrono::steady_clock::duration max_yield_wait {};
+
+#ifdef ORKS_USERTHREAD_THREAD_REGISTRY
+    // links of ThreadRegistry
+    ThreadData* registry_prev = nullptr;
+    ThreadData* registry_next = nullptr;
+#endif
+
 private:
     Context(*func)(void* arg, Context prev);
     void* arg;
+    // deletes arg without calling func
+    void (*delete_arg)(void* arg) = nullptr;
 
     SplitstackContext splitstack_context_;
+    // null until the launch. see acquire_stack()
     void* stack = nullptr;
+    // the size of the first segment. 0 means default until the launch.
     std::size_t stack_size = 0;
 
 public:
@@ -44,7 +77,7 @@ public:
     ThreadData(Fn fn)
         : ThreadData((Context(*)(void*, Context)) & (exec_thread_delete<Fn>),
                      (void*)(new Fn(std::move(fn)))) {
-
+        delete_arg = &delete_func<Fn>;
     }
 
     ThreadData(Context(*func)(void* arg, Context prev), void* arg)
@@ -91,6 +124,26 @@ public:
         return stack_size;
     }
 
+    // shared stacks are not supported with split stacks
+    bool uses_shared_stack() const {
+        return false;
+    }
+
+    // make the first segment of the stack of this thread. called at its launch.
+    void acquire_stack() {
+        if (stack) {
+            return;
+        }
+        std::size_t size;
+        stack = __splitstack_makecontext(stack_size == 0 ? SimpleStackAllocator::stack_size : stack_size,
+                                         splitstack_context_.ctx, &size);
+        if (!stack) {
+            throw std::bad_alloc();
+        }
+        assert(size != 0);
+        stack_size = size;
+    }
+
 
     // non copyable
     ThreadData(const ThreadData&) = delete;
@@ -99,27 +152,33 @@ public:
 
     // this function is public
     // this is bad
+    // stack_size is the size of the first segment. 0 means default. the stack is made at the launch.
     template <typename Fn>
-    static ThreadData* create(Fn fn) {
-        SplitstackContext ssctx;
-        std::size_t size;
-        void* stack = __splitstack_makecontext(SimpleStackAllocator::stack_size, ssctx.ctx, &size);
-        assert(size != 0);
-        auto th = new(stack) ThreadData(fn);
-        th->splitstack_context_ = ssctx;
-        th->stack = stack;
-        th->stack_size = size;
-        assert(th->get_stack_size() != 0);
+    static ThreadData* create(Fn fn, std::size_t stack_size = 0) {
+        auto th = new ThreadData(std::move(fn));
+        th->stack_size = stack_size;
         return th;
 
     }
 
+    // this function is public
+    // this is bad
+    // destroy a thread that was never launched. its function is deleted without being called.
+    static void discard(ThreadData& t) {
+        assert(t.state == ThreadState::before_launch);
+        if (t.delete_arg) {
+            t.delete_arg(t.arg);
+        }
+        destroy(t);
+    }
+
     // this function is public
     // this is bad
     static void destroy(ThreadData& t) {
-        SplitstackContext ssctx = t.splitstack_context_;
-        t.~ThreadData();
-        __splitstack_releasecontext(ssctx.ctx);
+        if (t.stack) {
+            __splitstack_releasecontext(t.splitstack_context_.ctx);
+        }
+        delete &t;
 
     }
 
@@ -131,6 +190,11 @@ private:
         return r;
     }
 
+    template<typename Fn>
+    static void delete_func(void* func_obj) {
+        delete static_cast<Fn*>(func_obj);
+    }
+
 
 };
 }
@@ -1,10 +1,20 @@
 #pragma once
 
+#include <chrono>
+#include <cstring>
+#include <memory>
+
 #include "../stackallocators.hpp"
+#include "../stack-profile.hpp"
 #include "../mysetjmp.h"
+#include "../fiber-local-storage.hpp"
+#include "../cancellation.hpp"
 namespace orks {
 namespace userthread {
 namespace detail {
+
+class Worker;
+
 namespace baddesign {
 
 
@@ -12,13 +22,59 @@ enum class ThreadState {
     running, ended, before_launch
 };
 
+class ThreadData;
+
+/*
+ * a stack shared by the threads of a worker, in the style of libco.
+ * only the occupier has its frames on it. the frames of the others are saved in their ThreadData.
+ */
+class SharedStack {
+#ifdef ORKS_USERTHREAD_STACK_ALLOCATOR
+    using StackAllocator = ORKS_USERTHREAD_STACK_ALLOCATOR;
+#else
+    using StackAllocator = SizeClassStackAllocator;
+#endif
+
+    StackAllocator::Stack stack;
+    // the frames of a thread are copied back while running on this, not on the shared stack
+    StackAllocator::Stack scratch;
+
+public:
+    static constexpr std::size_t default_size = 0x100000;
+
+    ThreadData* occupier = nullptr;
+
+    explicit SharedStack(std::size_t size = default_size) :
+        stack(StackAllocator::allocate(size)),
+        scratch(StackAllocator::allocate()) {
+    }
+
+    SharedStack(const SharedStack&) = delete;
+
+    char* get_stack() {
+        return stack.stack.get();
+    }
+
+    std::size_t get_stack_size() {
+        return stack.size;
+    }
+
+    char* get_scratch() {
+        return scratch.stack.get();
+    }
+
+    std::size_t get_scratch_size() {
+        return scratch.size;
+    }
+};
+
 class ThreadData {
     using Context = ThreadData*;
 
 #ifdef ORKS_USERTHREAD_STACK_ALLOCATOR
     using StackAllocator = ORKS_USERTHREAD_STACK_ALLOCATOR;
 #else
-    using StackAllocator = SimpleStackAllocator;
+    using StackAllocator = SizeClassStackAllocator;
 #endif
 
     using Stack = StackAllocator::Stack;
@@ -30,10 +86,47 @@ public:
     ThreadData* pass_on_longjmp = 0;
     void* transferred_data = nullptr;
 
+    // entry function of this thread. used as the key of profiling.
+    const void* spawn_site = nullptr;
+
+    FiberLocalStorage fiber_local_storage;
+
+    // inherited from the creating thread. null if the thread is not cancellable.
+    std::shared_ptr<CancellationState> cancellation;
+
+    // the worker that ran this thread last. woken threads are sent back to it.
+    Worker* last_worker = nullptr;
+    // never stolen: run only by last_worker. see WorkerManager::start_thread_function_on()
+    bool pinned = false;
+
+    // when this thread yielded last, and the longest time it waited to be run again after a yield
+    std::chrono::steady_clock::time_point yielded_at;
+    std::chrono::steady_clock::duration max_yield_wait {};
+
+#ifdef ORKS_USERTHREAD_THREAD_REGISTRY
+    // links of ThreadRegistry
+    ThreadData* registry_prev = nullptr;
+    ThreadData* registry_next = nullptr;
+#endif
+
+    // the stack of the worker that launched this thread, if made by create_on_shared_stack()
+    SharedStack* shared_stack = nullptr;
+
 private:
     Context(*func)(void* arg, Context prev);
     void* arg;
+    // deletes arg without calling func
+    void (*delete_arg)(void* arg) = nullptr;
+    // empty until the launch. see acquire_stack()
     Stack stack_frame;
+    // 0 means default stack size of StackAllocator
+    std::size_t requested_stack_size = 0;
+
+    // this thread has no stack of its own
+    bool on_shared_stack = false;
+    // the frames of this thread while another thread occupies the shared stack
+    std::unique_ptr<char[]> saved_frames;
+    std::size_t saved_frames_size = 0;
 
 #ifdef USE_SPLITSTACKS
     splitstack_context splitstack_context_;
@@ -45,7 +138,7 @@ public:
     ThreadData(Fn fn)
         : ThreadData((Context(*)(void*, Context)) & (exec_thread_delete<Fn>),
                      (void*)(new Fn(std::move(fn)))) {
-
+        delete_arg = &delete_func<Fn>;
     }
 
     ThreadData(Context(*func)(void* arg, Context prev), void* arg)
@@ -74,13 +167,59 @@ public:
     }
 
     char* get_stack() {
-        return stack_frame.stack.get();
+        return shared_stack ? shared_stack->get_stack() : stack_frame.stack.get();
     }
 
     std::size_t get_stack_size() {
+        if (shared_stack) {
+            return shared_stack->get_stack_size();
+        }
         return stack_frame.size;
     }
 
+    bool uses_shared_stack() const {
+        return on_shared_stack;
+    }
+
+    /*
+     * allocate the stack of this thread. called at its launch,
+     * so threads waiting in queues hold only this ThreadData and their functions.
+     */
+    void acquire_stack() {
+        if (on_shared_stack || stack_frame.stack) {
+            return;
+        }
+        stack_frame = requested_stack_size == 0 ? StackAllocator::allocate() : StackAllocator::allocate(requested_stack_size);
+        assert(stack_frame.size != 0);
+#ifdef ORKS_USERTHREAD_STACK_PROFILE
+        StackProfiler::paint(get_stack(), get_stack() + get_stack_size());
+#endif
+    }
+
+    std::size_t get_saved_frames_size() const {
+        return saved_frames_size;
+    }
+
+    /*
+     * copy the used part of the shared stack, from the stack pointer saved in env to the stack base,
+     * to a buffer of that size.
+     */
+    void save_frames() {
+        char* base = get_stack() + get_stack_size();
+        char* sp = reinterpret_cast<char*>(env.regs[1]);
+        assert(get_stack() < sp && sp <= base);
+        saved_frames_size = base - sp;
+        saved_frames.reset(new char[saved_frames_size]);
+        std::memcpy(saved_frames.get(), sp, saved_frames_size);
+    }
+
+    // *must not* be called on the shared stack
+    void restore_frames() {
+        std::memcpy(get_stack() + get_stack_size() - saved_frames_size, saved_frames.get(), saved_frames_size);
+        saved_frames.reset();
+        saved_frames_size = 0;
+    }
+
 
     // non copyable
     ThreadData(const ThreadData&) = delete;
@@ -89,23 +228,54 @@ public:
 
     // this function is public
     // this is bad
+    // stack_size == 0 means default stack size of StackAllocator. the stack is allocated at the launch.
     template <typename Fn>
-    static ThreadData* create(Fn fn) {
-        Stack stack = StackAllocator::allocate();
-        assert(stack.size != 0);
-        auto th = new(stack.stack.get()) ThreadData(fn);
-        th->stack_frame = std::move(stack);
-        assert(th->get_stack_size() != 0);
+    static ThreadData* create(Fn fn, std::size_t stack_size = 0) {
+        auto th = new ThreadData(std::move(fn));
+        th->requested_stack_size = stack_size;
         return th;
 
     }
 
+    // this function is public
+    // this is bad
+    // the thread runs on the shared stack assigned before its launch, and never has a stack of its own
+    template <typename Fn>
+    static ThreadData* create_on_shared_stack(Fn fn) {
+        auto th = new ThreadData(std::move(fn));
+        th->on_shared_stack = true;
+        return th;
+    }
+
+    // this function is public
+    // this is bad
+    // destroy a thread that was never launched. its function is deleted without being called.
+    static void discard(ThreadData& t) {
+        assert(t.state == ThreadState::before_launch);
+        if (t.delete_arg) {
+            t.delete_arg(t.arg);
+        }
+        destroy(t);
+    }
+
     // this function is public
     // this is bad
     static void destroy(ThreadData& t) {
+        if (t.on_shared_stack) {
+            if (t.shared_stack && t.shared_stack->occupier == &t) {
+                t.shared_stack->occupier = nullptr;
+            }
+        }
+
+#ifdef ORKS_USERTHREAD_STACK_PROFILE
+        // threads discarded before their launch have no stack to measure
+        if (t.stack_frame.stack) {
+            const std::size_t used = StackProfiler::measure(t.get_stack(), t.get_stack() + t.get_stack_size());
+            get_stack_profiler().record(t.spawn_site, used, t.get_stack_size());
+        }
+#endif
 
-        Stack stack = std::move(t.stack_frame);
-        t.~ThreadData();
+        delete &t;
     }
 
 private:
@@ -116,6 +286,11 @@ private:
         return r;
     }
 
+    template<typename Fn>
+    static void delete_func(void* func_obj) {
+        delete static_cast<Fn*>(func_obj);
+    }
+
 
 };
 
@@ -0,0 +1,60 @@
+#ifndef USER_THREAD_THREAD_REGISTRY_HPP
+#define USER_THREAD_THREAD_REGISTRY_HPP
+
+#include <mutex>
+
+#include "config.h"
+#include "util.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * intrusive list of all live user threads, for debuggers.
+ * only used if ORKS_USERTHREAD_THREAD_REGISTRY is defined.
+ * tools/gdb/user-thread.py walks `head` through ThreadData::registry_next.
+ */
+template <typename ThreadData>
+class ThreadRegistry {
+    std::mutex mutex;
+
+public:
+    ThreadData* head = nullptr;
+
+    void add(ThreadData* thread) {
+        auto lock = util::make_unique_lock(mutex);
+        thread->registry_prev = nullptr;
+        thread->registry_next = head;
+        if (head) {
+            head->registry_prev = thread;
+        }
+        head = thread;
+    }
+
+    void remove(ThreadData* thread) {
+        auto lock = util::make_unique_lock(mutex);
+        if (thread->registry_prev) {
+            thread->registry_prev->registry_next = thread->registry_next;
+        } else {
+            head = thread->registry_next;
+        }
+        if (thread->registry_next) {
+            thread->registry_next->registry_prev = thread->registry_prev;
+        }
+    }
+
+    template <typename F>
+    void for_each(F f) {
+        auto lock = util::make_unique_lock(mutex);
+        for (ThreadData* thread = head; thread; thread = thread->registry_next) {
+            f(*thread);
+        }
+    }
+};
+
+}
+}
+}
+
+#endif //USER_THREAD_THREAD_REGISTRY_HPP
@@ -1,35 +1,29 @@
 #ifndef USER_THREAD_INTERNAL_HPP_
 #define USER_THREAD_INTERNAL_HPP_
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <list>
 #include <thread>
 #include <condition_variable>
+#include <exception>
 #include <memory>
 #include <iostream>
+#include <stdexcept>
 #include <utility>
+#include <atomic>
+#include <future>
+#include <vector>
 
 #include <boost/range/irange.hpp>
 
 #include "stack-address-tools.hpp"
 #include "context-traits.hpp"
 #include "workqueue.hpp"
-
-
-namespace orks {
-namespace userthread {
-namespace detail {
-
-
-template<typename Fn>
-void exec_thread_delete(void* func_obj) {
-    (*static_cast<Fn*>(func_obj))();
-    delete static_cast<Fn*>(func_obj);
-}
-
-}
-}
-}
+#include "preemption.hpp"
+#include "cancellation.hpp"
+#include "io-ring.hpp"
 
 
 namespace orks {
@@ -42,8 +36,57 @@ using namespace stacktool;
 class Worker;
 void register_worker_of_this_native_thread(Worker& worker, std::string worker_name = "");
 Worker& get_worker_of_this_native_thread();
+// return nullptr if this native thread is not a worker
+Worker* find_worker_of_this_native_thread();
 
 using Work = BadDesignContextTraits::Context;
+
+/*
+ * return the thread running on the worker of this native thread.
+ * return nullptr if this native thread is not a worker.
+ * not inlined: the worker of a user thread changes across context switches.
+ */
+Work get_current_thread();
+
+/*
+ * attributes of a user thread given at creation.
+ */
+struct ThreadAttributes {
+    // rounded up to a size class of the stack allocator. 0 means default size.
+    std::size_t stack_size = 0;
+
+    // empty means the token of the creating thread
+    CancellationToken cancellation_token;
+
+    /*
+     * run on the shared stack of the worker that launches the thread, instead of a stack of its own.
+     * while another thread runs on the shared stack, only the used part of the stack is kept in a buffer.
+     * stack_size is ignored, and the thread is never moved to another worker.
+     * waits of this library keep their records off the stack, but other objects on the stack
+     * (events, task groups, I/O buffers) *must not* be touched by other threads while it is switched out.
+     * not supported with split stacks.
+     */
+    bool shared_stack = false;
+};
+
+/*
+ * scheduling statistics of a WorkerManager since its construction.
+ */
+struct SchedulerCounters {
+    // successful steals. a stolen batch counts as one.
+    std::uint64_t steals = 0;
+    // context switches of all workers
+    std::uint64_t switches = 0;
+};
+
+/*
+ * address unique to each type of entry function object.
+ * used as the spawn site of threads created from function objects.
+ */
+template <typename Fn>
+void spawn_site_of() {
+}
+
 /*
  * main thread でworker を 1つ 作成すると、新しい native thread が1つ作成される。
  * このクラスの使用者は必ずwait()を呼ぶこと。
@@ -56,16 +99,69 @@ class Worker {
 
     WorkQueue work_queue;
 
-    Work volatile worker_thread_context = nullptr;
+    // context of the native thread of this worker
+    ContextTraits::ThreadData worker_thread_context {nullptr, nullptr};
+
+    // the thread running on this worker
+    Work current_thread = &worker_thread_context;
+
+#ifndef USE_SPLITSTACKS
+    // created when the first thread on a shared stack is launched on this worker
+    std::unique_ptr<baddesign::SharedStack> shared_stack;
+#endif
+    // the next thread of a switch that passes through the worker context. see switch_thread_to()
+    Work handoff = nullptr;
 
     std::thread worker_thread;
+    pid_t native_thread_id;
+
+    // written only by the native thread of this worker, read by the preemption signal handler
+    std::atomic<std::uint64_t> switch_count {0};
+    std::uint64_t volatile switch_count_at_last_tick = 0;
+    std::atomic_bool preemption_requested {false};
+
+    // published at every switch for the watchdog. running_thread is nullptr while this runs its own context.
+    std::atomic<const void*> running_thread {nullptr};
+    std::atomic<const void*> running_spawn_site {nullptr};
+    // set by the watchdog while the running thread hogs this worker. see resume()
+    std::atomic_bool hogged {false};
+
+    // called with the switched out thread by the next thread of this worker. see suspend()
+    void (*after_switch)(Work prev, void* arg) = nullptr;
+    void* after_switch_arg = nullptr;
+    // the switched out thread yielded, and goes to the FIFO of yielded threads
+    bool yielding = false;
+
+    preemption::PreemptionTimer preemption_timer;
+
+    // resumed threads are not sent back to the worker whose queue is this long
+    static constexpr std::size_t overloaded_queue_size = 64;
+
+    // created at the first I/O on this worker. see get_io_ring()
+    std::unique_ptr<IoRing> io_ring;
+    bool io_ring_unavailable = false;
+    // scheduling points since requests were prepared without being submitted
+    unsigned io_deferred_rounds = 0;
+
+    static constexpr unsigned io_ring_entries = 256;
+    // prepared requests are submitted at least once in this many requests or scheduling points
+    static constexpr unsigned io_submit_batch = 32;
+    static constexpr unsigned io_max_deferred_rounds = 8;
+    // a worker waiting on its ring notices new works at this interval
+    static std::chrono::microseconds io_wait_timeout() {
+        return std::chrono::microseconds(100);
+    }
 
 public:
     explicit Worker(WorkQueue work_queue, std::string worker_name = "") :
         work_queue(work_queue) {
-        worker_thread = std::thread([this, worker_name]() {
+        std::promise<pid_t> tid_promise;
+        auto tid_future = tid_promise.get_future();
+        worker_thread = std::thread([this, worker_name, &tid_promise]() {
+            tid_promise.set_value(preemption::get_native_thread_id());
             do_works(worker_name);
         });
+        native_thread_id = tid_future.get();
     }
 
     Worker(const Worker&) = delete;
@@ -73,6 +169,44 @@ public:
 
     void wait() {
         worker_thread.join();
+        preemption_timer.stop();
+    }
+
+    /*
+     * send preemption signal to this worker every time_slice.
+     * A user thread that runs longer than time_slice is switched out at its next preemption_point().
+     */
+    void start_preemption_timer(std::chrono::microseconds time_slice) {
+        preemption_timer.start(native_thread_id, time_slice);
+    }
+
+    void stop_preemption_timer() {
+        preemption_timer.stop();
+    }
+
+    /*
+     * called from the preemption signal handler on the native thread of this worker.
+     * request preemption if no context switch occurred since previous tick.
+     * must be async signal safe.
+     */
+    void on_preemption_tick() noexcept {
+        const auto count = switch_count.load(std::memory_order_relaxed);
+        if (count == switch_count_at_last_tick) {
+            preemption_requested.store(true, std::memory_order_relaxed);
+        } else {
+            switch_count_at_last_tick = count;
+        }
+    }
+
+    /*
+     * yield if the time slice of the running user thread was expired.
+     * cheap enough to be called in a hot loop.
+     */
+    void preemption_point() {
+        if (preemption_requested.load(std::memory_order_relaxed)) {
+            preemption_requested.store(false, std::memory_order_relaxed);
+            schedule_thread();
+        }
     }
 
 
@@ -81,42 +215,205 @@ public:
         switch_thread(work_queue);
     }
 
+    /*
+     * return the io_uring of this worker, or nullptr if it is not available on the running kernel.
+     * *must* be called on the native thread of this worker.
+     */
+    IoRing* get_io_ring() {
+        if (!io_ring && !io_ring_unavailable) {
+            try {
+                io_ring.reset(new IoRing(io_ring_entries));
+            } catch (const std::system_error&) {
+                io_ring_unavailable = true;
+            }
+        }
+        return io_ring.get();
+    }
+
+    // may be called from any native thread
+    std::uint64_t get_switch_count() const {
+        return switch_count.load(std::memory_order_relaxed);
+    }
+
+    // may be called from any native thread. see running_thread
+    const void* get_running_thread() const {
+        return running_thread.load(std::memory_order_relaxed);
+    }
+
+    const void* get_running_spawn_site() const {
+        return running_spawn_site.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * called by the watchdog.
+     * threads resumed while this is hogged are run by other workers instead of being sent back to this.
+     */
+    void set_hogged(bool value) {
+        hogged.store(value, std::memory_order_relaxed);
+    }
+
+    /*
+     * return the user thread running on this worker,
+     * or the context of the native thread if no user thread is running.
+     */
+    Work get_current_thread() {
+        return current_thread;
+    }
+
     void create_thread(Work t) {
 
         debug::printf("create thread %p\n", &t);
-        switch_thread_to(t);
+        work_queue.thread_created();
+        if (acquire_stack(t)) {
+            switch_thread_to(t);
+        }
+
+    }
+
+    // push a thread to the local queue without switching to it
+    void enqueue_thread(Work t) {
+        work_queue.thread_created();
+        work_queue.push(t);
+    }
 
+    // see WorkQueue::push_lazy()
+    void push_lazy(LazyWork<Work>& work) {
+        work_queue.push_lazy(work);
     }
 
-    static Work make_thread(void (*func)(void* arg), void* arg) {
-        auto func_ = [func, arg](Work prev) -> Work {
+    /*
+     * push threads to the local queue at once without switching to them.
+     * idle workers are woken to steal them.
+     */
+    void create_threads(const std::vector<Work>& threads) {
+        work_queue.thread_created(threads.size());
+        work_queue.push_bulk(threads.begin(), threads.end());
+    }
+
+    /*
+     * switch out the current user thread without putting it back to the work queue.
+     * on_suspended(Work suspended) is called on this worker after the switch,
+     * so that the suspended thread can be published to its wakers without race.
+     * the thread is resumed by resume().
+     * next, if not nullptr, is a suspended thread that the caller woke. it is switched to instead of a queued thread.
+     */
+    template <typename F>
+    void suspend(F on_suspended, Work next = nullptr) {
+        assert(current_thread != &worker_thread_context);
+        after_switch = [](Work prev, void* f) {
+            (*static_cast<F*>(f))(prev);
+        };
+        after_switch_arg = &on_suspended;
+
+        if (next && can_switch_to(next)) {
+            switch_thread_to(next);
+            return;
+        }
+        if (next) {
+            resume(next);
+        }
+        // never park on the stack of the suspending thread: it may be the only thread that becomes runnable.
+        auto p_next = pop_thread(false);
+        switch_thread_to(p_next ? p_next.get() : &worker_thread_context);
+    }
+
+    /*
+     * run target, a suspended thread that the caller woke, by switching to it directly instead of resume().
+     * the work queues are bypassed: no other thread runs in between.
+     * the current thread is queued as if it yielded.
+     * a target pinned to another worker is resumed there, and the current thread continues.
+     */
+    void hand_off(Work target) {
+        assert(current_thread != &worker_thread_context);
+        if (!can_switch_to(target)) {
+            resume(target);
+            return;
+        }
+        current_thread->yielded_at = std::chrono::steady_clock::now();
+        yielding = true;
+        switch_thread_to(target);
+    }
+
+    /*
+     * make a suspended thread runnable.
+     * it is sent back to the worker that ran it last for cache locality,
+     * unless the worker is overloaded and the caller is a worker that can run it instead,
+     * or the worker is hogged by a thread.
+     */
+    static void resume(Work thread) {
+        Worker* last_worker = thread->last_worker;
+        Worker* worker = find_worker_of_this_native_thread();
+        if (is_pinned(thread)) {
+            if (worker == last_worker) {
+                worker->work_queue.push_pinned(thread);
+            } else {
+                last_worker->work_queue.post_pinned(thread);
+            }
+        } else if (worker == last_worker) {
+            worker->work_queue.push(thread);
+        } else if (worker && (last_worker->hogged.load(std::memory_order_relaxed) ||
+                              last_worker->work_queue.size() >= overloaded_queue_size)) {
+            worker->work_queue.push(thread);
+        } else if (last_worker->hogged.load(std::memory_order_relaxed)) {
+            last_worker->work_queue.inject(thread);
+        } else {
+            last_worker->work_queue.post(thread);
+        }
+    }
+
+    /*
+     * fn() is called on the new thread.
+     * fn is deleted without being called if the thread is cancelled before launch.
+     * spawn_site is the key of stack profiling. nullptr means the type of fn.
+     */
+    template <typename Fn>
+    static Work make_thread(Fn fn, const ThreadAttributes& attributes = {}, const void* spawn_site = nullptr) {
+        auto func_ = [fn = std::move(fn)](Work prev) mutable -> Work {
             call_after_context_switch(prev);
 
-            func(arg);
+            fn();
 
             debug::printf("fini\n");
+            get_worker_of_this_native_thread().current_thread->fiber_local_storage.run_destructors();
+
             auto& worker = get_worker_of_this_native_thread();
-            auto pop_no_timeout = [&]() -> decltype(worker.work_queue.pop()) {
-                while (!worker.work_queue.is_closed()) {
-                    auto p_next = worker.work_queue.pop();
-                    if (p_next) {
-                        return p_next;
-                    }
-                }
-                return boost::none;
-            };
-            auto p_next = pop_no_timeout();
+            worker.work_queue.thread_finished();
+
+            // blocks until next thread is found or all threads finished
+            auto p_next = worker.pop_thread(true);
 
             if (!p_next) {
                 debug::printf("work queue was closed. will jump back to worker context\n");
-                // remove volatile by copy
-                auto tmp = worker.worker_thread_context;
-                p_next = tmp;
+                p_next = &worker.worker_thread_context;
             }
             debug::printf("next thread is at %p\n", p_next.get());
+            worker.current_thread = p_next.get();
+            worker.assign(p_next.get());
             return p_next.get();
         };
-        return BadDesignContextTraits::make_context(func_);
+#ifdef USE_SPLITSTACKS
+        if (attributes.shared_stack) {
+            throw std::invalid_argument("shared stacks are not supported with split stacks");
+        }
+        Work thread = BadDesignContextTraits::make_context(std::move(func_), attributes.stack_size);
+#else
+        Work thread = attributes.shared_stack ? BadDesignContextTraits::make_context_on_shared_stack(std::move(func_))
+                      : BadDesignContextTraits::make_context(std::move(func_), attributes.stack_size);
+#endif
+        thread->spawn_site = spawn_site ? spawn_site : reinterpret_cast<const void*>(&spawn_site_of<Fn>);
+
+        if (attributes.cancellation_token.valid()) {
+            thread->cancellation = attributes.cancellation_token.get_state();
+        } else if (Work creator = ::orks::userthread::detail::get_current_thread()) {
+            thread->cancellation = creator->cancellation;
+        }
+        return thread;
+    }
+
+    static Work make_thread(void (*func)(void* arg), void* arg, const ThreadAttributes& attributes = {}) {
+        return make_thread([func, arg]() {
+            func(arg);
+        }, attributes, reinterpret_cast<const void*>(func));
     }
 
 
@@ -128,12 +425,18 @@ private:
 #endif
 
         register_worker_of_this_native_thread(*this, worker_name);
+        ContextTraits::init_native_context(worker_thread_context);
 
         debug::printf("worker is wake up! this: %p\n", this);
-        debug::printf("worker_thread_context %p\n", worker_thread_context);
-
-        while (!work_queue.is_closed()) {
-            schedule_thread();
+        debug::printf("worker_thread_context %p\n", &worker_thread_context);
+
+        // work_queue.pop() parks this worker while there is no work
+        while (auto p_next = pop_thread(true)) {
+            switch_thread_to(p_next.get());
+            while (Work next = handoff) {
+                handoff = nullptr;
+                switch_thread_to(next);
+            }
         }
 
         debug::printf("jumped back to worker context\n");
@@ -144,61 +447,161 @@ private:
     }
 
 
+    /*
+     * switch to other thread if exists.
+     * never blocks.
+     */
     void switch_thread(WorkQueue& work_queue) {
-        auto p_next = work_queue.pop();
+        auto p_next = pop_thread(false);
         if (!p_next) {
-            if (!work_queue.is_closed()) {
-                debug::printf("work queue was time out. no context switch will occur.\n");
-                return;
+            debug::printf("no other work. no context switch will occur.\n");
+            return;
+        }
+
+        Work self = current_thread;
+        self->yielded_at = std::chrono::steady_clock::now();
+        yielding = true;
+        switch_thread_to(p_next.get());
+
+        // resumed. possibly on another worker.
+        const auto wait = std::chrono::steady_clock::now() - self->yielded_at;
+        self->max_yield_wait = std::max(self->max_yield_wait, wait);
+    }
+
+    /*
+     * threads cancelled before launch, or whose stack could not be allocated, are discarded here without running.
+     */
+    boost::optional<Work> pop_thread(bool blocking) {
+        while (true) {
+            auto p_next = io_ring && io_ring->is_busy() ? pop_thread_with_io(blocking)
+                          : blocking ? work_queue.pop() : work_queue.try_pop();
+            if (!p_next) {
+                return p_next;
+            }
+            if (ContextTraits::is_cancelled_before_launch(p_next.get())) {
+                debug::printf("discard cancelled Work %p\n", p_next.get());
+                ContextTraits::discard_context(p_next.get());
+                work_queue.thread_finished();
+            } else if (acquire_stack(p_next.get())) {
+                return p_next;
             }
+        }
+    }
+
+    /*
+     * allocate the stack of t before switching to it, while current_thread of this worker is still intact.
+     * return false if the allocation failed. t is discarded inside the handler then,
+     * so that its function reports the exception. see exception_of_discarded_thread().
+     */
+    bool acquire_stack(Work t) {
+        try {
+            ContextTraits::acquire_stack(t);
+            return true;
+        } catch (...) {
+            debug::printf("discard Work %p without stack\n", t);
+            ContextTraits::discard_context(t);
+            work_queue.thread_finished();
+            return false;
+        }
+    }
 
-            debug::printf("will jump back to worker context\n");
-            if (worker_thread_context == nullptr) {
-                return;
+    /*
+     * pop_thread() while this worker has I/O requests.
+     * completions are reaped at every scheduling point, and the worker waits on its ring instead of parking.
+     * submission is deferred while other threads are ready, so that requests of several threads are entered at once.
+     */
+    boost::optional<Work> pop_thread_with_io(bool blocking) {
+        while (true) {
+            io_ring->prepare_cancels();
+            io_ring->reap();
+            auto p_next = work_queue.try_pop();
+
+            const unsigned prepared = io_ring->get_number_of_prepared();
+            if (p_next && (prepared == 0 ||
+                           (prepared < io_submit_batch && ++io_deferred_rounds < io_max_deferred_rounds))) {
+                return p_next;
             }
-            // remove volatile by copy
-            auto tmp = worker_thread_context;
-            p_next = tmp;
+            io_deferred_rounds = 0;
+
+            if (p_next || !blocking) {
+                io_ring->submit();
+                return p_next;
+            }
+            if (!io_ring->is_busy()) {
+                return work_queue.pop();
+            }
+            io_ring->submit_and_wait(io_wait_timeout());
         }
-        switch_thread_to(p_next.get());
     }
 
     void switch_thread_to(Work next) {
 
-        debug::printf("jump to Work %p\n", &next);
+        // a caught exception is recorded per native thread, and would be seen by next. see sync.hpp.
+        assert(current_thread == &worker_thread_context || !std::current_exception());
+
+        // the frames of the current thread are copied out when next occupies the shared stack,
+        // so the switch passes through the worker context, where after_switch can still refer to the frames.
+        if (current_thread->uses_shared_stack() && next->uses_shared_stack()) {
+            handoff = next;
+            next = &worker_thread_context;
+        }
+
+        debug::printf("jump to Work %p\n", next);
         auto prev = switch_context(next);
 
         call_after_context_switch(prev);
 
     }
 
+    /*
+     * current_thread of the worker is updated before the switch,
+     * because the switched thread may be resumed on another worker.
+     */
     Work switch_context(Work to) {
-//        auto this_thread = current_thread;
-//        this_thread->state = ThreadState::stop;
-//        assert(this_thread != nullptr);
-//#ifdef USE_SPLITSTACKS
-//        __splitstack_getcontext(this_thread->splitstack_context_);
-//#endif
-//
-        return ContextTraits::switch_context(to);
+        assign(to);
+        Work from = current_thread;
+        current_thread = to;
+        return ContextTraits::switch_context(from, to);
     }
 
     static void call_after_context_switch(Work prev) {
         Worker& worker = Worker::get_worker_of_this_native_thread();
-        debug::printf("worker.worker_thread_context %p\n", worker.worker_thread_context);
-        if (worker.worker_thread_context == nullptr) {
+
+        // new time slice for the next thread
+        worker.switch_count.store(worker.switch_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        worker.preemption_requested.store(false, std::memory_order_relaxed);
+        const Work running = worker.current_thread;
+        worker.running_thread.store(running == &worker.worker_thread_context ? nullptr : running,
+                                    std::memory_order_relaxed);
+        worker.running_spawn_site.store(running->spawn_site, std::memory_order_relaxed);
+        const bool yielded = worker.yielding;
+        worker.yielding = false;
+
+        if (worker.after_switch) {
+            auto after_switch = worker.after_switch;
+            worker.after_switch = nullptr;
+            after_switch(prev, worker.after_switch_arg);
+            return;
+        }
+
+        if (prev == &worker.worker_thread_context) {
             debug::out << "prev Work is worker_thread_context\n";
-            worker.worker_thread_context = prev;
             return;
         }
 
         if (ContextTraits::is_finished(prev)) {
-            debug::printf("delete prev Work %p\n", &prev);
+            debug::printf("delete prev Work %p\n", prev);
             ContextTraits::destroy_context(prev);
         } else {
-            debug::printf("push prev Work %p\n", &prev);
+            debug::printf("push prev Work %p\n", prev);
             debug::out << "prev Work::state: " << static_cast<int>(prev->state) << "\n";
-            worker.work_queue.push(prev);
+            if (is_pinned(prev)) {
+                worker.work_queue.push_pinned(prev);
+            } else if (yielded) {
+                worker.work_queue.push_yielded(prev);
+            } else {
+                worker.work_queue.push(prev);
+            }
         }
     }
 
@@ -208,8 +611,136 @@ private:
         return ::orks::userthread::detail::get_worker_of_this_native_thread();
     }
 
+    /*
+     * called before next runs on this worker.
+     * a thread on a shared stack gets the shared stack of this worker at its launch.
+     */
+    void assign(Work next) {
+        next->last_worker = this;
+#ifndef USE_SPLITSTACKS
+        if (next->uses_shared_stack() && !next->shared_stack) {
+            if (!shared_stack) {
+                shared_stack.reset(new baddesign::SharedStack());
+            }
+            next->shared_stack = shared_stack.get();
+        }
+#endif
+    }
+
+    // a pinned thread, or a launched thread on a shared stack which has its frames there, runs only on last_worker
+    static bool is_pinned(Work thread) {
+        return thread->pinned || thread->uses_shared_stack();
+    }
+
+    // a suspended thread can be switched to on this worker unless it is pinned to another one
+    bool can_switch_to(Work thread) const {
+        return !is_pinned(thread) || thread->last_worker == this;
+    }
+
+};
+
+/*
+ * whether the calling user thread t has at least half of its stack left.
+ * TaskGroup and parallel_invoke() call children inline only then, and give them threads of their own otherwise,
+ * because recursion of inline calls would grow one stack without bound, and stacks have no guard page.
+ * false on a stack other than that of t, e.g. in the body of a Generator. always true with split stacks, which grow.
+ */
+inline bool has_stack_for_inline_call(Work t) {
+#ifdef USE_SPLITSTACKS
+    (void)t;
+    return true;
+#else
+    char* sp = static_cast<char*>(__builtin_frame_address(0));
+    char* top = t->get_stack();
+    if (!top || sp <= top || top + t->get_stack_size() < sp) {
+        return false;
+    }
+    return static_cast<std::size_t>(sp - top) >= t->get_stack_size() / 2;
+#endif
+}
+
+/*
+ * a user thread suspended in a wait. placed on the stack of the waiting thread.
+ * it is registered to all objects that can wake it (events, cancellation, the sleep timer),
+ * and the first of them that calls try_wake_waiter() resumes the thread.
+ * the objects must call try_wake_waiter() under the lock that unregistration also takes.
+ */
+struct Waiter {
+    enum Phase {
+        registering, waiting, woken_while_registering
+    };
+
+    Work thread;
+    std::atomic_bool claimed = { false };
+    std::atomic_int phase = { registering };
+    WaitStatus status = WaitStatus::ready;
+
+    explicit Waiter(Work thread) :
+        thread(thread) {
+    }
+
+    /*
+     * called by the suspending side after all registrations.
+     * a wake during registration is deferred until here,
+     * because the resumed thread unregisters itself.
+     */
+    void finish_registration() {
+        if (phase.exchange(waiting) == woken_while_registering) {
+            Worker::resume(thread);
+        }
+    }
 };
 
+/*
+ * an object of a waiting thread that wakers touch while the thread is switched out.
+ * placed on the heap for a thread on a shared stack, whose frames are moved out of the stack meanwhile,
+ * and on the stack otherwise.
+ */
+template <typename T>
+class WaitRecord {
+    boost::optional<T> on_stack;
+    std::unique_ptr<T> on_heap;
+
+public:
+    template <typename... Args>
+    explicit WaitRecord(Work thread, Args&& ... args) {
+        if (thread && thread->uses_shared_stack()) {
+            on_heap.reset(new T(std::forward<Args>(args)...));
+        } else {
+            on_stack.emplace(std::forward<Args>(args)...);
+        }
+    }
+
+    T& operator*() {
+        return on_heap ? *on_heap : *on_stack;
+    }
+};
+
+inline bool try_wake_waiter(Waiter& waiter, WaitStatus status) {
+    if (waiter.claimed.exchange(true)) {
+        return false;
+    }
+    waiter.status = status;
+    if (waiter.phase.exchange(Waiter::woken_while_registering) == Waiter::waiting) {
+        Worker::resume(waiter.thread);
+    }
+    return true;
+}
+
+/*
+ * try_wake_waiter() that leaves the resume of the thread to the caller, so that it can switch to it directly.
+ * thread is set to the woken thread, or to nullptr if it is still registering. it is resumed by its registration then.
+ */
+inline bool try_take_over_waiter(Waiter& waiter, WaitStatus status, Work& thread) {
+    if (waiter.claimed.exchange(true)) {
+        return false;
+    }
+    Work woken = waiter.thread;
+    waiter.status = status;
+    thread = waiter.phase.exchange(Waiter::woken_while_registering) == Waiter::waiting ? woken : nullptr;
+    return true;
+}
+
 } // detail
 } // userthread
 } // orks
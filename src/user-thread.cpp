@@ -1,5 +1,9 @@
+#include <cerrno>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
+#include <system_error>
 
 #include "user-thread.hpp"
 
@@ -9,6 +13,12 @@ namespace detail {
 namespace debug {
 std::mutex debug_out_mutex;
 }
+
+#ifdef ORKS_USERTHREAD_THREAD_REGISTRY
+namespace baddesign {
+ThreadRegistry<ThreadDataOfTraits> thread_registry;
+}
+#endif
 }
 }
 }
@@ -45,6 +55,27 @@ Worker& get_worker_of_this_native_thread() {
     return *worker_of_this_native_thread;
 }
 
+Worker* find_worker_of_this_native_thread() {
+    return worker_of_this_native_thread;
+}
+
+Work get_current_thread() {
+    if (!worker_of_this_native_thread) {
+        return nullptr;
+    }
+    return worker_of_this_native_thread->get_current_thread();
+}
+
+namespace {
+FiberLocalStorage& get_fiber_local_storage_of_current_thread() {
+    Work current = get_current_thread();
+    if (!current) {
+        throw std::logic_error("fiber local storage: not called on a worker");
+    }
+    return current->fiber_local_storage;
+}
+}
+
 const std::string& get_worker_name_of_this_native_thread() {
     return worker_name_of_this_native_thread;
 }
@@ -53,6 +84,31 @@ WorkerManager& get_global_workermanager() {
     return *worker_manager_ptr;
 }
 
+namespace preemption {
+namespace {
+void signal_handler(int) {
+    const int saved_errno = errno;
+    if (worker_of_this_native_thread) {
+        worker_of_this_native_thread->on_preemption_tick();
+    }
+    errno = saved_errno;
+}
+}
+
+void install_signal_handler() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        struct sigaction sa {};
+        sa.sa_handler = signal_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        if (::sigaction(preemption_signal, &sa, nullptr) != 0) {
+            throw std::system_error(errno, std::generic_category(), "sigaction");
+        }
+    });
+}
+}
+
 } // detail
 
 using namespace detail;
@@ -63,6 +119,12 @@ void init_worker_manager(unsigned int number_of_worker) {
     }
 }
 
+void init_worker_manager(unsigned int number_of_worker, const AdmissionLimits& admission_limits) {
+    if (!worker_manager_ptr) {
+        worker_manager_ptr = std::make_unique<WorkerManager>(number_of_worker, admission_limits);
+    }
+}
+
 void init_worker_manager() {
     if (!worker_manager_ptr) {
         worker_manager_ptr = std::make_unique<WorkerManager>();
@@ -72,17 +134,100 @@ void init_worker_manager() {
 void start_main_thread(void (*func)(void*), void* arg) {
     init_worker_manager();
     worker_manager_ptr->start_main_thread(func, arg);
+    // shut down. the next call initializes a new one.
+    worker_manager_ptr.reset();
+}
+
+void run(void (*func)(void*), void* arg) {
+    init_worker_manager();
+    worker_manager_ptr->run(func, arg);
 }
 
 void start_thread(void (*func)(void*), void* arg) {
     worker_manager_ptr->start_thread(func, arg);
 }
 
+void submit_thread(void (*func)(void*), void* arg) {
+    worker_manager_ptr->submit_thread(func, arg);
+}
+
 
 
 void yield() {
     worker_manager_ptr->scheduling_yield();
 }
+
+AdmissionCounters get_admission_counters() {
+    return worker_manager_ptr->get_admission_counters();
+}
+
+SchedulerCounters get_scheduler_counters() {
+    return worker_manager_ptr->get_scheduler_counters();
+}
+
+StackUsageProfile get_stack_usage_profile() {
+    return get_stack_profiler().snapshot();
+}
+
+void reset_stack_usage_profile() {
+    get_stack_profiler().reset();
+}
+
+void set_stack_usage_profile_by_spawn_site(bool enable) {
+    get_stack_profiler().set_profile_by_spawn_site(enable);
+}
+
+FiberLocalKey create_fiber_local_key(void (*destructor)(void*)) {
+    return get_fiber_local_key_registry().create_key(destructor);
+}
+
+void delete_fiber_local_key(FiberLocalKey key) {
+    get_fiber_local_key_registry().delete_key(key);
+}
+
+void* get_fiber_local(FiberLocalKey key) {
+    return get_fiber_local_storage_of_current_thread().get(key);
+}
+
+void set_fiber_local(FiberLocalKey key, void* value) {
+    get_fiber_local_storage_of_current_thread().set(key, value);
+}
+
+void*& fiber_local_slot(std::size_t index) {
+    return get_fiber_local_storage_of_current_thread().fixed_slot(index);
+}
+
+void enable_preemption(std::chrono::microseconds time_slice) {
+    init_worker_manager();
+    worker_manager_ptr->enable_preemption(time_slice);
+}
+
+void enable_watchdog(std::chrono::microseconds threshold, std::function<void(const HogReport&)> on_hog) {
+    init_worker_manager();
+    worker_manager_ptr->enable_watchdog(threshold, std::move(on_hog));
+}
+
+void preemption_point() {
+    worker_manager_ptr->preemption_point();
+}
+
+CancellationToken get_cancellation_token() {
+    Work current = get_current_thread();
+    if (!current) {
+        return CancellationToken();
+    }
+    return CancellationToken(current->cancellation);
+}
+
+bool is_cancelled() {
+    Work current = get_current_thread();
+    return current && current->cancellation && current->cancellation->is_cancelled();
+}
+
+std::chrono::steady_clock::duration get_max_yield_wait() {
+    Work current = get_current_thread();
+    return current ? current->max_yield_wait : std::chrono::steady_clock::duration::zero();
+}
 }
 }
 
@@ -0,0 +1,146 @@
+#ifndef USER_THREAD_WATCHDOG_HPP
+#define USER_THREAD_WATCHDOG_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "util.hpp"
+#include "workqueue.hpp"
+#include "user-thread-internal.hpp"
+
+namespace orks {
+namespace userthread {
+namespace detail {
+
+/*
+ * a user thread that ran on a worker without a context switch for longer than the threshold of the watchdog.
+ */
+struct HogReport {
+    // index of the worker
+    unsigned worker;
+    // identifies the thread. it may finish at any time, so it *must not* be dereferenced.
+    const void* thread;
+    // entry function of the thread, the same key as stack profiling
+    const void* spawn_site;
+    // since the last context switch of the worker, as far as sampling tells
+    std::chrono::steady_clock::duration running_for;
+};
+
+/*
+ * native thread that samples the switch counter of each worker.
+ * a worker that runs one user thread for longer than the threshold is reported once per hog,
+ * and the works queued on it are made stealable by the others until it switches.
+ * see Worker::set_hogged() and WorkStealQueue::rescue().
+ */
+class Watchdog {
+    struct Sample {
+        std::uint64_t switch_count = 0;
+        std::chrono::steady_clock::time_point since;
+        bool hogged = false;
+    };
+
+    std::vector<Worker*> workers;
+    WorkStealQueue<Work>& work_queue;
+    const std::chrono::microseconds threshold;
+    std::function<void(const HogReport&)> on_hog;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool stopping = false;
+    std::thread thread;
+
+    // a hog is noticed within threshold + sampling_interval
+    std::chrono::microseconds sampling_interval() const {
+        return std::max(threshold / 4, std::chrono::microseconds(100));
+    }
+
+public:
+    // empty on_hog logs to stderr. on_hog is called on the watchdog thread.
+    Watchdog(std::vector<Worker*> workers, WorkStealQueue<Work>& work_queue, std::chrono::microseconds threshold,
+             std::function<void(const HogReport&)> on_hog) :
+        workers(std::move(workers)),
+        work_queue(work_queue),
+        threshold(threshold),
+        on_hog(on_hog ? std::move(on_hog) : log_hog) {
+        thread = std::thread([this]() {
+            run();
+        });
+    }
+
+    Watchdog(const Watchdog&) = delete;
+
+    // hogged workers are released
+    ~Watchdog() {
+        {
+            auto lock = util::make_unique_lock(mutex);
+            stopping = true;
+        }
+        cond.notify_one();
+        thread.join();
+        for (Worker* worker : workers) {
+            worker->set_hogged(false);
+        }
+    }
+
+    static void log_hog(const HogReport& report) {
+        std::fprintf(stderr, "orks::userthread: worker %u is hogged by thread %p (spawn site %p) for %.3f ms\n",
+                     report.worker, report.thread, report.spawn_site,
+                     std::chrono::duration<double, std::milli>(report.running_for).count());
+    }
+
+private:
+    void run() {
+        std::vector<Sample> samples(workers.size());
+        auto lock = util::make_unique_lock(mutex);
+        while (!stopping) {
+            lock.unlock();
+            for (unsigned i = 0; i < workers.size(); ++i) {
+                check(i, samples[i]);
+            }
+            lock.lock();
+            cond.wait_for(lock, sampling_interval(), [this]() {
+                return stopping;
+            });
+        }
+    }
+
+    void check(unsigned i, Sample& sample) {
+        Worker& worker = *workers[i];
+        const auto now = std::chrono::steady_clock::now();
+        const std::uint64_t count = worker.get_switch_count();
+        if (count != sample.switch_count || !worker.get_running_thread()) {
+            sample.switch_count = count;
+            sample.since = now;
+            if (sample.hogged) {
+                sample.hogged = false;
+                worker.set_hogged(false);
+            }
+            return;
+        }
+        if (sample.hogged || now - sample.since < threshold) {
+            return;
+        }
+
+        const HogReport report { i, worker.get_running_thread(), worker.get_running_spawn_site(), now - sample.since };
+        if (worker.get_switch_count() != count) {
+            // switched while reading the report
+            return;
+        }
+        sample.hogged = true;
+        worker.set_hogged(true);
+        work_queue.rescue(i);
+        on_hog(report);
+    }
+};
+
+}
+}
+}
+
+#endif //USER_THREAD_WATCHDOG_HPP
@@ -1,19 +1,35 @@
 #ifndef USER_THREAD_WORKQUEUE_HPP
 #define USER_THREAD_WORKQUEUE_HPP
 
+#include <algorithm>
+#include <cstdint>
 #include <deque>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <condition_variable>
 #include <boost/optional.hpp>
 
 #include "util.hpp"
+#include "mpsc-queue.hpp"
 
 namespace orks {
 namespace userthread {
 namespace detail {
 
+/*
+ * LIFO queue of new and woken works, and FIFO queue of yielded works.
+ * pinned works are FIFO too, and are never stolen.
+ * posted works, woken threads sent back to the owner, are FIFO and are stolen only after rescue_posted().
+ */
 template<typename T>
 class ThreadSafeQueue {
     std::mutex mutex;
     std::deque<T> queue;
+    std::deque<T> yielded;
+    std::deque<T> pinned;
+    std::deque<T> posted;
 
 public:
 
@@ -22,6 +38,12 @@ public:
         queue.push_back(t);
     }
 
+    template <typename InputIterator>
+    void push_bulk(InputIterator first, InputIterator last) {
+        auto lock = util::make_unique_lock(mutex);
+        queue.insert(queue.end(), first, last);
+    }
+
     /*
      * return true if queue is not empty
      * return false if else
@@ -37,6 +59,74 @@ public:
         return true;
     }
 
+    void push_yielded(const T& t) {
+        auto lock = util::make_unique_lock(mutex);
+        yielded.push_back(t);
+    }
+
+    // pop the oldest yielded work
+    bool pop_yielded(T& t) {
+        auto lock = util::make_unique_lock(mutex);
+        if (yielded.empty()) {
+            return false;
+        }
+
+        t = yielded.front();
+        yielded.pop_front();
+        return true;
+    }
+
+    void push_pinned(const T& t) {
+        auto lock = util::make_unique_lock(mutex);
+        pinned.push_back(t);
+    }
+
+    bool pop_pinned(T& t) {
+        auto lock = util::make_unique_lock(mutex);
+        if (pinned.empty()) {
+            return false;
+        }
+
+        t = pinned.front();
+        pinned.pop_front();
+        return true;
+    }
+
+    bool has_pinned() {
+        auto lock = util::make_unique_lock(mutex);
+        return !pinned.empty();
+    }
+
+    template <typename InputIterator>
+    void push_posted_bulk(InputIterator first, InputIterator last) {
+        auto lock = util::make_unique_lock(mutex);
+        posted.insert(posted.end(), first, last);
+    }
+
+    bool pop_posted(T& t) {
+        auto lock = util::make_unique_lock(mutex);
+        if (posted.empty()) {
+            return false;
+        }
+
+        t = posted.front();
+        posted.pop_front();
+        return true;
+    }
+
+    bool has_posted() {
+        auto lock = util::make_unique_lock(mutex);
+        return !posted.empty();
+    }
+
+    // make posted works stealable. return the number of stealable works.
+    std::size_t rescue_posted() {
+        auto lock = util::make_unique_lock(mutex);
+        queue.insert(queue.end(), posted.begin(), posted.end());
+        posted.clear();
+        return queue.size() + yielded.size();
+    }
+
     bool pop_front(T& t) {
         auto lock = util::make_unique_lock(mutex);
         if (queue.empty()) {
@@ -48,11 +138,106 @@ public:
         return true;
     }
 
+    /*
+     * move the older half of the queue (at least one, at most max_size) to out.
+     * yielded works are taken only if the queue is empty.
+     * return false if both are empty.
+     */
+    bool pop_front_half(std::vector<T>& out, std::size_t max_size) {
+        auto lock = util::make_unique_lock(mutex);
+        auto& from = queue.empty() ? yielded : queue;
+        if (from.empty()) {
+            return false;
+        }
+
+        const std::size_t size = std::min((from.size() + 1) / 2, max_size);
+        out.assign(from.begin(), from.begin() + size);
+        from.erase(from.begin(), from.begin() + size);
+        return true;
+    }
+
+    // pinned and posted works are not counted, because only the owner can pop them
+    bool empty() {
+        auto lock = util::make_unique_lock(mutex);
+        return queue.empty() && yielded.empty();
+    }
+
+    // pinned works are not counted
+    std::size_t size() {
+        auto lock = util::make_unique_lock(mutex);
+        return queue.size() + yielded.size() + posted.size();
+    }
+
+};
+
+
+/*
+ * a work that is made only when it is stolen. see WorkQueue::push_lazy().
+ */
+template <typename T>
+struct LazyWork {
+    // called by the thief after it took this. return the work to run.
+    T (*make)(LazyWork& self);
+    // index of the queue that holds this
+    int queue_num = -1;
+};
+
+template <typename T>
+class LazyWorkQueue {
+    std::mutex mutex;
+    std::deque<LazyWork<T>*> works;
+
+public:
+    void push(LazyWork<T>* work) {
+        auto lock = util::make_unique_lock(mutex);
+        works.push_back(work);
+    }
+
+    /*
+     * remove work from this queue.
+     * return false if it was already taken by a thief.
+     */
+    bool withdraw(LazyWork<T>* work) {
+        auto lock = util::make_unique_lock(mutex);
+        // the newest one in most cases
+        for (auto it = works.rbegin(); it != works.rend(); ++it) {
+            if (*it == work) {
+                works.erase(std::next(it).base());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * make the oldest one and take it. boost::none if empty.
+     * made under the lock, so that its pusher never finds it taken before it is made.
+     * if make throws, it is left in this queue for its pusher.
+     */
+    boost::optional<T> make_front() {
+        auto lock = util::make_unique_lock(mutex);
+        if (works.empty()) {
+            return boost::none;
+        }
+        LazyWork<T>* work = works.front();
+        T made = work->make(*work);
+        works.pop_front();
+        return made;
+    }
+
+    bool empty() {
+        auto lock = util::make_unique_lock(mutex);
+        return works.empty();
+    }
 };
 
 
 /*
  * pop時にnullptrが返った場合はqueueがcloseされたことを表す。
+ *
+ * WorkStealQueue also counts live threads for termination detection.
+ * Workers that found no work park on their own condition variable instead of spinning,
+ * and are woken by push(), post() to their mailbox, or close().
  */
 template<typename T,
          template<typename U> class ThreadSafeDeque = ThreadSafeQueue>
@@ -60,6 +245,31 @@ class WorkStealQueue {
     std::vector<ThreadSafeDeque<T>> work_queues;
     std::atomic_bool closed = { false };
 
+    // works submitted from native threads which are not workers
+    MpscQueue<T> injection_queue;
+
+    // works posted to a specific worker. drained by the owner only.
+    std::unique_ptr<MpscQueue<T>[]> mailboxes;
+    // the same, for pinned works
+    std::unique_ptr<MpscQueue<T>[]> pinned_mailboxes;
+
+    // works not made yet, pushed by threads running on each worker
+    std::unique_ptr<LazyWorkQueue<T>[]> lazy_queues;
+
+    struct ParkingSlot {
+        std::condition_variable cond;
+        bool parked = false;
+    };
+
+    std::mutex park_mutex;
+    std::unique_ptr<ParkingSlot[]> parking_slots;
+    std::atomic_int number_of_parked_workers = { 0 };
+
+    std::atomic<std::size_t> number_of_live_threads = { 0 };
+    std::mutex finish_mutex;
+    std::atomic<std::uint64_t> number_of_steals = { 0 };
+    std::condition_variable finish_cond;
+
 
 public:
 
@@ -67,6 +277,8 @@ public:
         ThreadSafeDeque<T>& queue;
         WorkStealQueue& wsq;
         int queue_num;
+        // pops since a yielded work was popped. owned by the worker of this queue.
+        unsigned pops_since_yielded = 0;
 
     public:
         explicit WorkQueue(ThreadSafeDeque<T>& q, WorkStealQueue& wsq,
@@ -78,18 +290,159 @@ public:
         void push(T t) {
             debug::printf("WorkQueue::push %p\n", t);
             queue.push(t);
+            wsq.notify_pushed();
+        }
+
+        /*
+         * push a work that yielded. it is popped after the works yielded before it,
+         * and at least once in yielded_pop_interval pops even while new works keep being pushed.
+         */
+        void push_yielded(T t) {
+            debug::printf("WorkQueue::push_yielded %p\n", t);
+            queue.push_yielded(t);
+            wsq.notify_pushed();
+        }
+
+        /*
+         * push a work that is made by a thief only if it is stolen.
+         * the pusher must withdraw_lazy() it, or wait until the made work finished.
+         * idle workers are woken to steal it.
+         */
+        void push_lazy(LazyWork<T>& work) {
+            work.queue_num = queue_num;
+            wsq.lazy_queues[queue_num].push(&work);
+            wsq.notify_pushed();
         }
 
+        /*
+         * push a work to the mailbox of this queue from any native thread.
+         * unlike push(), the work is run by the owner of this queue.
+         * it is stolen only if the owner is hogged. see WorkStealQueue::rescue().
+         */
+        void post(T t) {
+            debug::printf("WorkQueue::post %p\n", t);
+            wsq.post(queue_num, t);
+        }
+
+        /*
+         * push a work that only the owner of this queue may run. called by the owner.
+         * pinned works are popped in FIFO order after other local works,
+         * and at least once in yielded_pop_interval pops like yielded works.
+         */
+        void push_pinned(T t) {
+            debug::printf("WorkQueue::push_pinned %p\n", t);
+            queue.push_pinned(t);
+        }
+
+        // push a work from any native thread for any worker. see WorkStealQueue::inject()
+        void inject(T t) {
+            wsq.inject(t);
+        }
+
+        // push_pinned() from any native thread
+        void post_pinned(T t) {
+            debug::printf("WorkQueue::post_pinned %p\n", t);
+            wsq.post_pinned(queue_num, t);
+        }
 
+        std::size_t size() {
+            return queue.size();
+        }
+
+        /*
+         * push works with one lock, and wake as many parked workers as the works.
+         */
+        template <typename InputIterator>
+        void push_bulk(InputIterator first, InputIterator last) {
+            queue.push_bulk(first, last);
+            wsq.notify_pushed(std::distance(first, last));
+        }
+
+
+        /*
+         * blocks until a work is found.
+         * return boost::none only if queue was closed.
+         */
         boost::optional<T> pop() {
 
+            while (true) {
+                auto t = try_pop();
+                if (t) {
+                    return t;
+                }
+
+                t = wsq.steal(queue, queue_num);
+                if (t || wsq.is_closed()) {
+                    return t;
+                }
+
+                // returns at once if works were posted while stealing
+                wsq.park(queue_num);
+            }
+        }
+
+        /*
+         * does not block.
+         * return boost::none if no work was found in own queue and one round of stealing.
+         */
+        boost::optional<T> try_pop() {
+
+            // posted works are resumed before others, in the order they were posted
+            auto& mailbox = wsq.mailboxes[queue_num];
+            if (!mailbox.empty()) {
+                std::vector<T> posted;
+                mailbox.consume_all([&posted](T & t) {
+                    posted.push_back(t);
+                });
+                queue.push_posted_bulk(posted.rbegin(), posted.rend());
+            }
+            auto& pinned_mailbox = wsq.pinned_mailboxes[queue_num];
+            if (!pinned_mailbox.empty()) {
+                pinned_mailbox.consume_all([this](T & posted) {
+                    queue.push_pinned(posted);
+                });
+            }
+
             T t;
+            if (queue.pop_posted(t)) {
+                debug::printf("WorkQueue::pop posted %p\n", t);
+                return t;
+            }
+
+            if (++pops_since_yielded >= yielded_pop_interval && (queue.pop_yielded(t) || queue.pop_pinned(t))) {
+                debug::printf("WorkQueue::pop yielded %p\n", t);
+                pops_since_yielded = 0;
+                return t;
+            }
+
             if (queue.pop(t)) {
                 debug::printf("WorkQueue::pop %p\n", t);
                 return t;
             }
 
-            return wsq.steal();
+            // move injected works to own queue, where other workers can steal them.
+            // the oldest injected work is pushed last and popped first.
+            auto push_to_own_queue = [this](T & injected) {
+                queue.push(injected);
+            };
+            if (wsq.injection_queue.consume_all(push_to_own_queue) && queue.pop(t)) {
+                debug::printf("WorkQueue::pop injected %p\n", t);
+                return t;
+            }
+
+            if (queue.pop_pinned(t)) {
+                debug::printf("WorkQueue::pop pinned %p\n", t);
+                pops_since_yielded = 0;
+                return t;
+            }
+
+            if (queue.pop_yielded(t)) {
+                debug::printf("WorkQueue::pop yielded %p\n", t);
+                pops_since_yielded = 0;
+                return t;
+            }
+
+            return wsq.steal_once(queue);
         }
 
         void close() {
@@ -100,10 +453,22 @@ public:
             return wsq.is_closed();
         }
 
+        void thread_created(std::size_t n = 1) {
+            wsq.thread_created(n);
+        }
+
+        void thread_finished() {
+            wsq.thread_finished();
+        }
+
     };
 
     explicit WorkStealQueue(int num_of_worker) :
-        work_queues(num_of_worker) {
+        work_queues(num_of_worker),
+        mailboxes(new MpscQueue<T>[num_of_worker]),
+        pinned_mailboxes(new MpscQueue<T>[num_of_worker]),
+        lazy_queues(new LazyWorkQueue<T>[num_of_worker]),
+        parking_slots(new ParkingSlot[num_of_worker]) {
 
     }
 
@@ -117,26 +482,24 @@ public:
 
 
     /*
-     * return false if no works left
-     * return true if else
+     * return boost::none if no works left or queue was closed,
+     * or works were posted to the queue_num th worker, which owns own_queue.
      */
-    boost::optional<T> steal() {
+    boost::optional<T> steal(ThreadSafeDeque<T>& own_queue, int queue_num) {
 
-        for (auto i : boost::irange(0, 1000)) {
+        for (int round = 0; round < steal_rounds_before_park; ++round) {
             debug::printf("WorkQueue::steal loop\n");
             if (closed) {
                 debug::printf("WorkQueue::steal closed\n");
                 return boost::none;
             }
+            if (!mailboxes[queue_num].empty() || !pinned_mailboxes[queue_num].empty()) {
+                return boost::none;
+            }
 
-
-            for (int i : boost::irange(0, static_cast<int>(work_queues.size()))) {
-                auto& queue = work_queues[i];
-                T t;
-                if (queue.pop_front(t)) {
-                    debug::printf("WorkQueue::steal %p\n", t);
-                    return t;
-                }
+            auto t = steal_once(own_queue);
+            if (t) {
+                return t;
             }
 
         }
@@ -144,14 +507,233 @@ public:
         return boost::none;
     }
 
+    /*
+     * steal the older half of the first non empty queue.
+     * one of stolen works is returned and the others are pushed to own_queue,
+     * so that a batch of works spreads over workers in a few steals.
+     * if no queue has works, the oldest lazy work of any worker is made.
+     */
+    boost::optional<T> steal_once(ThreadSafeDeque<T>& own_queue) {
+        std::vector<T> stolen;
+        for (int i : boost::irange(0, static_cast<int>(work_queues.size()))) {
+            auto& queue = work_queues[i];
+            if (&queue == &own_queue) {
+                continue;
+            }
+            if (queue.pop_front_half(stolen, max_steal_size)) {
+                debug::printf("WorkQueue::steal %p\n", stolen.front());
+                number_of_steals.fetch_add(1, std::memory_order_relaxed);
+                own_queue.push_bulk(stolen.begin() + 1, stolen.end());
+                return stolen.front();
+            }
+        }
+
+        // including own lazy works: their pushers may be suspended
+        for (int i : boost::irange(0, static_cast<int>(work_queues.size()))) {
+            boost::optional<T> made;
+            try {
+                made = lazy_queues[i].make_front();
+            } catch (...) {
+                debug::printf("WorkQueue::steal failed to make a lazy work\n");
+                continue;
+            }
+            if (made) {
+                number_of_steals.fetch_add(1, std::memory_order_relaxed);
+                // counted only once it was made, so that a failed make does not keep close() waiting
+                thread_created();
+                return made;
+            }
+        }
+        return boost::none;
+    }
+
+    /*
+     * remove a lazy work pushed by WorkQueue::push_lazy() from any native thread.
+     * return false if a thief took it.
+     */
+    bool withdraw_lazy(LazyWork<T>& work) {
+        return lazy_queues[work.queue_num].withdraw(&work);
+    }
+
+    /*
+     * push a work from any native thread.
+     * lock-free, and wakes a parked worker.
+     */
+    void inject(T t) {
+        debug::printf("WorkQueue::inject %p\n", t);
+        injection_queue.push(t);
+        notify_pushed();
+    }
+
+    template <typename InputIterator>
+    void inject_bulk(InputIterator first, InputIterator last) {
+        injection_queue.push_bulk(first, last);
+        notify_pushed(std::distance(first, last));
+    }
+
+    /*
+     * push a work to the mailbox of the queue_num th worker, and wake it if parked.
+     */
+    void post(int queue_num, T t) {
+        mailboxes[queue_num].push(t);
+        if (number_of_parked_workers > 0) {
+            auto lock = util::make_unique_lock(park_mutex);
+            unpark(queue_num);
+        }
+    }
+
+    // see WorkQueue::post_pinned()
+    void post_pinned(int queue_num, T t) {
+        pinned_mailboxes[queue_num].push(t);
+        if (number_of_parked_workers > 0) {
+            auto lock = util::make_unique_lock(park_mutex);
+            unpark(queue_num);
+        }
+    }
+
+    /*
+     * make the works of the queue_num th worker stealable while its owner is stuck in a work:
+     * its mailbox is moved to its queue, and parked workers are woken to steal them.
+     * pinned works are left.
+     */
+    void rescue(int queue_num) {
+        auto& queue = work_queues[queue_num];
+        mailboxes[queue_num].consume_all([&queue](T & posted) {
+            queue.push(posted);
+        });
+        notify_pushed(queue.rescue_posted());
+    }
+
+    /*
+     * sleep until a work is pushed or queue is closed.
+     * may return spuriously.
+     */
+    void park(int queue_num) {
+        auto lock = util::make_unique_lock(park_mutex);
+        ++number_of_parked_workers;
+        auto& slot = parking_slots[queue_num];
+        slot.parked = true;
+        auto leave = util::make_scope_exit([this, &slot]() {
+            slot.parked = false;
+            --number_of_parked_workers;
+        });
+
+        // re-check after number_of_parked_workers was incremented
+        // so that push() before this check is never missed.
+        if (closed || has_work(queue_num)) {
+            return;
+        }
+        debug::printf("WorkQueue::park\n");
+        slot.cond.wait(lock);
+    }
+
+    /*
+     * blocks until all threads counted by thread_created() finished, and then closes the queue,
+     * so that no counted thread is left without workers.
+     */
     void close() {
-        closed = true;
+        {
+            auto lock = util::make_unique_lock(finish_mutex);
+            finish_cond.wait(lock, [this]() {
+                return number_of_live_threads == 0;
+            });
+            closed = true;
+        }
+        auto lock = util::make_unique_lock(park_mutex);
+        for (std::size_t i = 0; i < work_queues.size(); ++i) {
+            unpark(i);
+        }
     }
 
     bool is_closed() {
         return closed;
     }
 
+    void thread_created(std::size_t n = 1) {
+        number_of_live_threads += n;
+    }
+
+    /*
+     * thread_created() for threads made outside of the counted threads, which may race close().
+     * return false if the queue was closed. the threads will never be run then.
+     */
+    bool try_thread_created(std::size_t n = 1) {
+        auto lock = util::make_unique_lock(finish_mutex);
+        if (closed) {
+            return false;
+        }
+        number_of_live_threads += n;
+        return true;
+    }
+
+    void thread_finished() {
+        if (--number_of_live_threads == 0) {
+            auto lock = util::make_unique_lock(finish_mutex);
+            finish_cond.notify_all();
+        }
+    }
+
+    // successful steals, counting a batch as one
+    std::uint64_t get_number_of_steals() const {
+        return number_of_steals.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * blocks until all threads counted by thread_created() called thread_finished().
+     */
+    void wait_all_threads_finished() {
+        auto lock = util::make_unique_lock(finish_mutex);
+        finish_cond.wait(lock, [this]() {
+            return number_of_live_threads == 0;
+        });
+    }
+
+private:
+    static constexpr int steal_rounds_before_park = 1000;
+    // the oldest yielded work is popped before newer works at this interval
+    static constexpr unsigned yielded_pop_interval = 8;
+    static constexpr std::size_t max_steal_size = 64;
+
+    bool has_work(int queue_num) {
+        if (!injection_queue.empty() || !mailboxes[queue_num].empty() || !pinned_mailboxes[queue_num].empty() ||
+                work_queues[queue_num].has_pinned() || work_queues[queue_num].has_posted()) {
+            return true;
+        }
+        for (auto& queue : work_queues) {
+            if (!queue.empty()) {
+                return true;
+            }
+        }
+        for (std::size_t i = 0; i < work_queues.size(); ++i) {
+            if (!lazy_queues[i].empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // *must* hold park_mutex
+    void unpark(std::size_t queue_num) {
+        auto& slot = parking_slots[queue_num];
+        if (slot.parked) {
+            // cleared here so that next notification wakes another worker
+            slot.parked = false;
+            slot.cond.notify_one();
+        }
+    }
+
+    void notify_pushed(std::ptrdiff_t number_of_works = 1) {
+        if (number_of_parked_workers > 0) {
+            auto lock = util::make_unique_lock(park_mutex);
+            for (std::size_t i = 0; i < work_queues.size() && number_of_works > 0; ++i) {
+                if (parking_slots[i].parked) {
+                    unpark(i);
+                    --number_of_works;
+                }
+            }
+        }
+    }
+
 };
 }
 }
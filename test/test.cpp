@@ -1,5 +1,15 @@
 #include <thread>
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <fstream>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <unwind.h>
 #include "gtest/gtest.h"
 #include "user-thread.hpp"
 
@@ -115,6 +125,69 @@ TEST(WorkerManager, TestYieldWith1Worker) {
     ASSERT_EQ(args.thread_size * 2, args.counter);
 }
 
+TEST(WorkerManager, YieldedThreadsRunInFifoOrder) {
+
+    WorkerManager wm { 1 };
+    detail::start_main_thread(wm, [&wm]() {
+        constexpr int number_of_yields = 100;
+        std::vector<int> order;
+        auto futures = detail::create_threads(wm, 3, [&wm, &order](std::size_t i) {
+            for (int k = 0; k < number_of_yields; ++k) {
+                order.push_back(static_cast<int>(i));
+                wm.scheduling_yield();
+            }
+        });
+        for (auto& future : futures) {
+            future.get();
+        }
+
+        ASSERT_EQ(3u * number_of_yields, order.size());
+        for (std::size_t k = 3; k < order.size(); ++k) {
+            ASSERT_EQ(order[k - 3], order[k]);
+        }
+    });
+}
+
+TEST(WorkerManager, YieldedThreadIsNotStarvedByNewThreads) {
+
+    WorkerManager wm { 1 };
+    detail::start_main_thread(wm, [&wm]() {
+        constexpr int number_of_children = 1000;
+        std::atomic_bool done { false };
+        int polls = 0;
+        auto poller = detail::create_thread(wm, [&]() {
+            while (!done) {
+                ++polls;
+                wm.scheduling_yield();
+            }
+            return get_max_yield_wait();
+        });
+
+        for (int i = 0; i < number_of_children; ++i) {
+            detail::create_thread(wm, []() {
+            });
+        }
+        done = true;
+
+        ASSERT_LT(std::chrono::steady_clock::duration::zero(), poller.get());
+        ASSERT_LE(number_of_children / 32, polls);
+    });
+    ASSERT_EQ(std::chrono::steady_clock::duration::zero(), get_max_yield_wait());
+}
+
+TEST(WorkerManager, SchedulerCountersCountSwitches) {
+
+    WorkerManager wm { 2 };
+    const auto before = wm.get_scheduler_counters();
+    detail::start_main_thread(wm, [&wm]() {
+        for (int i = 0; i < 10; ++i) {
+            wm.scheduling_yield();
+        }
+    });
+    const auto after = wm.get_scheduler_counters();
+    ASSERT_LE(before.switches + 1, after.switches);
+    ASSERT_LE(before.steals, after.steals);
+}
 
 TEST(WorkerManager, Test) {
 
@@ -160,6 +233,1348 @@ TEST(TestBigLocalArray, RecThread) {
 
 #endif
 
+void child_thread_for_test_outlive_main(void* arg) {
+    TestData& args = *reinterpret_cast<TestData*>(arg);
+    for (int i = 0; i < 100; ++i) {
+        args.wm.scheduling_yield();
+    }
+    ++args.counter;
+}
+
+void main_thread_for_test_outlive_main(void* arg) {
+    TestData& args = *reinterpret_cast<TestData*>(arg);
+    for (int i = 0; i < args.thread_size; ++i) {
+        args.wm.start_thread(child_thread_for_test_outlive_main, &args);
+    }
+    // return without waiting children
+}
+
+TEST(WorkerManager, ThreadsOutliveMainThreadWith1Worker) {
+
+    WorkerManager wm { 1 };
+    TestData args {wm};
+    wm.start_main_thread(main_thread_for_test_outlive_main, &args);
+    ASSERT_EQ(args.thread_size, args.counter);
+}
+
+TEST(WorkerManager, ThreadsOutliveMainThread) {
+
+    WorkerManager wm { 4 };
+    TestData args {wm};
+    wm.start_main_thread(main_thread_for_test_outlive_main, &args);
+    ASSERT_EQ(args.thread_size, args.counter);
+}
+
+TEST(WorkerManager, ManyIdleWorkers) {
+
+    // idle workers must park instead of spinning
+    WorkerManager wm { 32 };
+    std::atomic_int i {0};
+    wm.start_main_thread(main_thread_for_test_main_thread, &i);
+    ASSERT_EQ(i, 1);
+}
+
+TEST(WorkerManager, RunManySessions) {
+
+    WorkerManager wm { 4 };
+    for (int session = 0; session < 100; ++session) {
+        auto future = detail::run(wm, [&wm, session]() {
+            auto futures = detail::create_threads(wm, 8, [session](std::size_t i) {
+                return session + static_cast<int>(i);
+            });
+            int sum = 0;
+            for (auto& f : futures) {
+                sum += f.get();
+            }
+            return sum;
+        });
+        ASSERT_EQ(8 * session + 28, future.get());
+    }
+
+    // threads submitted between sessions are run by the warm workers
+    auto submitted = detail::submit(wm, []() {
+        return 1;
+    });
+    ASSERT_EQ(1, submitted.get());
+
+    wm.shutdown();
+    ASSERT_THROW(detail::run(wm, []() {
+    }), std::logic_error);
+}
+
+TEST(WorkerManager, DestructWithoutSession) {
+
+    WorkerManager wm { 2 };
+}
+
+TEST(WorkerManager, GlobalRunAfterStartMainThread) {
+
+    std::atomic_int i {0};
+    auto increment = [](void* arg) {
+        ++*static_cast<std::atomic_int*>(arg);
+    };
+    init_worker_manager(2);
+    start_main_thread(increment, &i);
+    // the shut down global worker manager is initialized again
+    run(increment, &i);
+    run(increment, &i);
+    start_main_thread(increment, &i);
+    ASSERT_EQ(i, 4);
+}
+
+TEST(Submit, SubmitBeforeStartMainThread) {
+
+    WorkerManager wm { 2 };
+    auto future = detail::submit(wm, [](int n) {
+        return n * 2;
+    }, 21);
+    wm.start_main_thread([](void*) {}, nullptr);
+    ASSERT_EQ(42, future.get());
+}
+
+TEST(Submit, SubmitFromForeignNativeThread) {
+
+    WorkerManager wm { 2 };
+    const int size = 100;
+    std::atomic_int counter {0};
+    std::thread foreign;
+    // gtest assertions fail the test only on the thread of the test
+    std::vector<int> results;
+    detail::start_main_thread(wm, [&]() {
+        foreign = std::thread([&]() {
+            std::vector<Future<int>> futures;
+            for (int i = 0; i < size; ++i) {
+                futures.push_back(detail::submit(wm, [&counter](int i) {
+                    ++counter;
+                    return i;
+                }, i));
+            }
+            for (int i = 0; i < size; ++i) {
+                results.push_back(futures[i].get());
+            }
+        });
+        // keep workers alive until foreign thread submitted all
+        while (counter != size) {
+            wm.scheduling_yield();
+        }
+    });
+    foreign.join();
+    ASSERT_EQ(size, counter);
+    ASSERT_EQ(static_cast<std::size_t>(size), results.size());
+    for (int i = 0; i < size; ++i) {
+        ASSERT_EQ(i, results[i]);
+    }
+}
+
+TEST(Submit, SubmitRacingShutdownIsRunOrRejected) {
+
+    WorkerManager wm { 2 };
+    std::vector<Future<int>> futures;
+    bool rejected = false;
+    std::thread foreign([&]() {
+        try {
+            for (int i = 0; i < 100000; ++i) {
+                futures.push_back(detail::submit(wm, []() {
+                    return 1;
+                }));
+            }
+        } catch (std::logic_error&) {
+            rejected = true;
+        }
+    });
+    wm.start_main_thread([](void*) {}, nullptr);
+    foreign.join();
+    // accepted threads were run before the workers quit
+    for (auto& future : futures) {
+        ASSERT_TRUE(future.is_ready());
+    }
+    ASSERT_TRUE(rejected || futures.size() == 100000u);
+}
+
+TEST(Submit, StartThreadFromForeignNativeThread) {
+
+    WorkerManager wm { 1 };
+    std::atomic_int i {0};
+    wm.start_thread(main_thread_for_test_main_thread, &i);
+    wm.start_main_thread([](void*) {}, nullptr);
+    ASSERT_EQ(1, i);
+}
+
+TEST(Spawn, CreateThreadsDoesNotSwitch) {
+
+    WorkerManager wm { 1 };
+    std::atomic_int started {0};
+    auto future = detail::start_main_thread(wm, [&]() {
+        auto futures = detail::create_threads(wm, 1000, [&started](std::size_t i) {
+            ++started;
+            return i * 2;
+        });
+        // the only worker is running this thread
+        EXPECT_EQ(0, started);
+        std::size_t sum = 0;
+        for (auto& f : futures) {
+            sum += f.get();
+        }
+        return sum;
+    });
+    ASSERT_EQ(999u * 1000u, future.get());
+    ASSERT_EQ(1000, started);
+}
+
+TEST(Spawn, CreateThreadsFromForeignNativeThread) {
+
+    WorkerManager wm { 4 };
+    auto futures = detail::create_threads(wm, 1000, [](std::size_t i) {
+        return i;
+    });
+    wm.start_main_thread([](void*) {}, nullptr);
+    for (std::size_t i = 0; i < futures.size(); ++i) {
+        ASSERT_EQ(i, futures[i].get());
+    }
+}
+
+TEST(StackSize, SizeClass) {
+
+    using Allocator = detail::SizeClassStackAllocator;
+    ASSERT_EQ(0x1000u, Allocator::size_of_class(Allocator::size_class_of(1)));
+    ASSERT_EQ(0x1000u, Allocator::size_of_class(Allocator::size_class_of(0x1000)));
+    ASSERT_EQ(0x2000u, Allocator::size_of_class(Allocator::size_class_of(0x1001)));
+    ASSERT_EQ(std::size_t(Allocator::max_stack_size), Allocator::size_of_class(Allocator::size_class_of(~std::size_t(0))));
+}
+
+TEST(StackSize, StackIsRecycledInSizeClass) {
+
+    using Allocator = detail::SizeClassStackAllocator;
+    char* p;
+    {
+        auto stack = Allocator::allocate(0x3000);
+        ASSERT_EQ(0x4000u, stack.size);
+        p = stack.stack.get();
+    }
+    auto small = Allocator::allocate(0x1000);
+    ASSERT_NE(p, small.stack.get());
+    auto same_class = Allocator::allocate(0x4000);
+    ASSERT_EQ(p, same_class.stack.get());
+}
+
+TEST(StackSize, CreateThreadWithStackSize) {
+
+    WorkerManager wm { 2 };
+    auto future = detail::start_main_thread(wm, [&wm]() {
+        ThreadAttributes small;
+        small.stack_size = 0x1000;
+        ThreadAttributes large;
+        large.stack_size = 0x80000;
+        auto f1 = detail::create_thread(wm, small, [](int i) {
+            return i + 1;
+        }, 1);
+        // too deep for the default stack
+        auto f2 = detail::create_thread(wm, large, [](unsigned int n) {
+            rec(n);
+            return n;
+        }, 64u);
+        while (f1.wait_for(std::chrono::seconds(0)) != std::future_status::ready
+                || f2.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            wm.scheduling_yield();
+        }
+        return f1.get() + f2.get();
+    });
+    ASSERT_EQ(66u, future.get());
+}
+
+TEST(StackSize, StackIsAcquiredAtLaunch) {
+
+    using Traits = detail::BadDesignContextTraits;
+    Traits::ThreadData native {nullptr, nullptr};
+    Traits::init_native_context(native);
+
+    char* stack_at_launch = nullptr;
+    bool local_is_on_stack = false;
+    Traits::Context ctx = nullptr;
+    ctx = Traits::make_context([&](Traits::Context) {
+        const char local = 0;
+        stack_at_launch = ctx->get_stack();
+        local_is_on_stack = stack_at_launch < &local && &local < stack_at_launch + ctx->get_stack_size();
+        return &native;
+    }, 0x8000);
+    ASSERT_EQ(nullptr, ctx->get_stack());
+
+    Traits::switch_context(&native, ctx);
+    ASSERT_TRUE(Traits::is_finished(ctx));
+    ASSERT_NE(nullptr, stack_at_launch);
+    ASSERT_TRUE(local_is_on_stack);
+    Traits::destroy_context(ctx);
+
+    // never launched, so never given a stack
+    Traits::Context discarded = Traits::make_context([&](Traits::Context) {
+        return &native;
+    });
+    ASSERT_EQ(nullptr, discarded->get_stack());
+    Traits::discard_context(discarded);
+}
+
+#ifndef USE_SPLITSTACKS
+
+TEST(StackSize, FailedStackAllocationIsReportedToTheFuture) {
+
+    WorkerManager wm { 1 };
+    detail::start_main_thread(wm, [&wm]() {
+        constexpr std::size_t stack_size = detail::SizeClassStackAllocator::max_stack_size;
+        ThreadAttributes attributes;
+        attributes.stack_size = stack_size;
+
+        std::size_t pages;
+        std::ifstream("/proc/self/statm") >> pages;
+        rlimit saved;
+        ASSERT_EQ(0, ::getrlimit(RLIMIT_AS, &saved));
+        rlimit limited = saved;
+        // too small for the stack of the child, which is allocated when the parent switches to it
+        limited.rlim_cur = pages * ::sysconf(_SC_PAGESIZE) + stack_size / 2;
+        ASSERT_EQ(0, ::setrlimit(RLIMIT_AS, &limited));
+        auto future = detail::create_thread(wm, attributes, []() {
+            return 1;
+        });
+        ASSERT_EQ(0, ::setrlimit(RLIMIT_AS, &saved));
+
+        ASSERT_THROW(future.get(), std::bad_alloc);
+        // the worker is intact
+        ASSERT_EQ(2, detail::create_thread(wm, []() {
+            return 2;
+        }).get());
+    });
+}
+
+#endif
+
+struct CountDestruction {
+    static std::atomic_int destructed;
+    int value = 0;
+    ~CountDestruction() {
+        ++destructed;
+    }
+};
+std::atomic_int CountDestruction::destructed {0};
+
+TEST(FiberLocal, ValuesAreLocalToUserThreads) {
+
+    WorkerManager wm { 4 };
+    CountDestruction::destructed = 0;
+    const int thread_size = 16;
+    std::atomic_int ok {0};
+    FiberLocal<CountDestruction> local;
+    detail::start_main_thread(wm, [&]() {
+        for (int i = 0; i < thread_size; ++i) {
+            detail::create_thread(wm, [&](int i) {
+                local->value = i;
+                fiber_local_slot(0) = &ok;
+                for (int n = 0; n < 100; ++n) {
+                    // may migrate to another worker
+                    wm.scheduling_yield();
+                    if (local->value != i || fiber_local_slot(0) != &ok) {
+                        return;
+                    }
+                }
+                ++ok;
+            }, i);
+        }
+    });
+    ASSERT_EQ(thread_size, ok);
+    ASSERT_EQ(thread_size, CountDestruction::destructed);
+}
+
+TEST(FiberLocal, DeletedKeysAreReusedWithoutStaleValues) {
+
+    WorkerManager wm { 1 };
+    detail::start_main_thread(wm, [&]() {
+        int stale = 0;
+        const FiberLocalKey first = create_fiber_local_key();
+        set_fiber_local(first, &stale);
+        delete_fiber_local_key(first);
+
+        // more than FiberLocalKeyRegistry::max_keys over the process lifetime
+        for (int i = 0; i < 4096; ++i) {
+            FiberLocal<int> local;
+            static_cast<void>(local);
+        }
+
+        const FiberLocalKey reused = create_fiber_local_key();
+        ASSERT_EQ(first, reused);
+        ASSERT_EQ(nullptr, get_fiber_local(reused));
+        delete_fiber_local_key(reused);
+    });
+}
+
+TEST(FiberLocal, NotUserThread) {
+
+    ASSERT_THROW(get_fiber_local(0), std::logic_error);
+}
+
+TEST(StackProfile, HistogramBucket) {
+
+    ASSERT_EQ(0u, StackUsageHistogram::bucket_of(1));
+    ASSERT_EQ(10u, StackUsageHistogram::bucket_of(1024));
+    ASSERT_EQ(11u, StackUsageHistogram::bucket_of(1025));
+    ASSERT_LE(1025u, StackUsageHistogram::bucket_upper_bound(StackUsageHistogram::bucket_of(1025)));
+}
+
+#ifdef ORKS_USERTHREAD_STACK_PROFILE
+
+void rec_for_stack_profile(void*) {
+    rec(1);
+}
+
+TEST(StackProfile, RecordHighWatermark) {
+
+    reset_stack_usage_profile();
+    set_stack_usage_profile_by_spawn_site(true);
+    WorkerManager wm { 2 };
+    wm.start_main_thread([](void* arg) {
+        static_cast<WorkerManager*>(arg)->start_thread(rec_for_stack_profile, nullptr);
+    }, &wm);
+    set_stack_usage_profile_by_spawn_site(false);
+
+    const auto profile = get_stack_usage_profile();
+    ASSERT_EQ(2u, profile.all.number_of_threads);
+    // rec() has 4KiB local array
+    ASSERT_LE(0x1000u, profile.all.max_used);
+
+    const auto site = profile.by_spawn_site.find(reinterpret_cast<const void*>(rec_for_stack_profile));
+    ASSERT_NE(profile.by_spawn_site.end(), site);
+    ASSERT_EQ(1u, site->second.number_of_threads);
+    ASSERT_LE(0x1000u, site->second.max_used);
+}
+
+#endif
+
+TEST(Preemption, SpinningThreadIsPreempted) {
+
+    WorkerManager wm { 1 };
+    wm.enable_preemption(std::chrono::milliseconds(1));
+    std::atomic_bool flag {false};
+    detail::start_main_thread(wm, [&]() {
+        // child is run first and spins until main thread set flag
+        detail::create_thread(wm, [&]() {
+            while (!flag) {
+                wm.preemption_point();
+            }
+        });
+        flag = true;
+    });
+    ASSERT_TRUE(flag);
+}
+
+TEST(Preemption, PreemptionPointWithoutPreemption) {
+
+    WorkerManager wm { 1 };
+    std::atomic_int i {0};
+    detail::start_main_thread(wm, [&]() {
+        for (int n = 0; n < 1000; ++n) {
+            wm.preemption_point();
+            ++i;
+        }
+    });
+    ASSERT_EQ(1000, i);
+}
+
+TEST(Sync, EventWaitSuspendsUserThread) {
+
+    WorkerManager wm { 1 };
+    auto future = detail::start_main_thread(wm, [&wm]() {
+        Event event;
+        // child is run first and suspended. blocking the only worker would deadlock.
+        auto child = detail::create_thread(wm, [&event]() {
+            return event.wait();
+        });
+        event.set();
+        return child.get();
+    });
+    ASSERT_EQ(WaitStatus::ready, future.get());
+}
+
+TEST(Sync, SleepForAndFutureWaitFor) {
+
+    WorkerManager wm { 2 };
+    detail::start_main_thread(wm, [&wm]() {
+        auto start = std::chrono::steady_clock::now();
+        ASSERT_EQ(WaitStatus::ready, sleep_for(std::chrono::milliseconds(10)));
+        ASSERT_LE(std::chrono::milliseconds(10), std::chrono::steady_clock::now() - start);
+
+        Event event;
+        auto child = detail::create_thread(wm, [&event]() {
+            event.wait();
+        });
+        ASSERT_EQ(std::future_status::timeout, child.wait_for(std::chrono::milliseconds(1)));
+        event.set();
+        ASSERT_EQ(std::future_status::ready, child.wait_for(std::chrono::seconds(10)));
+    });
+}
+
+TEST(Sync, WokenThreadReturnsToLastWorker) {
+
+    // posted threads are never stolen without the watchdog, so all of them return while the others steal
+    WorkerManager wm { 4 };
+    auto future = detail::start_main_thread(wm, [&wm]() {
+        Event event;
+        std::atomic_int waiting {0};
+        auto children = detail::create_threads(wm, 16, [&event, &waiting](std::size_t) {
+            auto worker = detail::find_worker_of_this_native_thread();
+            ++waiting;
+            event.wait();
+            return worker == detail::find_worker_of_this_native_thread();
+        });
+        while (waiting != 16) {
+            wm.scheduling_yield();
+        }
+        // woken from a native thread that is not a worker
+        std::thread([&event]() {
+            event.set();
+        }).join();
+        int returned = 0;
+        for (auto& child : children) {
+            returned += child.get() ? 1 : 0;
+        }
+        return returned;
+    });
+    ASSERT_EQ(16, future.get());
+}
+
+TEST(Sync, WhenAllAndWhenAny) {
+
+    WorkerManager wm { 4 };
+    detail::start_main_thread(wm, [&wm]() {
+        Event go;
+        std::vector<Future<int>> futures;
+        for (int i = 0; i < 8; ++i) {
+            futures.push_back(detail::create_thread(wm, [&go, i]() {
+                if (i != 5) {
+                    go.wait();
+                }
+                return i;
+            }));
+        }
+        auto first = when_any(futures.begin(), futures.end());
+        ASSERT_EQ(5, first->get());
+
+        go.set();
+        ASSERT_EQ(WaitStatus::ready, when_all(futures.begin(), futures.end()));
+        for (std::size_t i = 0; i < futures.size(); ++i) {
+            ASSERT_TRUE(futures[i].is_ready());
+        }
+        // already ready
+        ASSERT_EQ(futures.begin(), when_any(futures.begin(), futures.end()));
+        ASSERT_EQ(futures.end(), when_any(futures.end(), futures.end()));
+    });
+}
+
+int task_group_fib(WorkerManager& wm, int n) {
+    if (n < 2) {
+        return n;
+    }
+    int x, y;
+    TaskGroup group { wm };
+    group.run([&wm, &x, n]() {
+        x = task_group_fib(wm, n - 1);
+    });
+    y = task_group_fib(wm, n - 2);
+    group.wait();
+    return x + y;
+}
+
+TEST(TaskGroup, ForkJoin) {
+
+    WorkerManager wm { 4 };
+    const auto before = wm.get_scheduler_counters();
+    auto future = detail::start_main_thread(wm, [&wm]() {
+        return task_group_fib(wm, 20);
+    });
+    ASSERT_EQ(6765, future.get());
+    // only stolen children, and children past half of a stack, got a thread
+    ASSERT_GT(10946u, wm.get_scheduler_counters().switches - before.switches);
+}
+
+void task_group_chain(WorkerManager& wm, int n) {
+    if (n == 0) {
+        return;
+    }
+    TaskGroup group { wm };
+    group.run([&wm, n]() {
+        task_group_chain(wm, n - 1);
+    });
+    group.wait();
+}
+
+TEST(TaskGroup, DeepRecursionMovesToNewStacks) {
+
+    // one worker: no thief keeps the recursion shallow
+    WorkerManager wm { 1 };
+    detail::start_main_thread(wm, [&wm]() {
+        task_group_chain(wm, 1000);
+    });
+}
+
+TEST(TaskGroup, RunAfterShutdownIsNotWaited) {
+
+    WorkerManager wm { 1 };
+    wm.shutdown();
+    TaskGroup group { wm };
+    ASSERT_THROW(group.run([]() {
+    }), std::logic_error);
+    // the child was rolled back: nothing to wait, and nothing reported
+    group.wait();
+}
+
+TEST(TaskGroup, RethrowsFirstExceptionAndRunsQueuedChildrenInline) {
+
+    WorkerManager wm { 1 };
+    detail::start_main_thread(wm, [&wm]() {
+        TaskGroup group { wm };
+        std::atomic<int> count { 0 };
+        auto waiter = detail::get_current_thread();
+        for (int i = 0; i < 10; ++i) {
+            group.run([&count, waiter, i]() {
+                // the only worker keeps running the waiter, which runs the queued children
+                ASSERT_EQ(waiter, detail::get_current_thread());
+                ++count;
+                if (i == 3) {
+                    throw std::runtime_error("child");
+                }
+            });
+        }
+        ASSERT_THROW(group.wait(), std::runtime_error);
+        ASSERT_EQ(10, count);
+
+        // reusable after wait()
+        group.run([&count]() {
+            ++count;
+        });
+        group.wait();
+        ASSERT_EQ(11, count);
+    });
+}
+
+int lazy_fib(WorkerManager& wm, int n) {
+    if (n < 2) {
+        return n;
+    }
+    int x, y;
+    detail::parallel_invoke(wm, [&wm, &x, n]() {
+        x = lazy_fib(wm, n - 1);
+    }, [&wm, &y, n]() {
+        y = lazy_fib(wm, n - 2);
+    });
+    return x + y;
+}
+
+TEST(ParallelInvoke, LazyFib) {
+
+    WorkerManager wm { 4 };
+    const auto before = wm.get_scheduler_counters();
+    auto future = detail::start_main_thread(wm, [&wm]() {
+        return lazy_fib(wm, 20);
+    });
+    ASSERT_EQ(6765, future.get());
+    // far fewer threads than calls: only stolen calls, and calls past half of a stack, got a thread
+    ASSERT_GT(10946u, wm.get_scheduler_counters().switches - before.switches);
+}
+
+// recursion in the function called inline after g() at odd depths, and in g() at even depths
+void lazy_chain(WorkerManager& wm, int n) {
+    if (n == 0) {
+        return;
+    }
+    auto next = [&wm, n]() {
+        lazy_chain(wm, n - 1);
+    };
+    auto leaf = []() {
+    };
+    if (n % 2) {
+        detail::parallel_invoke(wm, next, leaf);
+    } else {
+        detail::parallel_invoke(wm, leaf, next);
+    }
+}
+
+TEST(ParallelInvoke, DeepRecursionMovesToNewStacks) {
+
+    // one worker: no thief keeps the recursion shallow
+    WorkerManager wm { 1 };
+    detail::start_main_thread(wm, [&wm]() {
+        lazy_chain(wm, 1000);
+    });
+}
+
+TEST(ParallelInvoke, FailedStealLeavesWorkToPusher) {
+
+    WorkerManager wm { 1 };
+    detail::start_main_thread(wm, [&wm]() {
+        struct FailingWork : detail::LazyWork<detail::Work> {
+            std::atomic<int> attempts { 0 };
+        } work;
+        work.make = [](detail::LazyWork<detail::Work>& self) -> detail::Work {
+            ++static_cast<FailingWork&>(self).attempts;
+            throw std::bad_alloc();
+        };
+        wm.push_lazy_work(work);
+        // the only worker is idle while this sleeps, and fails to take the work
+        detail::sleep_for(std::chrono::milliseconds(10));
+        ASSERT_LT(0, work.attempts);
+        ASSERT_TRUE(wm.withdraw_lazy_work(work));
+    });
+}
+
+TEST(ParallelInvoke, StolenWhileCallerIsSuspended) {
+
+    WorkerManager wm { 1 };
+    detail::start_main_thread(wm, [&wm]() {
+        auto caller = detail::get_current_thread();
+        detail::Work runner = nullptr;
+        // the only worker is idle while the caller sleeps, and takes the first function
+        detail::parallel_invoke(wm, [&runner]() {
+            runner = detail::get_current_thread();
+        }, []() {
+            detail::sleep_for(std::chrono::milliseconds(10));
+        });
+        ASSERT_NE(nullptr, runner);
+        ASSERT_NE(caller, runner);
+
+        // not stolen: called inline
+        detail::parallel_invoke(wm, [&runner]() {
+            runner = detail::get_current_thread();
+        }, []() {
+        });
+        ASSERT_EQ(caller, runner);
+
+        ASSERT_THROW(detail::parallel_invoke(wm, []() {
+            throw std::runtime_error("f");
+        }, []() {
+            detail::sleep_for(std::chrono::milliseconds(1));
+        }), std::runtime_error);
+    });
+}
+
+TEST(Pipeline, SerialStagesAndBoundedTokens) {
+
+    WorkerManager wm { 4 };
+    detail::start_main_thread(wm, [&wm]() {
+        constexpr int number_of_items = 1000;
+        constexpr std::size_t max_tokens = 8;
+        int next = 0;
+        std::atomic<std::size_t> in_flight { 0 };
+        std::atomic<std::size_t> max_in_flight { 0 };
+        std::atomic<int> in_exclusive { 0 };
+        std::vector<int> output;
+
+        auto source = make_filter<void, int>(FilterMode::serial_in_order, [&](FlowControl & fc) {
+            if (next == number_of_items) {
+                fc.stop();
+                return 0;
+            }
+            std::size_t n = ++in_flight;
+            std::size_t max = max_in_flight;
+            while (n > max && !max_in_flight.compare_exchange_weak(max, n)) {
+            }
+            return next++;
+        });
+        auto square = make_filter<int, long>(FilterMode::parallel, [](int i) {
+            return static_cast<long>(i) * i;
+        });
+        auto exclusive = make_filter<long, long>(FilterMode::serial_out_of_order, [&](long x) {
+            EXPECT_EQ(1, ++in_exclusive);
+            --in_exclusive;
+            return x;
+        });
+        auto sink = make_filter<long, void>(FilterMode::serial_in_order, [&](long x) {
+            output.push_back(static_cast<int>(x % 1000003));
+            --in_flight;
+        });
+        run_pipeline(wm, max_tokens, source & square & exclusive & sink);
+
+        ASSERT_EQ(static_cast<std::size_t>(number_of_items), output.size());
+        for (int i = 0; i < number_of_items; ++i) {
+            ASSERT_EQ(static_cast<int>(static_cast<long>(i) * i % 1000003), output[i]);
+        }
+        ASSERT_GE(max_tokens, max_in_flight);
+    });
+}
+
+TEST(Pipeline, ExceptionStopsSource) {
+
+    WorkerManager wm { 2 };
+    detail::start_main_thread(wm, [&wm]() {
+        int next = 0;
+        std::vector<int> output;
+        auto source = make_filter<void, int>(FilterMode::serial_in_order, [&](FlowControl&) {
+            return next++;
+        });
+        auto fail = make_filter<int, int>(FilterMode::parallel, [](int i) {
+            if (i == 100) {
+                throw std::runtime_error("filter");
+            }
+            return i;
+        });
+        auto sink = make_filter<int, void>(FilterMode::serial_in_order, [&](int i) {
+            output.push_back(i);
+        });
+        ASSERT_THROW(run_pipeline(wm, 4, source & fail & sink), std::runtime_error);
+        // items after the failed one may pass, but in order
+        for (std::size_t i = 1; i < output.size(); ++i) {
+            ASSERT_LT(output[i - 1], output[i]);
+        }
+    });
+}
+
+namespace {
+struct TreeNode {
+    std::unique_ptr<TreeNode> left;
+    // not copyable, so that values are only passed by address
+    std::unique_ptr<int> value;
+    std::unique_ptr<TreeNode> right;
+};
+
+std::unique_ptr<TreeNode> make_tree(int begin, int end) {
+    if (begin == end) {
+        return nullptr;
+    }
+    const int middle = begin + (end - begin) / 2;
+    return std::unique_ptr<TreeNode>(new TreeNode {
+        make_tree(begin, middle), std::unique_ptr<int>(new int(middle)), make_tree(middle + 1, end)
+    });
+}
+
+void walk_in_order(TreeNode* node, Generator<std::unique_ptr<int>>::Yield& yield) {
+    if (node) {
+        walk_in_order(node->left.get(), yield);
+        yield(node->value);
+        walk_in_order(node->right.get(), yield);
+    }
+}
+
+Generator<std::unique_ptr<int>> in_order(TreeNode* root) {
+    return Generator<std::unique_ptr<int>>([root](Generator<std::unique_ptr<int>>::Yield & yield) {
+        walk_in_order(root, yield);
+    });
+}
+}
+
+TEST(Generator, TreeTraversal) {
+
+    auto tree = make_tree(0, 100);
+    auto check = [&tree]() {
+        int expected = 0;
+        for (auto& value : in_order(tree.get())) {
+            ASSERT_EQ(expected++, *value);
+        }
+        ASSERT_EQ(100, expected);
+    };
+
+    // a native thread
+    check();
+
+    WorkerManager wm { 2 };
+    detail::start_main_thread(wm, [&]() {
+        auto self = detail::get_current_thread();
+        check();
+        // the body runs as a part of the consumer, and can suspend it
+        Generator<int> sleepy([self](Generator<int>::Yield & yield) {
+            for (int i = 0; i < 3; ++i) {
+                EXPECT_EQ(self, detail::get_current_thread());
+                detail::sleep_for(std::chrono::milliseconds(1));
+                yield(i);
+            }
+        });
+        int sum = 0;
+        for (int i : sleepy) {
+            sum += i;
+        }
+        ASSERT_EQ(3, sum);
+    }).get();
+}
+
+TEST(Generator, EarlyDestructionAndExceptions) {
+
+    int destructed = 0;
+    struct Guard {
+        int& destructed;
+        ~Guard() {
+            ++destructed;
+        }
+    };
+    auto counting = [&destructed](Generator<int>::Yield & yield) {
+        Guard guard { destructed };
+        for (int i = 0;; ++i) {
+            yield(i);
+        }
+    };
+    {
+        Generator<int> never_started(counting);
+    }
+    ASSERT_EQ(0, destructed);
+    {
+        Generator<int> g(counting);
+        auto it = g.begin();
+        ++it;
+        ASSERT_EQ(1, *it);
+        Generator<int> moved(std::move(g));
+        ASSERT_EQ(0, destructed);
+    }
+    // unwound at destruction
+    ASSERT_EQ(1, destructed);
+
+    Generator<int> failing([](Generator<int>::Yield & yield) {
+        yield(1);
+        throw std::runtime_error("generator");
+    });
+    auto it = failing.begin();
+    ASSERT_EQ(1, *it);
+    ASSERT_THROW(++it, std::runtime_error);
+}
+
+TEST(Handoff, RequestAndReplyInOneSwitchEach) {
+
+    for (unsigned workers : {1u, 4u}) {
+        WorkerManager wm { workers };
+        detail::start_main_thread(wm, [&wm, workers]() {
+            constexpr int number_of_requests = 100;
+            HandoffPoint client;
+            HandoffPoint server;
+            auto served = detail::create_thread(wm, [client, server]() mutable {
+                int count = 0;
+                int reply = 0;
+                for (int* request = static_cast<int*>(server.wait()); *request >= 0; ++count) {
+                    reply = *request * 2;
+                    request = static_cast<int*>(client.yield_to_and_wait(&reply, server));
+                }
+                return count;
+            });
+
+            // the first handoff waits for the server to start waiting
+            int request = 0;
+            ASSERT_EQ(0, *static_cast<int*>(server.yield_to_and_wait(&request, client)));
+            const auto before = wm.get_scheduler_counters();
+            for (request = 1; request < number_of_requests; ++request) {
+                ASSERT_EQ(request * 2, *static_cast<int*>(server.yield_to_and_wait(&request, client)));
+            }
+            if (workers == 1) {
+                ASSERT_EQ(before.switches + 2 * (number_of_requests - 1), wm.get_scheduler_counters().switches);
+            }
+
+            ASSERT_THROW(client.yield_to_and_wait(&request, client), std::invalid_argument);
+            request = -1;
+            server.yield_to(&request);
+            ASSERT_EQ(number_of_requests, served.get());
+        });
+    }
+}
+
+TEST(Handoff, WaitsAreCancellable) {
+
+    WorkerManager wm { 2 };
+    detail::start_main_thread(wm, [&wm]() {
+        ThreadAttributes attributes;
+        attributes.cancellation_token = CancellationToken::create();
+        HandoffPoint nobody_yields;
+        HandoffPoint nobody_waits;
+        auto receiver = detail::create_thread(wm, attributes, [nobody_yields]() mutable {
+            nobody_yields.wait();
+        });
+        auto sender = detail::create_thread(wm, attributes, [nobody_waits]() mutable {
+            nobody_waits.yield_to(nullptr);
+        });
+        attributes.cancellation_token.cancel();
+        ASSERT_THROW(receiver.get(), OperationCancelled);
+        ASSERT_THROW(sender.get(), OperationCancelled);
+    });
+}
+
+#ifndef USE_SPLITSTACKS
+
+TEST(SharedStack, FramesAreKeptWhileSwitchedOut) {
+
+    WorkerManager wm { 2 };
+    detail::start_main_thread(wm, [&wm]() {
+        constexpr int number_of_threads = 100;
+        constexpr int frame_size = 256;
+        ThreadAttributes attributes;
+        attributes.shared_stack = true;
+        Event go;
+        std::vector<const void*> addresses(number_of_threads);
+        std::atomic<int> intact { 0 };
+        std::vector<Future<void>> futures;
+        for (int i = 0; i < number_of_threads; ++i) {
+            futures.push_back(detail::create_thread(wm, attributes, [&, i]() {
+                int frame[frame_size];
+                for (int k = 0; k < frame_size; ++k) {
+                    frame[k] = i * frame_size + k;
+                }
+                addresses[i] = frame;
+                for (int r = 0; r < 3; ++r) {
+                    wm.scheduling_yield();
+                }
+                go.wait();
+                detail::sleep_for(std::chrono::milliseconds(1));
+                bool ok = true;
+                for (int k = 0; k < frame_size; ++k) {
+                    ok = ok && frame[k] == i * frame_size + k;
+                }
+                intact += ok;
+            }));
+        }
+        go.set();
+        for (auto& future : futures) {
+            future.get();
+        }
+        ASSERT_EQ(number_of_threads, intact);
+        // every thread ran on the same stack of its worker
+        ASSERT_GE(2u, std::set<const void*>(addresses.begin(), addresses.end()).size());
+    });
+}
+
+#endif
+
+TEST(WorkerManager, PinnedThreadsStayOnTheirWorker) {
+
+    WorkerManager wm { 2 };
+    detail::start_main_thread(wm, [&wm]() {
+        ASSERT_EQ(2u, wm.get_number_of_workers());
+        std::vector<Future<detail::Worker*>> futures;
+        for (unsigned i = 0; i < 8; ++i) {
+            futures.push_back(detail::create_thread_on(wm, i % 2, [&wm]() {
+                detail::Worker* worker = detail::find_worker_of_this_native_thread();
+                for (int r = 0; r < 20; ++r) {
+                    wm.scheduling_yield();
+                    detail::sleep_for(std::chrono::microseconds(100));
+                    EXPECT_EQ(worker, detail::find_worker_of_this_native_thread());
+                }
+                return worker;
+            }));
+        }
+        // unpinned threads are still stolen meanwhile
+        auto others = detail::create_threads(wm, 8, [&wm](std::size_t) {
+            wm.scheduling_yield();
+        });
+        for (auto& other : others) {
+            other.get();
+        }
+
+        std::vector<detail::Worker*> workers;
+        for (auto& future : futures) {
+            workers.push_back(future.get());
+        }
+        for (unsigned i = 2; i < workers.size(); ++i) {
+            ASSERT_EQ(workers[i % 2], workers[i]);
+        }
+        ASSERT_NE(workers[0], workers[1]);
+        ASSERT_THROW(detail::create_thread_on(wm, 2, []() {
+        }), std::out_of_range);
+    });
+}
+
+TEST(Watchdog, ReportsHogAndRescuesQueuedThreads) {
+
+    WorkerManager wm { 2 };
+    std::mutex mutex;
+    std::vector<HogReport> reports;
+    wm.enable_watchdog(std::chrono::milliseconds(10), [&](const HogReport & report) {
+        std::lock_guard<std::mutex> lock(mutex);
+        reports.push_back(report);
+    });
+
+    std::atomic<const void*> hog_thread { nullptr };
+    std::atomic_bool sleeper_finished { false };
+    bool finished_during_hog = false;
+    auto hog = [&wm, &hog_thread, &sleeper_finished, &finished_during_hog]() {
+        hog_thread = detail::get_current_thread();
+        // likely woken while its worker is hogged below
+        detail::create_thread(wm, [&sleeper_finished]() {
+            detail::sleep_for(std::chrono::milliseconds(30));
+            sleeper_finished = true;
+        });
+        const auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (!sleeper_finished && std::chrono::steady_clock::now() < give_up) {
+        }
+        finished_during_hog = sleeper_finished;
+    };
+    detail::start_main_thread(wm, [&wm, &hog]() {
+        wm.start_thread_function(hog);
+    });
+
+    ASSERT_TRUE(finished_during_hog);
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_FALSE(reports.empty());
+    const auto it = std::find_if(reports.begin(), reports.end(), [&hog_thread](const HogReport & report) {
+        return report.thread == hog_thread;
+    });
+    ASSERT_NE(reports.end(), it);
+    ASSERT_EQ(reinterpret_cast<const void*>(&detail::spawn_site_of<decltype(hog)>), it->spawn_site);
+    ASSERT_LE(std::chrono::steady_clock::duration(std::chrono::milliseconds(10)), it->running_for);
+}
+
+TEST(Cancellation, ChildTokenIsCancelledWithParent) {
+
+    auto parent = CancellationToken::create();
+    auto child = parent.create_child();
+    auto grandchild = child.create_child();
+    child.cancel();
+    ASSERT_FALSE(parent.is_cancelled());
+    ASSERT_TRUE(grandchild.is_cancelled());
+    parent.cancel();
+    ASSERT_TRUE(parent.create_child().is_cancelled());
+}
+
+TEST(Cancellation, WakesBlockedThreadsOfTree) {
+
+    WorkerManager wm { 2 };
+    detail::start_main_thread(wm, [&wm]() {
+        ThreadAttributes attributes;
+        attributes.cancellation_token = CancellationToken::create();
+        Event never_set;
+        Event spawned;
+        auto sleeping = detail::create_thread(wm, attributes, []() {
+            return sleep_for(std::chrono::seconds(100));
+        });
+        Future<WaitStatus> inherited;
+        auto waiting = detail::create_thread(wm, attributes, [&]() {
+            // token is inherited by grandchildren. it is sleeping when spawned is set.
+            inherited = detail::create_thread(wm, []() {
+                return sleep_for(std::chrono::seconds(100));
+            });
+            // not in the cancelled tree, so it is not ready until never_set is set
+            ThreadAttributes other_tree;
+            other_tree.cancellation_token = CancellationToken::create();
+            auto outside = detail::create_thread(wm, other_tree, [&never_set]() {
+                return never_set.wait();
+            });
+            spawned.set();
+
+            // the join of a cancelled thread is woken with OperationCancelled,
+            // or throws it at once if the thread was cancelled before the join
+            EXPECT_THROW(outside.get(), OperationCancelled);
+            never_set.set();
+            return outside;
+        });
+
+        spawned.wait();
+        ASSERT_FALSE(is_cancelled());
+        auto start = std::chrono::steady_clock::now();
+        attributes.cancellation_token.cancel();
+        ASSERT_EQ(WaitStatus::cancelled, sleeping.get());
+        ASSERT_EQ(WaitStatus::cancelled, inherited.get());
+        ASSERT_EQ(WaitStatus::ready, waiting.get().get());
+        ASSERT_GT(std::chrono::seconds(10), std::chrono::steady_clock::now() - start);
+    });
+}
+
+TEST(Cancellation, DiscardsThreadsNotStarted) {
+
+    WorkerManager wm { 1 };
+    std::atomic_int started {0};
+    detail::start_main_thread(wm, [&]() {
+        ThreadAttributes attributes;
+        attributes.cancellation_token = CancellationToken::create();
+        std::vector<Future<void>> futures;
+        for (int i = 0; i < 100; ++i) {
+            futures.push_back(detail::submit(wm, attributes, [&started]() {
+                ++started;
+            }));
+        }
+        attributes.cancellation_token.cancel();
+        for (auto& future : futures) {
+            ASSERT_THROW(future.get(), OperationCancelled);
+        }
+    });
+    ASSERT_EQ(0, started);
+}
+
+TEST(Admission, RunInlineAtLimit) {
+
+    WorkerManager wm { 1, AdmissionLimits { 2, AdmissionPolicy::run_inline } };
+    auto future = detail::start_main_thread(wm, [&wm]() {
+        auto main_thread = detail::get_current_thread();
+        auto futures = detail::create_threads(wm, 10, [main_thread](std::size_t) {
+            return detail::get_current_thread() == main_thread;
+        });
+        int number_of_inline = 0;
+        for (auto& f : futures) {
+            number_of_inline += f.get();
+        }
+        return number_of_inline;
+    });
+    ASSERT_EQ(8, future.get());
+    ASSERT_EQ(2u, wm.get_admission_counters().admitted);
+    ASSERT_EQ(8u, wm.get_admission_counters().run_inline);
+}
+
+TEST(Admission, FailFastAtLimit) {
+
+    WorkerManager wm { 1, AdmissionLimits { 1, AdmissionPolicy::fail } };
+    std::atomic_int counter {0};
+    detail::start_main_thread(wm, [&]() {
+        ASSERT_THROW(detail::create_threads(wm, 2, [&counter](std::size_t) {
+            ++counter;
+        }), AdmissionRejected);
+    });
+    // the admitted one is still run
+    ASSERT_EQ(1, counter);
+    ASSERT_EQ(1u, wm.get_admission_counters().rejected);
+}
+
+TEST(Admission, WaitSuspendsSpawner) {
+
+    WorkerManager wm { 2, AdmissionLimits { 1, AdmissionPolicy::wait } };
+    auto future = detail::start_main_thread(wm, [&wm]() {
+        Event event;
+        auto first = detail::create_thread(wm, [&event]() {
+            event.wait();
+            return 1;
+        });
+        std::thread setter([&event]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            event.set();
+        });
+        // suspended until first finished
+        auto second = detail::create_thread(wm, []() {
+            return 2;
+        });
+        const int result = first.get() + second.get();
+        setter.join();
+        return result;
+    });
+    ASSERT_EQ(3, future.get());
+    ASSERT_LE(1u, wm.get_admission_counters().waited);
+    ASSERT_EQ(2u, wm.get_admission_counters().admitted);
+}
+
+TEST(Admission, WaitingBatchPublishesAdmittedThreads) {
+
+    // the second thread of a batch waits for the first, which must not be held back by the batch
+    WorkerManager wm { 2, AdmissionLimits { 1, AdmissionPolicy::wait } };
+    auto future = detail::start_main_thread(wm, [&wm]() {
+        auto futures = detail::create_threads(wm, 4, [](std::size_t i) {
+            return i;
+        });
+        std::size_t sum = 0;
+        for (auto& f : futures) {
+            sum += f.get();
+        }
+        return sum;
+    });
+    ASSERT_EQ(6u, future.get());
+    ASSERT_EQ(4u, wm.get_admission_counters().admitted);
+}
+
+_Unwind_Reason_Code collect_ip(_Unwind_Context* context, void* arg) {
+    static_cast<std::vector<std::uintptr_t>*>(arg)->push_back(_Unwind_GetIP(context));
+    return _URC_NO_REASON;
+}
+
+TEST(Io, ReadWriteFromUserThreads) {
+
+    char path[] = "/tmp/user-thread-io-XXXXXX";
+    const int fd = ::mkstemp(path);
+    ASSERT_LE(0, fd);
+    constexpr std::size_t block_size = 4096;
+    constexpr int number_of_blocks = 16;
+
+    WorkerManager wm { 2 };
+    detail::start_main_thread(wm, [&]() {
+        auto writers = detail::create_threads(wm, number_of_blocks, [=](std::size_t i) {
+            std::vector<char> block(block_size, static_cast<char>('a' + i));
+            return write_at(fd, block.data(), block.size(), i * block_size);
+        });
+        for (auto& writer : writers) {
+            ASSERT_EQ(block_size, writer.get());
+        }
+        sync_file(fd);
+
+        // reopened through the ring, and read with registered file and buffer
+        const int reopened = open_at(AT_FDCWD, path, O_RDONLY);
+        std::vector<char> buffer(block_size * number_of_blocks);
+        register_io_files({ reopened });
+        register_io_buffers({ iovec { buffer.data(), buffer.size() } });
+        auto readers = detail::create_threads(wm, number_of_blocks, [&](std::size_t i) {
+            return read_at(RegisteredFile { 0 }, &buffer[i * block_size], block_size, i * block_size, 0);
+        });
+        for (auto& reader : readers) {
+            ASSERT_EQ(block_size, reader.get());
+        }
+        for (int i = 0; i < number_of_blocks; ++i) {
+            ASSERT_EQ(static_cast<char>('a' + i), buffer[i * block_size]);
+            ASSERT_EQ(static_cast<char>('a' + i), buffer[(i + 1) * block_size - 1]);
+        }
+        register_io_files({});
+        register_io_buffers({});
+        ::close(reopened);
+
+        char byte;
+        ASSERT_THROW(read_at(-1, &byte, 1, 0), std::system_error);
+    });
+    ::close(fd);
+    ::unlink(path);
+}
+
+#ifdef ORKS_USERTHREAD_IO_URING
+
+TEST(Io, CancellationCancelsRequestInKernel) {
+
+    int fds[2];
+    ASSERT_EQ(0, ::pipe(fds));
+
+    WorkerManager wm { 2 };
+    detail::start_main_thread(wm, [&]() {
+        ThreadAttributes attributes;
+        attributes.cancellation_token = CancellationToken::create();
+        char byte = 0;
+        // nothing is written to the pipe
+        auto reader = detail::create_thread(wm, attributes, [&]() {
+            return read_at(fds[0], &byte, 1, 0);
+        });
+        detail::sleep_for(std::chrono::milliseconds(10));
+        attributes.cancellation_token.cancel();
+        ASSERT_THROW(reader.get(), OperationCancelled);
+
+        // the cancelled read did not take the byte written later
+        const char written = 'x';
+        ASSERT_EQ(1u, write_at(fds[1], &written, 1, 0));
+        ASSERT_EQ(1u, read_at(fds[0], &byte, 1, 0));
+        ASSERT_EQ(written, byte);
+    });
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+#endif
+
+TEST(Unwind, BacktraceEndsAtRootFrameOfUserThread) {
+
+    WorkerManager wm { 2 };
+    auto future = detail::start_main_thread(wm, [&wm]() {
+        // unwind a thread that was switched out and resumed
+        auto child = detail::create_thread(wm, [&wm]() {
+            wm.scheduling_yield();
+            std::vector<std::uintptr_t> ips;
+            const auto reason = _Unwind_Backtrace(collect_ip, &ips);
+            return std::make_pair(reason, ips);
+        });
+        return child.get();
+    });
+    auto result = future.get();
+    ASSERT_EQ(_URC_END_OF_STACK, result.first);
+
+    // libgcc reports a frame with ip 0 after the outermost frame
+    auto& ips = result.second;
+    while (!ips.empty() && ips.back() == 0) {
+        ips.pop_back();
+    }
+    ASSERT_LE(3u, ips.size());
+
+    // the outermost frame is the root frame, found by its unwind info
+    void* root = reinterpret_cast<void*>(&orks_private_call_with_alt_stack_arg3_impl);
+    ASSERT_EQ(root, _Unwind_FindEnclosingFunction(reinterpret_cast<void*>(ips.back())));
+
+    void* setjmp = reinterpret_cast<void*>(&mysetjmp);
+    ASSERT_EQ(setjmp, _Unwind_FindEnclosingFunction(static_cast<char*>(setjmp) + 1));
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
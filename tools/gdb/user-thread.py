@@ -0,0 +1,95 @@
+# gdb helper for user threads.
+#
+# requires a build with -DORKS_USERTHREAD_THREAD_REGISTRY=ON.
+#
+#   (gdb) source tools/gdb/user-thread.py
+#   (gdb) info user-threads        # list live user threads
+#   (gdb) user-thread bt <index>   # backtrace of a switched out user thread
+#
+# `user-thread bt` temporarily loads the registers saved in ThreadData::env
+# into the selected native thread, so it works only on live processes, not on core files.
+# env of a thread running on a worker is stale. use `thread <n>` and `bt` for them.
+
+import gdb
+
+REGISTRY = 'orks::userthread::detail::baddesign::thread_registry'
+
+# layout of struct context in src/mysetjmp.h
+SAVED_REGISTERS = ['rbx', 'rsp', 'rbp', 'r12', 'r13', 'r14', 'r15', 'rip']
+
+
+def user_threads():
+    thread = gdb.parse_and_eval(REGISTRY)['head']
+    while int(thread) != 0:
+        yield thread
+        thread = thread['registry_next']
+
+
+def describe_address(address):
+    block = gdb.block_for_pc(address)
+    while block is not None and block.function is None:
+        block = block.superblock
+    if block is not None:
+        return block.function.print_name
+    return '0x%x' % address
+
+
+class InfoUserThreads(gdb.Command):
+    """List live user threads: index, ThreadData address, state, spawn site and saved pc."""
+
+    def __init__(self):
+        super(InfoUserThreads, self).__init__('info user-threads', gdb.COMMAND_STATUS)
+
+    def invoke(self, arg, from_tty):
+        for index, thread in enumerate(user_threads()):
+            state = str(thread['state']).split('::')[-1]
+            spawn_site = describe_address(int(thread['spawn_site']))
+            pc = 'not launched'
+            if state != 'before_launch':
+                pc = describe_address(int(thread['env']['regs'][7]))
+            print('%d  %s  %s  spawned at %s  pc %s' % (index, thread, state, spawn_site, pc))
+
+
+class UserThreadBacktrace(gdb.Command):
+    """Print the backtrace of a switched out user thread: user-thread bt INDEX"""
+
+    def __init__(self):
+        super(UserThreadBacktrace, self).__init__('user-thread bt', gdb.COMMAND_STACK)
+
+    def invoke(self, arg, from_tty):
+        index = int(gdb.parse_and_eval(arg))
+        thread = None
+        for i, t in enumerate(user_threads()):
+            if i == index:
+                thread = t
+                break
+        if thread is None:
+            raise gdb.GdbError('no user thread %d' % index)
+        if str(thread['state']).endswith('before_launch'):
+            print('user thread %d is not launched yet' % index)
+            return
+
+        regs = thread['env']['regs']
+        frame = gdb.selected_frame()
+        gdb.execute('select-frame 0')
+        saved = [(name, int(gdb.parse_and_eval('$' + name))) for name in SAVED_REGISTERS]
+        try:
+            for i, name in enumerate(SAVED_REGISTERS):
+                gdb.execute('set $%s = %d' % (name, int(regs[i])))
+            gdb.execute('bt')
+        finally:
+            for name, value in saved:
+                gdb.execute('set $%s = %d' % (name, value))
+            frame.select()
+
+
+class UserThreadPrefix(gdb.Command):
+    """Commands for user threads."""
+
+    def __init__(self):
+        super(UserThreadPrefix, self).__init__('user-thread', gdb.COMMAND_STACK, prefix=True)
+
+
+InfoUserThreads()
+UserThreadPrefix()
+UserThreadBacktrace()